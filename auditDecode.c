@@ -0,0 +1,216 @@
+/* ==================================================================================
+ * auditDecode: prints the records of binary log files (LOG_FORMAT = binary) as
+ * the text lines the logger would have written, so the output can be read, or
+ * given to traceReport and logQuery, like any text log file.
+ *
+ * Usage: ./auditDecode lockLog.log [more log files...]
+ * Build: gcc -std=gnu99 -I. auditDecode.c piLock.c -o auditDecode -lpthread -lrt
+ *
+ * Every block is checked against the CRC-32 in its header.  A damaged block is
+ * reported on stderr and skipped: the decoder looks for the next block header
+ * and carries on from there, so one bad sector only loses the messages of the
+ * blocks it covers.  Gaps in the sequence numbers of the blocks (e.g. a block
+ * that was never written before a power cut) are reported the same way.
+ * ================================================================================= */
+
+#include "piLock.h"
+
+static int decodeFile(const char* path);
+static int validBlock(const char* data, size_t size, size_t offset);
+static void printRecords(const char* records, int count, char* programName);
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s lockLog.log [more log files...]\n", argv[0]);
+		return 1;
+	}
+
+	int damaged = 0;
+	for (int file = 1; file < argc; ++file)
+	{
+		int result = decodeFile(argv[file]);
+		if (result < 0)
+		{
+			fprintf(stderr, "Could not read %s\n", argv[file]);
+			return 1;
+		}
+		damaged += result;
+	}
+
+	return (damaged > 0) ? 2 : 0;
+}
+
+/* =================================================
+ * This function prints every valid block of a log
+ * file and reports the damaged ones.
+ *
+ * @param: char* path
+ * @return: number of damaged blocks, -1 = error
+ * ============================================== */
+
+static int decodeFile(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) != 0)
+	{
+		return -1;
+	}
+
+	size_t size = (size_t) status.st_size;
+	if (size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	char programName[64] = "?";
+	uint32_t expected = 0;
+	int damaged = 0;
+	size_t offset = 0;
+
+	while (offset + sizeof(AuditBlockHeader) <= size)
+	{
+		if (!validBlock(data, size, offset))
+		{
+			// Skip to the next header whose records match its CRC
+			size_t next = offset + 1;
+			while (next + sizeof(AuditBlockHeader) <= size && !validBlock(data, size, next))
+			{
+				next++;
+			}
+			fprintf(stderr, "%s: %zu damaged bytes at offset %zu skipped\n", path, next - offset, offset);
+			damaged++;
+			offset = next;
+			continue;
+		}
+
+		AuditBlockHeader header;
+		memcpy(&header, data + offset, sizeof(header));
+
+		// Sequence numbers start again from 0 every time the logger opens the file
+		if (header.sequence != 0 && header.sequence != expected)
+		{
+			fprintf(stderr, "%s: blocks %u to %u are missing before offset %zu\n", path, expected, header.sequence - 1, offset);
+			damaged++;
+		}
+		expected = header.sequence + 1;
+
+		printRecords(data + offset + sizeof(AuditBlockHeader), header.records, programName);
+		offset += sizeof(AuditBlockHeader) + header.records * sizeof(AuditRecord);
+	}
+
+	if (offset < size)
+	{
+		fprintf(stderr, "%s: %zu bytes at the end are not a whole block\n", path, size - offset);
+		damaged++;
+	}
+
+	munmap((void*) data, size);
+	return damaged;
+}
+
+/* =================================================
+ * This function checks that a block header starts at
+ * the given offset and that its records match its
+ * CRC.
+ *
+ * @param: char* data, size_t size, size_t offset
+ * @return: 1 = valid block, 0 = not a block
+ * ============================================== */
+
+static int validBlock(const char* data, size_t size, size_t offset)
+{
+	AuditBlockHeader header;
+	memcpy(&header, data + offset, sizeof(header));
+
+	if (header.magic != AUDIT_BLOCK_MAGIC || header.version != 1 || header.records > AUDIT_BLOCK_RECORDS)
+	{
+		return 0;
+	}
+
+	size_t recordsLength = header.records * sizeof(AuditRecord);
+	if (offset + sizeof(AuditBlockHeader) + recordsLength > size)
+	{
+		return 0;
+	}
+	return crc32(0, data + offset + sizeof(AuditBlockHeader), recordsLength) == header.crc;
+}
+
+/* =================================================
+ * This function prints the records of one block as
+ * log lines: "<time> : <program> : <message>".  The
+ * program name is taken from the AUDIT_EVENT_PROGRAM
+ * record at the start of every log file.
+ *
+ * @param: char* records, int count, char* program name (updated)
+ * @return: void
+ * ============================================== */
+
+static void printRecords(const char* records, int count, char* programName)
+{
+	for (int i = 0; i < count; )
+	{
+		AuditRecord record;
+		memcpy(&record, records + i * sizeof(AuditRecord), sizeof(record));
+		const char* next = records + (i + 1) * sizeof(AuditRecord);
+		int remaining = count - i - 1;
+		i++;
+
+		struct timespec time;
+		char timeString[30];
+		time.tv_sec = (time_t) (record.time / 1000000ULL);
+		time.tv_nsec = (long) (record.time % 1000000ULL) * 1000L;
+		formatTime(&time, timeString);
+
+		if (record.event == AUDIT_EVENT_TEXT || record.event == AUDIT_EVENT_PROGRAM)
+		{
+			int textRecords = (record.length + sizeof(AuditRecord) - 1) / sizeof(AuditRecord);
+			if (textRecords > remaining)
+			{
+				break;
+			}
+			i += textRecords;
+
+			if (record.event == AUDIT_EVENT_PROGRAM)
+			{
+				snprintf(programName, 64, "%.*s", record.length, next);
+			}
+			else
+			{
+				printf("%s : %s : %.*s", timeString, programName, record.length, next);
+			}
+		}
+		else if (record.event == AUDIT_EVENT_TRACE)
+		{
+			uint64_t clocks[2];
+			if (remaining < 1)
+			{
+				break;
+			}
+			memcpy(clocks, next, sizeof(clocks));
+			i++;
+
+			printf("%s : %s : TRACE %08x %s %llu %llu\n", timeString, programName, record.argument,
+				(record.length < auditTraceStageCount) ? auditTraceStages[record.length] : "?",
+				(unsigned long long) clocks[0], (unsigned long long) clocks[1]);
+		}
+		else if (record.event >= AUDIT_EVENT_MESSAGE && record.event - AUDIT_EVENT_MESSAGE < auditMessageCount)
+		{
+			printf("%s : %s : %s", timeString, programName, auditMessages[record.event - AUDIT_EVENT_MESSAGE]);
+		}
+		else
+		{
+			printf("%s : %s : (unknown event %u)\n", timeString, programName, record.event);
+		}
+	}
+}
@@ -0,0 +1,156 @@
+/* ==================================================================================
+ * commFileBench: compares the two ways the lock has read the communication file
+ * while it is idle.  The old main loop reopened and read the file on every pass;
+ * the current one waits on a CommWatcher and only reads the file once it changed.
+ *
+ * Usage: ./commFileBench [seconds per mode] [milliseconds between commands]
+ * Build: gcc -std=gnu99 -O2 -I. bench/commFileBench.c piLock.c -o commFileBench
+ *            -Wl,--wrap=fopen -lpthread -lrt
+ *
+ * A writer thread writes a new command to a communication file in a temporary
+ * directory every interval, the way the key does.  The main thread reads the
+ * commands in each mode for the same time, and the bench prints the CPU time of
+ * the reading thread, the number of files it opened (fopen() is wrapped at link
+ * time to count them) and how long a command took to be seen.
+ * ================================================================================= */
+
+#include "piLock.h"
+#include <sys/resource.h> // getrusage()
+
+typedef struct BenchWriter
+{
+	char path[255];
+	int intervalMs;
+	atomic_int stop;
+	atomic_ullong writtenAt;		// CLOCK_MONOTONIC of the last write, in nanoseconds
+} BenchWriter;
+
+static __thread unsigned long fileOpens = 0;
+
+FILE* __real_fopen(const char* path, const char* mode);
+
+FILE* __wrap_fopen(const char* path, const char* mode)
+{
+	fileOpens++;
+	return __real_fopen(path, mode);
+}
+
+static unsigned long long monotonicNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static double threadCpuSeconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void* writeCommands(void* argument)
+{
+	BenchWriter* writer = argument;
+	int command = 0;
+
+	while (!atomic_load(&writer->stop))
+	{
+		usleep(writer->intervalMs * 1000);
+		command = !command;
+		atomic_store(&writer->writtenAt, monotonicNs());
+		writeCommunicationFile(writer->path, command, 0);
+	}
+	return NULL;
+}
+
+static void printResult(const char* mode, double seconds, double cpu, unsigned long opens, unsigned long seen, unsigned long long latencyNs)
+{
+	printf("%-18s cpu %6.3f s / %4.1f s (%5.1f%%)  file opens %9lu (%9.0f/s)  commands seen %3lu  mean latency %8.1f us\n",
+		mode, cpu, seconds, 100.0 * cpu / seconds, opens, opens / seconds, seen, seen ? latencyNs / 1000.0 / seen : 0.0);
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 5;
+	int intervalMs = argc > 2 ? atoi(argv[2]) : 500;
+	if (seconds <= 0 || intervalMs <= 0)
+	{
+		fprintf(stderr, "Usage: %s [seconds per mode] [milliseconds between commands]\n", argv[0]);
+		return 1;
+	}
+
+	char directory[] = "/tmp/commFileBenchXXXXXX";
+	if (mkdtemp(directory) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	BenchWriter writer;
+	snprintf(writer.path, sizeof(writer.path), "%s/commFile.txt", directory);
+	writer.intervalMs = intervalMs;
+	atomic_init(&writer.stop, 0);
+	atomic_init(&writer.writtenAt, 0);
+	writeCommunicationFile(writer.path, 0, 0);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, writeCommands, &writer);
+
+	// Old main loop: reopen the file on every pass, with nothing to wait on
+	unsigned long long end = monotonicNs() + seconds * 1000000000ULL;
+	unsigned long long latency = 0;
+	unsigned long seen = 0;
+	int last = 0;
+	double cpu = threadCpuSeconds();
+	unsigned long opens = fileOpens;
+
+	while (monotonicNs() < end)
+	{
+		int command = readCommunicationFile(writer.path, NULL);
+		if ((command == 0 || command == 1) && command != last)
+		{
+			latency += monotonicNs() - atomic_load(&writer.writtenAt);
+			seen++;
+			last = command;
+		}
+	}
+	printResult("reopen every loop", seconds, threadCpuSeconds() - cpu, fileOpens - opens, seen, latency);
+
+	// Current main loop: sleep on the watcher and only read the file once it changed
+	CommWatcher watcher;
+	if (initCommWatcher(&watcher, writer.path) != 0)
+	{
+		fprintf(stderr, "The communication file could not be watched\n");
+		return 1;
+	}
+
+	end = monotonicNs() + seconds * 1000000000ULL;
+	latency = 0;
+	seen = 0;
+	cpu = threadCpuSeconds();
+	opens = fileOpens;
+
+	while (monotonicNs() < end)
+	{
+		if (waitCommFileChange(&watcher, 100) == 1)
+		{
+			int command = readCommunicationFile(writer.path, NULL);
+			if ((command == 0 || command == 1) && command != last)
+			{
+				latency += monotonicNs() - atomic_load(&writer.writtenAt);
+				seen++;
+				last = command;
+			}
+		}
+	}
+	printResult(watcher.mode == COMM_WATCH_INOTIFY ? "inotify watcher" : "stat() timer", seconds,
+		threadCpuSeconds() - cpu, fileOpens - opens, seen, latency);
+	freeCommWatcher(&watcher);
+
+	atomic_store(&writer.stop, 1);
+	pthread_join(thread, NULL);
+	unlink(writer.path);
+	rmdir(directory);
+	return 0;
+}
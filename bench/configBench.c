@@ -0,0 +1,143 @@
+/* ==================================================================================
+ * configBench: writes a configuration file with every parameter and a given number
+ * of LOCK_ADDRESS lines, then times loadConfig() on it, and parseConfig() on the
+ * same text already in memory (loadConfig() minus opening and mapping the file).
+ * The shipped lockConfig.cfg is timed as well if it is given.
+ *
+ * Usage: ./configBench [locks] [iterations] [lockConfig.cfg]
+ *        ./configBench -w file [locks]    only write the generated file
+ * Build: gcc -std=gnu99 -O2 -I. bench/configBench.c piLock.c -o configBench
+ *            -lpthread -lrt
+ * ================================================================================= */
+
+#include "piLock.h"
+
+static int writeConfig(const char* path, int locks)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(file, "# Generated by configBench with %d LOCK_ADDRESS lines\n\n", locks);
+	fprintf(file, "WATCHDOG_TIMEOUT = 10\n\nDEFAULT_LOCK_STATE = 0\n\n");
+	fprintf(file, "COMMMUNICATION_FILE_PATH = /home/pi/raspShare/commFile.txt\n\n");
+	fprintf(file, "LOCK_LOG_FILE_PATH = /home/pi/raspShare/lockLog.log\n\nKEY_LOG_FILE_PATH = /home/pi/raspShare/keyLog.log\n\n");
+	fprintf(file, "LOG_FLUSH_INTERVAL = 100\n\nLOG_SUMMARY_INTERVAL = 60\n\nLOG_SEGMENT_SIZE = 1024\n\nLOG_SEGMENT_COUNT = 4\n\n");
+	fprintf(file, "LOG_COMPRESS = 0\n\nLOG_FORMAT = text\n\nCOMM_TRANSPORT = udp # commands go over the network\n\n");
+	fprintf(file, "SHM_FILE_PATH = /dev/shm/piLockComm\n\nSTATE_FILE_PATH = /home/pi/raspShare/lockState\n\n");
+	fprintf(file, "COMM_PORT = 5005\n\nCOMM_BIND_ADDRESS = 0.0.0.0\n\nCOMM_SECRET = generated-secret\n\n");
+	fprintf(file, "DEBOUNCE_TIME = 20\n\nCOMMAND_COALESCE_WINDOW = 1000\n\nGPIO_BACKEND = mmap\n\n");
+	fprintf(file, "GPIO_WAVEFORM_PATH = /home/pi/raspShare/wave.txt\n\n");
+	for (int i = 0; i < locks; ++i)
+	{
+		fprintf(file, "LOCK_ADDRESS = 10.%d.%d.%d:%d\n", (i >> 16) & 255, (i >> 8) & 255, (i & 255) + 1, 5005 + i % 100);
+	}
+	return fclose(file);
+}
+
+static double elapsedUs(const struct timespec* start, const struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int timeConfig(const char* name, const char* path, int iterations)
+{
+	static LockConfig settings;
+	struct timespec start, end;
+
+	setDefaultConfig(&settings);
+	if (loadConfig(path, &settings) != 0)
+	{
+		fprintf(stderr, "%s could not be read\n", path);
+		return -1;
+	}
+	int lockCount = settings.lockCount;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; ++i)
+	{
+		setDefaultConfig(&settings);
+		loadConfig(path, &settings);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double load = elapsedUs(&start, &end) / iterations;
+
+	// The same text parsed from memory
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		return -1;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+	char* text = malloc(length > 0 ? length : 1);
+	if (text == NULL || fread(text, 1, length, file) != (size_t) length)
+	{
+		fclose(file);
+		free(text);
+		return -1;
+	}
+	fclose(file);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; ++i)
+	{
+		setDefaultConfig(&settings);
+		parseConfig(text, length, &settings);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double parse = elapsedUs(&start, &end) / iterations;
+	free(text);
+
+	printf("%-24s %7ld bytes %4d locks  loadConfig() %8.2f us  parseConfig() %8.2f us  (%.1f ns per byte)\n",
+		name, length, lockCount, load, parse, parse * 1000.0 / (length > 0 ? length : 1));
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 2 && strcmp(argv[1], "-w") == 0)
+	{
+		int locks = argc > 3 ? atoi(argv[3]) : MAX_LOCKS;
+		if (locks < 0 || writeConfig(argv[2], locks) != 0)
+		{
+			fprintf(stderr, "%s could not be written\n", argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+
+	int locks = argc > 1 ? atoi(argv[1]) : MAX_LOCKS;
+	int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+	if (locks < 0 || locks > MAX_LOCKS || iterations <= 0)
+	{
+		fprintf(stderr, "Usage: %s [locks] [iterations] [lockConfig.cfg]\n       %s -w file [locks]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	char path[] = "/tmp/configBenchXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	char name[32];
+	int result = 0;
+	snprintf(name, sizeof(name), "generated, 0 locks");
+	result |= writeConfig(path, 0) | timeConfig(name, path, iterations);
+	snprintf(name, sizeof(name), "generated, %d locks", locks);
+	result |= writeConfig(path, locks) | timeConfig(name, path, iterations);
+	if (argc > 3)
+	{
+		result |= timeConfig(argv[3], argv[3], iterations);
+	}
+
+	unlink(path);
+	return result != 0;
+}
@@ -0,0 +1,223 @@
+/* ==================================================================================
+ * fleetBench: one key driving a fleet of locks over the udp transport on 127.0.0.1.
+ * The key end is the LockFleet of key.c; the locks are lock ends of the transport,
+ * one per port, all read by a second thread from one epoll instance.  Every command
+ * is sent to the whole fleet, and the bench prints how long the fleet took to
+ * acknowledge it, the acknowledgement latency of every lock, the time from the
+ * command to each lock seeing it, and the CPU time of both ends.
+ *
+ * Usage: ./fleetBench [locks] [commands] [milliseconds between commands] [first port]
+ * Build: gcc -std=gnu99 -O2 -I. bench/fleetBench.c piLock.c -o fleetBench -lpthread -lrt
+ *
+ * The communication file of the locks is not watched (a few hundred inotify
+ * instances would pass the usual per-user limit); it is only the fallback of the
+ * protocol, which loopback does not need.
+ * ================================================================================= */
+
+#include "piLock.h"
+#include <sys/resource.h> // getrusage(), setrlimit()
+
+typedef struct BenchLocks
+{
+	CommTransport* transports;
+	int count;
+	int epollFd;
+	atomic_int stop;
+	uint64_t* observeLatencies;		// CLOCK_REALTIME from the command to a lock seeing it, in nanoseconds
+	long observed;
+	long capacity;
+	double cpu;						// CPU time of the thread, in seconds
+} BenchLocks;
+
+typedef struct BenchKey
+{
+	uint64_t* ackLatencies;			// Acknowledgement latency of every lock for every command, in nanoseconds
+	long acks;
+	long capacity;
+} BenchKey;
+
+static uint64_t realtimeNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static double threadCpuSeconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+	uint64_t first = *(const uint64_t*) a, second = *(const uint64_t*) b;
+	return (first > second) - (first < second);
+}
+
+static void printLatencies(const char* name, uint64_t* latencies, long count)
+{
+	if (count == 0)
+	{
+		printf("%-26s none\n", name);
+		return;
+	}
+	qsort(latencies, count, sizeof(latencies[0]), compareLatency);
+	printf("%-26s %7ld  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", name, count, latencies[(count * 50 + 99) / 100 - 1] / 1e6,
+		latencies[(count * 99 + 99) / 100 - 1] / 1e6, latencies[count - 1] / 1e6);
+}
+
+static void* runLocks(void* argument)
+{
+	BenchLocks* locks = argument;
+	struct epoll_event events[64];
+	double start = threadCpuSeconds();
+
+	while (!atomic_load(&locks->stop))
+	{
+		int ready = epoll_wait(locks->epollFd, events, 64, 100);
+		for (int e = 0; e < ready; ++e)
+		{
+			CommTransport* transport = &locks->transports[events[e].data.u32];
+			while (pollCommTransport(transport) == 1)
+			{
+				if (locks->observed < locks->capacity)
+				{
+					locks->observeLatencies[locks->observed++] = realtimeNs() - transport->sendTime;
+				}
+			}
+		}
+	}
+
+	locks->cpu = threadCpuSeconds() - start;
+	return NULL;
+}
+
+static void onFleetReply(LockFleet* fleet, FleetLock* lock, void* argument)
+{
+	BenchKey* key = argument;
+	(void) fleet;
+
+	if (lock->completed && lock->transport.fallback != COMM_FALLBACK_FILE && key->acks < key->capacity)
+	{
+		key->ackLatencies[key->acks++] = lock->transport.ackLatency;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 200;
+	int commands = argc > 2 ? atoi(argv[2]) : 100;
+	int intervalMs = argc > 3 ? atoi(argv[3]) : 20;
+	int firstPort = argc > 4 ? atoi(argv[4]) : 20000;
+	if (count <= 0 || count > MAX_LOCKS || commands <= 0 || intervalMs < 0 || firstPort <= 0 || firstPort + count > 65536)
+	{
+		fprintf(stderr, "Usage: %s [locks (at most %d)] [commands] [milliseconds between commands] [first port]\n", argv[0], MAX_LOCKS);
+		return 1;
+	}
+
+	// Every lock takes a UDP socket and a listening socket, and the key a socket per lock
+	struct rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+
+	char directory[] = "/tmp/fleetBenchXXXXXX";
+	if (mkdtemp(directory) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	LockConfig settings;
+	setDefaultConfig(&settings);
+	settings.commTransport = COMM_TRANSPORT_UDP;
+	strCopy(settings.commBindAddress, "127.0.0.1");
+	strCopy(settings.commSecret, "fleet-bench");
+	snprintf(settings.commFilePath, sizeof(settings.commFilePath), "%s/commFile.txt", directory);
+	writeCommunicationFile(settings.commFilePath, 0, 0);
+
+	static BenchLocks locks;
+	locks.count = count;
+	locks.transports = calloc(count, sizeof(CommTransport));
+	locks.capacity = (long) count * commands;
+	locks.observeLatencies = calloc(locks.capacity, sizeof(uint64_t));
+	locks.epollFd = epoll_create1(EPOLL_CLOEXEC);
+	atomic_init(&locks.stop, 0);
+
+	settings.lockCount = count;
+	for (int i = 0; i < count; ++i)
+	{
+		settings.commPort = firstPort + i;
+		snprintf(settings.lockAddresses[i], LOCK_ADDRESS_LENGTH, "127.0.0.1:%d", firstPort + i);
+		if (openCommTransport(&locks.transports[i], &settings, COMM_ROLE_LOCK) != 0)
+		{
+			fprintf(stderr, "The lock on port %d could not be opened\n", firstPort + i);
+			return 1;
+		}
+		freeCommWatcher(&locks.transports[i].watcher);
+
+		struct pollfd fds[3];
+		int fdCount = getCommTransportFds(&locks.transports[i], fds, 3);
+		for (int f = 0; f < fdCount; ++f)
+		{
+			struct epoll_event event = { EPOLLIN, { .u32 = (uint32_t) i } };
+			epoll_ctl(locks.epollFd, EPOLL_CTL_ADD, fds[f].fd, &event);
+		}
+	}
+
+	LockFleet fleet;
+	if (openLockFleet(&fleet, &settings) != 0)
+	{
+		fprintf(stderr, "The fleet could not be opened\n");
+		return 1;
+	}
+
+	static BenchKey key;
+	key.capacity = (long) count * commands;
+	key.ackLatencies = calloc(key.capacity, sizeof(uint64_t));
+	uint64_t* completions = calloc(commands, sizeof(uint64_t));
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, runLocks, &locks);
+
+	double keyCpu = threadCpuSeconds();
+	int command = 0;
+	for (int c = 0; c < commands; ++c)
+	{
+		command = !command;
+		sendFleetCommand(&fleet, command);
+		while (fleet.outstanding > 0 && pollLockFleet(&fleet, 1000, onFleetReply, &key) >= 0);
+		completions[c] = monotonicNanoseconds() - fleet.sendTime;
+		usleep(intervalMs * 1000);
+	}
+	keyCpu = threadCpuSeconds() - keyCpu;
+
+	atomic_store(&locks.stop, 1);
+	pthread_join(thread, NULL);
+
+	unsigned long failures = 0, retransmissions = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		failures += fleet.locks[i].failures;
+		retransmissions += fleet.locks[i].commands - fleet.locks[i].acks - fleet.locks[i].failures;
+	}
+
+	printf("%d locks, %d commands, %d ms apart\n", count, commands, intervalMs);
+	printLatencies("whole fleet acknowledged", completions, commands);
+	printLatencies("ack of one lock", key.ackLatencies, key.acks);
+	printLatencies("command seen by one lock", locks.observeLatencies, locks.observed);
+	printf("fallbacks to the file %lu, unanswered %lu\n", failures, retransmissions);
+	printf("CPU: key %.3f s (%.1f us per lock and command), locks %.3f s (%.1f us per lock and command)\n",
+		keyCpu, keyCpu * 1e6 / ((double) count * commands), locks.cpu, locks.cpu * 1e6 / ((double) count * commands));
+
+	closeLockFleet(&fleet);
+	for (int i = 0; i < count; ++i)
+	{
+		closeCommTransport(&locks.transports[i]);
+	}
+	unlink(settings.commFilePath);
+	rmdir(directory);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/* ==================================================================================
+ * formatTimeBench: times the timestamp of a log line, rendered by the old getTime()
+ * (gettimeofday(), localtime() and strftime() on every call) and by the current
+ * clock_gettime() and formatTime(), then checks that formatTime() prints the same
+ * date and time as strftime() across a year of timestamps, DST changes included.
+ *
+ * Usage: TZ=America/New_York ./formatTimeBench [calls]
+ * Build: gcc -std=gnu99 -O2 -I. bench/formatTimeBench.c piLock.c -o formatTimeBench
+ *            -lpthread -lrt
+ * ================================================================================= */
+
+#include "piLock.h"
+
+// getTime() as it was before formatTime() cached the rendered prefix
+static void oldGetTime(char *buffer)
+{
+	struct timeval tv;
+	time_t currentTime;
+
+	gettimeofday(&tv, NULL);
+
+	currentTime = tv.tv_sec;
+
+	strftime(buffer, 30, "%m-%d-%Y %T.", localtime(&currentTime));
+}
+
+static double elapsedNs(const struct timespec* start, const struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char* argv[])
+{
+	long calls = argc > 1 ? atol(argv[1]) : 5000000;
+	if (calls <= 0)
+	{
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		return 1;
+	}
+
+	char buffer[32];
+	struct timespec start, end, now;
+	unsigned long checksum = 0;		// keeps the compiler from dropping the calls
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < calls; i++)
+	{
+		oldGetTime(buffer);
+		checksum += buffer[18];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("gettimeofday + localtime + strftime  %7.1f ns per call\n", elapsedNs(&start, &end) / calls);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < calls; i++)
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+		formatTime(&now, buffer);
+		checksum += buffer[25];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("clock_gettime + formatTime           %7.1f ns per call\n", elapsedNs(&start, &end) / calls);
+
+	// A new second on every call, so only the hour is cached
+	now.tv_sec = 1700000000;
+	now.tv_nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < calls; i++)
+	{
+		now.tv_sec++;
+		formatTime(&now, buffer);
+		checksum += buffer[18];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("formatTime, new second every call    %7.1f ns per call\n", elapsedNs(&start, &end) / calls);
+
+	// Every 7 minutes and 1 second of 2024, against strftime() and localtime_r()
+	long mismatches = 0, checked = 0;
+	for (time_t second = 1704067200; second < 1735689600; second += 421)
+	{
+		struct timespec time = { second, 123456000 };
+		struct tm localTime;
+		char expected[32];
+
+		localtime_r(&second, &localTime);
+		strftime(expected, sizeof(expected), "%m-%d-%Y %T.123456", &localTime);
+		formatTime(&time, buffer);
+		if (strcmp(expected, buffer) != 0)
+		{
+			if (mismatches++ < 5)
+			{
+				printf("mismatch: %s instead of %s\n", buffer, expected);
+			}
+		}
+		checked++;
+	}
+	printf("%ld timestamps of 2024 checked against strftime(), %ld mismatches (checksum %lu)\n", checked, mismatches, checksum);
+	return mismatches != 0;
+}
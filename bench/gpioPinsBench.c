@@ -0,0 +1,134 @@
+/* ==================================================================================
+ * gpioPinsBench: operations per second of the per-pin GPIO functions (setPin(),
+ * clearPin(), writePin(), readPin()) against the mask functions (setPins(),
+ * clearPins(), writePins(), readPins()) for the accesses the programs make, on the
+ * sim backend.  It first checks that both families agree on pins of both banks.
+ *
+ * Usage: ./gpioPinsBench [operations]
+ * Build: gcc -std=gnu99 -O2 -I. bench/gpioPinsBench.c piLock.c -o gpioPinsBench
+ *            -lpthread -lrt
+ *
+ * Every register access of the sim backend goes through the backend table, and
+ * every read of a level register checks the waveform clock, so the absolute rates
+ * are those of the sim backend; the ratio is what the number of accesses gives.
+ * ================================================================================= */
+
+#include "piLock.h"
+
+#define BENCH_GREEN 15
+#define BENCH_RED 18
+#define BENCH_BUTTON 23
+#define BENCH_PHOTODIODE 24
+#define BENCH_HIGH_PIN 40		// second bank
+
+typedef struct BenchCase
+{
+	const char* name;
+	void (*perPin)(GPIO_Handle gpio, long i);
+	void (*mask)(GPIO_Handle gpio, long i);
+} BenchCase;
+
+static volatile uint64_t sink;	// keeps the reads from being dropped
+
+static void ledsPerPin(GPIO_Handle gpio, long i)
+{
+	writePin(gpio, BENCH_GREEN, i & 1);
+	writePin(gpio, BENCH_RED, !(i & 1));
+}
+
+static void ledsMask(GPIO_Handle gpio, long i)
+{
+	uint64_t green = PIN_MASK(BENCH_GREEN), red = PIN_MASK(BENCH_RED);
+	writePins(gpio, (i & 1) ? green : red, (i & 1) ? red : green);
+}
+
+static void inputsPerPin(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	sink += readPin(gpio, BENCH_BUTTON) | (readPin(gpio, BENCH_PHOTODIODE) << 1);
+}
+
+static void inputsMask(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	sink += readPins(gpio, PIN_MASK(BENCH_BUTTON) | PIN_MASK(BENCH_PHOTODIODE));
+}
+
+static void bothBanksPerPin(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	setPin(gpio, BENCH_GREEN);
+	setPin(gpio, BENCH_RED);
+	setPin(gpio, BENCH_HIGH_PIN);
+	clearPin(gpio, BENCH_GREEN);
+	clearPin(gpio, BENCH_RED);
+	clearPin(gpio, BENCH_HIGH_PIN);
+}
+
+static void bothBanksMask(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	uint64_t pins = PIN_MASK(BENCH_GREEN) | PIN_MASK(BENCH_RED) | PIN_MASK(BENCH_HIGH_PIN);
+	setPins(gpio, pins);
+	clearPins(gpio, pins);
+}
+
+static const BenchCase cases[] =
+{
+	{ "2 LEDs, one on, one off", ledsPerPin, ledsMask },
+	{ "button and photodiode read", inputsPerPin, inputsMask },
+	{ "3 pins of 2 banks set, cleared", bothBanksPerPin, bothBanksMask }
+};
+
+static double operationsPerSecond(GPIO_Handle gpio, void (*operation)(GPIO_Handle, long), long operations)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < operations; ++i)
+	{
+		operation(gpio, i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return operations / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char* argv[])
+{
+	long operations = argc > 1 ? atol(argv[1]) : 2000000;
+	if (operations <= 0)
+	{
+		fprintf(stderr, "Usage: %s [operations]\n", argv[0]);
+		return 1;
+	}
+
+	selectGpioBackend(GPIO_BACKEND_SIM, NULL);
+	GPIO_Handle gpio = gpiolib_init_gpio();
+	if (gpio == NULL)
+	{
+		fprintf(stderr, "The sim GPIO backend could not be set up\n");
+		return 1;
+	}
+
+	// Both families must see the same levels, in the second bank as well
+	int pins[] = { BENCH_GREEN, BENCH_RED, BENCH_HIGH_PIN, 53 };
+	int errors = 0;
+	for (int p = 0; p < 4; ++p)
+	{
+		setPin(gpio, pins[p]);
+		errors += (readPin(gpio, pins[p]) != 1) + (readPins(gpio, PIN_MASK(pins[p])) != PIN_MASK(pins[p]));
+		clearPins(gpio, PIN_MASK(pins[p]));
+		errors += (readPin(gpio, pins[p]) != 0) + (readPins(gpio, PIN_MASK(pins[p])) != 0);
+	}
+	printf("per-pin and mask functions agree on pins 15, 18, 40 and 53: %s\n\n", errors ? "NO" : "yes");
+
+	printf("%-32s %16s %16s %8s\n", "operation", "per-pin ops/s", "mask ops/s", "ratio");
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+	{
+		double perPin = operationsPerSecond(gpio, cases[c].perPin, operations);
+		double mask = operationsPerSecond(gpio, cases[c].mask, operations);
+		printf("%-32s %16.0f %16.0f %7.2fx\n", cases[c].name, perPin, mask, mask / perPin);
+	}
+
+	gpiolib_free_gpio(gpio);
+	return errors != 0;
+}
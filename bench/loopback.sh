@@ -0,0 +1,105 @@
+#!/bin/sh
+# ==================================================================================
+# loopback: runs the key and the lock on this machine over 127.0.0.1, with the sim
+# GPIO backend pressing the button of the key, then gives both log files to
+# traceReport for the latency of every command from the press of the button to
+# the servo of the lock, with its percentiles.
+#
+# Usage: bench/loopback.sh [presses] [milliseconds between presses]
+#        (run from the top of the tree, needs gcc and the PIGPIO directory)
+#
+# lock.c and key.c read their configuration from CONFIG_FILE_PATH, so the file
+# there is replaced for the run and put back afterwards.  Every other file of the
+# run (waveform, logs, communication file, state snapshot) is in a temporary
+# directory.  The presses alternate lock and unlock with the door closed, so the
+# commands to lock include the DOOR_SETTLE_TIME of the lock (see door>servo); the
+# press>servo times of the commands to unlock and to lock are also given apart.
+# ==================================================================================
+
+presses=${1:-40}
+interval=${2:-2500}
+config=/home/pi/raspShare/lockConfig.cfg
+work=$(mktemp -d /tmp/loopbackXXXXXX) || exit 1
+
+build()
+{
+	gcc -std=gnu99 -O2 -I. -IPIGPIO "$@" -LPIGPIO -lpigpio -lpthread -lrt
+}
+
+build lock.c piLock.c -o "$work/lock" && build key.c piLock.c -o "$work/key" &&
+	gcc -std=gnu99 -O2 traceReport.c -o "$work/traceReport" || exit 1
+
+# Door closed the whole time, and one 100 ms press of the key button (GPIO 14) per period
+cat > "$work/wave.txt" <<EOF
+0 24 1
+0 14 0
+$((interval / 2)) 14 1
+$((interval / 2 + 100)) 14 0
+LOOP $interval
+EOF
+
+mkdir -p "$(dirname "$config")"
+if [ -f "$config" ]; then
+	cp "$config" "$work/lockConfig.cfg.saved"
+fi
+restore()
+{
+	if [ -f "$work/lockConfig.cfg.saved" ]; then
+		cp "$work/lockConfig.cfg.saved" "$config"
+	else
+		rm -f "$config"
+	fi
+}
+trap 'kill $lockPid $keyPid 2>/dev/null; restore; exit 1' INT TERM
+
+cat > "$config" <<EOF
+WATCHDOG_TIMEOUT = 10
+
+DEFAULT_LOCK_STATE = 0
+
+COMMMUNICATION_FILE_PATH = $work/commFile.txt
+
+LOCK_LOG_FILE_PATH = $work/lockLog.log
+
+KEY_LOG_FILE_PATH = $work/keyLog.log
+
+STATE_FILE_PATH = $work/lockState
+
+COMM_TRANSPORT = udp
+
+COMM_BIND_ADDRESS = 127.0.0.1
+
+COMM_SECRET = loopback-$$
+
+LOCK_ADDRESS = 127.0.0.1
+
+DEBOUNCE_TIME = 20
+
+GPIO_BACKEND = sim
+
+GPIO_WAVEFORM_PATH = $work/wave.txt
+EOF
+
+export LD_LIBRARY_PATH=$PWD/PIGPIO${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+"$work/lock" > "$work/lock.out" 2>&1 &
+lockPid=$!
+sleep 0.5
+"$work/key" > "$work/key.out" 2>&1 &
+keyPid=$!
+
+sleep $(((presses * interval + interval / 2) / 1000 + 2))
+kill -TERM $keyPid $lockPid
+wait $keyPid $lockPid 2>/dev/null
+restore
+
+"$work/traceReport" "$work/keyLog.log" "$work/lockLog.log" > "$work/report.txt"
+tail -n 9 "$work/report.txt"
+
+# press>servo of the commands to unlock (no door stage) and to lock, apart, with the nearest rank percentiles of traceReport
+echo
+for kind in unlock lock; do
+	awk -v kind=$kind 'NR > 1 && NF == 8 && $8 != "-" && (($7 == "-") == (kind == "unlock")) { print $8 }' "$work/report.txt" |
+		sort -n | awk -v kind=$kind '{ v[NR] = $1 } END { if (NR > 0) printf("press>servo, %-6s %5d commands  p50 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n",
+			kind, NR, v[int((NR * 50 + 99) / 100)], v[int((NR * 99 + 99) / 100)], v[NR]) }'
+done
+echo "Logs of the run: $work"
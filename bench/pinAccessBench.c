@@ -0,0 +1,126 @@
+/* ==================================================================================
+ * pinAccessBench: nanoseconds per LED update and per input read made with the GPIO
+ * functions and with the PIN_ accessors of piLock.h, with the mmap backend and with
+ * the sim backend.  lock.c and key.c update their LEDs with PIN_CLEAR() and
+ * PIN_SET().
+ *
+ * Usage: ./pinAccessBench [operations]
+ * Build: gcc -std=gnu99 -O2 -I. bench/pinAccessBench.c piLock.c -o pinAccessBench
+ *            -lpthread -lrt
+ *
+ * There is no /dev/gpiomem off a Pi, so the mmap backend is given a block of
+ * ordinary memory laid out like the registers: the times are those of the code
+ * path, without the latency of the peripheral bus.
+ * ================================================================================= */
+
+#include "piLock.h"
+
+#define BENCH_GREEN 15
+#define BENCH_RED 18
+#define BENCH_BUTTON 23
+
+static volatile uint64_t sink;	// keeps the reads from being dropped
+
+static void ledsWritePins(GPIO_Handle gpio, long i)
+{
+	uint64_t green = PIN_MASK(BENCH_GREEN), red = PIN_MASK(BENCH_RED);
+	writePins(gpio, (i & 1) ? green : red, (i & 1) ? red : green);
+}
+
+static void ledsPinFunctions(GPIO_Handle gpio, long i)
+{
+	clearPin(gpio, (i & 1) ? BENCH_RED : BENCH_GREEN);
+	setPin(gpio, (i & 1) ? BENCH_GREEN : BENCH_RED);
+}
+
+static void ledsPinMacros(GPIO_Handle gpio, long i)
+{
+	if (i & 1)
+	{
+		PIN_CLEAR(gpio, BENCH_RED);
+		PIN_SET(gpio, BENCH_GREEN);
+	}
+	else
+	{
+		PIN_CLEAR(gpio, BENCH_GREEN);
+		PIN_SET(gpio, BENCH_RED);
+	}
+}
+
+static void readReadPins(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	sink += readPins(gpio, PIN_MASK(BENCH_BUTTON));
+}
+
+static void readReadPin(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	sink += readPin(gpio, BENCH_BUTTON);
+}
+
+static void readPinMacro(GPIO_Handle gpio, long i)
+{
+	(void) i;
+	sink += PIN_READ(gpio, BENCH_BUTTON);
+}
+
+static double nanosecondsPerOperation(GPIO_Handle gpio, void (*operation)(GPIO_Handle, long), long operations)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < operations; ++i)
+	{
+		operation(gpio, i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / operations;
+}
+
+static void runBackend(const char* name, GPIO_Handle gpio, long operations)
+{
+	printf("%-5s LED update: writePins() %6.1f ns  clearPin() + setPin() %6.1f ns  PIN_CLEAR() + PIN_SET() %6.1f ns\n", name,
+		nanosecondsPerOperation(gpio, ledsWritePins, operations), nanosecondsPerOperation(gpio, ledsPinFunctions, operations),
+		nanosecondsPerOperation(gpio, ledsPinMacros, operations));
+	printf("%-5s input read: readPins()  %6.1f ns  readPin()             %6.1f ns  PIN_READ()                %6.1f ns\n", name,
+		nanosecondsPerOperation(gpio, readReadPins, operations), nanosecondsPerOperation(gpio, readReadPin, operations),
+		nanosecondsPerOperation(gpio, readPinMacro, operations));
+}
+
+int main(int argc, char* argv[])
+{
+	long operations = argc > 1 ? atol(argv[1]) : 20000000;
+	if (operations <= 0)
+	{
+		fprintf(stderr, "Usage: %s [operations]\n", argv[0]);
+		return 1;
+	}
+
+	selectGpioBackend(GPIO_BACKEND_MMAP, NULL);
+	GPIO_Handle registers = calloc(1, GPIO_LEN);
+	if (registers == NULL)
+	{
+		return 1;
+	}
+	runBackend("mmap", registers, operations);
+	free(registers);
+
+	selectGpioBackend(GPIO_BACKEND_SIM, NULL);
+	GPIO_Handle gpio = gpiolib_init_gpio();
+	if (gpio == NULL)
+	{
+		fprintf(stderr, "The sim GPIO backend could not be set up\n");
+		return 1;
+	}
+
+	// The accessors must still reach the sim backend, which turns a write of GPSETx into a level of GPLEVx
+	PIN_SET(gpio, BENCH_GREEN);
+	int reached = PIN_READ(gpio, BENCH_GREEN) == 1 && readPin(gpio, BENCH_GREEN) == 1;
+	PIN_CLEAR(gpio, BENCH_GREEN);
+	reached = reached && PIN_READ(gpio, BENCH_GREEN) == 0;
+	printf("PIN_ accessors reach the sim backend: %s\n", reached ? "yes" : "NO");
+
+	runBackend("sim", gpio, operations / 4);
+	gpiolib_free_gpio(gpio);
+	return !reached;
+}
@@ -0,0 +1,158 @@
+/* ==================================================================================
+ * transportLatencyBench: times a command from the key writing it to the lock seeing
+ * it, over the file and the shared memory transports, with the lock end waiting on
+ * an event loop the way lock.c does.  The shm transport is also read in a busy loop,
+ * which gives the cost of the seqlock itself without the COMM_SHM_POLL_MS timer.
+ *
+ * Usage: ./transportLatencyBench [commands per transport] [milliseconds between commands]
+ * Build: gcc -std=gnu99 -O2 -I. bench/transportLatencyBench.c piLock.c
+ *            -o transportLatencyBench -lpthread -lrt
+ *
+ * Both ends run in this process, on two threads, so their clocks agree.  The GPIO
+ * backend plays no part in this path: the key thread writes the commands directly,
+ * as the button handler of key.c does.
+ * ================================================================================= */
+
+#include "piLock.h"
+
+#define BENCH_MAX_COMMANDS 100000
+
+typedef struct BenchLock
+{
+	CommTransport* transport;
+	int spin;						// 1 to read the transport in a busy loop instead of the event loop
+	int expected;					// Commands to see before stopping
+	atomic_int done;				// Set by the key once it has written every command
+	atomic_ullong writtenAt;		// CLOCK_REALTIME when the key wrote the last command, in nanoseconds
+	uint64_t latencies[BENCH_MAX_COMMANDS];
+	int seen;
+} BenchLock;
+
+static uint64_t realtimeNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+	uint64_t first = *(const uint64_t*) a, second = *(const uint64_t*) b;
+	return (first > second) - (first < second);
+}
+
+static void* runLock(void* argument)
+{
+	BenchLock* bench = argument;
+	EventLoop loop;
+	int lastCommand = bench->transport->command;
+
+	if (!bench->spin && (initEventLoop(&loop) != 0 || addCommTransportSources(&loop, bench->transport) != 0))
+	{
+		fprintf(stderr, "The event loop could not be set up\n");
+		return NULL;
+	}
+
+	// A command overwritten before it was read is missed, so stop a second after the last one as well
+	while (bench->seen < bench->expected && !(atomic_load(&bench->done) && realtimeNs() - atomic_load(&bench->writtenAt) > 1000000000ULL))
+	{
+		if (!bench->spin && runEventLoop(&loop, 1000) < 0)
+		{
+			break;
+		}
+
+		while (pollCommTransport(bench->transport) == 1 && bench->transport->command != lastCommand)
+		{
+			bench->latencies[bench->seen++] = realtimeNs() - atomic_load(&bench->writtenAt);
+			lastCommand = bench->transport->command;
+		}
+	}
+
+	if (!bench->spin)
+	{
+		removeCommTransportSources(&loop, bench->transport);
+		closeEventLoop(&loop);
+	}
+	return NULL;
+}
+
+static int runBench(const char* name, int type, int spin, const char* directory, int commands, int intervalMs)
+{
+	LockConfig settings;
+	setDefaultConfig(&settings);
+	settings.commTransport = type;
+	snprintf(settings.commFilePath, sizeof(settings.commFilePath), "%s/commFile.txt", directory);
+	snprintf(settings.shmFilePath, sizeof(settings.shmFilePath), "%s/commRecord", directory);
+	writeCommunicationFile(settings.commFilePath, 0, 0);
+
+	CommTransport lock, key;
+	if (openCommTransport(&lock, &settings, COMM_ROLE_LOCK) != 0 || openCommTransport(&key, &settings, COMM_ROLE_KEY) != 0)
+	{
+		fprintf(stderr, "%s: the transport could not be opened\n", name);
+		return -1;
+	}
+
+	static BenchLock bench;
+	bench.transport = &lock;
+	bench.spin = spin;
+	bench.expected = commands;
+	bench.seen = 0;
+	atomic_init(&bench.done, 0);
+	atomic_init(&bench.writtenAt, 0);
+	while (pollCommTransport(&lock) == 1);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, runLock, &bench);
+
+	// Alternate lock and unlock, with a random offset so the commands do not follow the phase of the poll timer
+	int command = lock.command;
+	for (int i = 0; i < commands; ++i)
+	{
+		usleep(intervalMs * 1000 + rand() % (COMM_SHM_POLL_MS * 1000));
+		command = !command;
+		atomic_store(&bench.writtenAt, realtimeNs());
+		writeCommTransport(&key, command);
+	}
+	atomic_store(&bench.done, 1);
+	pthread_join(thread, NULL);
+
+	qsort(bench.latencies, bench.seen, sizeof(bench.latencies[0]), compareLatency);
+	if (bench.seen > 0)
+	{
+		printf("%-16s %5d commands  p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name, bench.seen,
+			bench.latencies[bench.seen / 2] / 1000.0, bench.latencies[bench.seen * 99 / 100] / 1000.0,
+			bench.latencies[bench.seen - 1] / 1000.0);
+	}
+
+	closeCommTransport(&key);
+	closeCommTransport(&lock);
+	unlink(settings.commFilePath);
+	unlink(settings.shmFilePath);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int commands = argc > 1 ? atoi(argv[1]) : 500;
+	int intervalMs = argc > 2 ? atoi(argv[2]) : 10;
+	if (commands <= 0 || commands > BENCH_MAX_COMMANDS || intervalMs < 0)
+	{
+		fprintf(stderr, "Usage: %s [commands per transport (at most %d)] [milliseconds between commands]\n", argv[0], BENCH_MAX_COMMANDS);
+		return 1;
+	}
+
+	char directory[] = "/tmp/transportBenchXXXXXX";
+	if (mkdtemp(directory) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	srand(1);
+
+	runBench("file (inotify)", COMM_TRANSPORT_FILE, 0, directory, commands, intervalMs);
+	runBench("shm (timer)", COMM_TRANSPORT_SHM, 0, directory, commands, intervalMs);
+	runBench("shm (busy loop)", COMM_TRANSPORT_SHM, 1, directory, commands, intervalMs);
+
+	rmdir(directory);
+	return 0;
+}
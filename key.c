@@ -29,264 +29,367 @@
 
 // Import the necessary header files
 #include "piLock.h"
+#include <pigpio.h>
 
 // PIN CONSTANTS //
 #define BUTTON 14
 #define GREEN_LED 15
 #define RED_LED 18
 
-int main(const int argc, const char *const argv[])
+// Everything the action of the button machine needs
+typedef struct KeyContext
 {
-	
-	///////////////////////////////////////////////////////////////////////////////////// DEFAULT VARIABLE INITIALIZATION //
-	//Declare default variables and file paths that will be read from the configuration file
-	int timeout;					// Watchdog timout
-	int lockState;					// Initial lock state (1 for locked, 0 for unlocked)
+	LockFleet* fleet;
+	GPIO_Handle gpio;
+	Logger* logger;
+} KeyContext;
+
+/* =================================================
+ * This function is the action of the button machine,
+ * run when the button is released.  It sends the
+ * opposite of the last command to every lock and
+ * shows the new command on the LEDs.
+ *
+ * @param: void* KeyContext
+ * @return: void
+ * ============================================== */
+
+static void onButtonRelease(void* context)
+{
+	KeyContext* keyContext = context;
+	uint64_t pressTime = monotonicNanoseconds();
+
+	// if the previous command sent to the locks is a 1 (locked)
+	if (keyContext->fleet->command)
+	{
+		sendFleetCommand(keyContext->fleet, 0);	// Send a 0 to every lock indicating that the new command is to unlock the door
 
-	char commFilePath[255];			// File path to the communication file shared between Pis
-	char lockLogFilePath[255];		// File path to the log file for the lock mechanism
-	char keyLogFilePath[255];		// File path to the log file for the remote access key
+		// Write to the log file that a command has been written to the communication file to unlock the door
+		PRINT_MSG(keyContext->logger, "Wrote command to unlock the door to communication file\n");
 
-	// Initialize default variables and file paths to those defined in the piLock.h header file
-	timeout = DEFAULT_TIMEOUT;
-	lockState = DEFAULT_LOCK_STATE;
+		PIN_CLEAR(keyContext->gpio, RED_LED);	// Turn off RED_LED
+		PIN_SET(keyContext->gpio, GREEN_LED);	// and turn on GREEN_LED to indicate message sent to unlock
+	}
+	else 						// if the previous command sent to the locks is a 0 (unlocked)
+	{
+		sendFleetCommand(keyContext->fleet, 1);	// Send a 1 to every lock indicating that the new command is to lock the door
+
+		// Write to the log file that a command has been written to the communication file to lock the door
+		PRINT_MSG(keyContext->logger, "Wrote command to lock the door to communication file\n");
+
+		PIN_CLEAR(keyContext->gpio, GREEN_LED);	// Turn off GREEN_LED
+		PIN_SET(keyContext->gpio, RED_LED);		// and turn on RED_LED to indicate message sent to lock
+	}
+
+	// Trace the command from the press to the moment it was handed to the transports; the lock traces the rest
+	logTrace(keyContext->logger, keyContext->fleet->traceId, "press", pressTime);
+	logTrace(keyContext->logger, keyContext->fleet->traceId, "sent", keyContext->fleet->sendTime);
+}
+
+/* =================================================
+ * This function logs a reply from one lock of the
+ * fleet: the acknowledgement of a command, a command
+ * that had to be written to the communication file,
+ * or a change of the state of the door.
+ *
+ * @param: LockFleet*, FleetLock* lock that replied, void* Logger
+ * @return: void
+ * ============================================== */
+
+static void logFleetReply(LockFleet* fleet, FleetLock* lock, void* argument)
+{
+	(void) fleet;
+	Logger* logger = argument;
+	CommTransport* transport = &lock->transport;
+	char message[LOG_MESSAGE_LENGTH];
+
+	if (transport->type != COMM_TRANSPORT_UDP || transport->pending)
+	{
+		return;
+	}
+
+	if (lock->completed && transport->fallback == COMM_FALLBACK_FILE)
+	{
+		snprintf(message, sizeof(message), "Lock %s did not acknowledge the command, it was written to the communication file\n", lock->name);
+	}
+	else if (lock->completed)
+	{
+		snprintf(message, sizeof(message), "Lock %s acknowledged the command%s in %.1f ms, the door is %s\n", lock->name,
+			(transport->fallback == COMM_FALLBACK_TCP) ? " over TCP" : "", transport->ackLatency / 1000000.0, commStateName(transport->lockState));
+		logTrace(logger, transport->traceId, "ack", 0);
+	}
+	else
+	{
+		snprintf(message, sizeof(message), "Lock %s reported that the door is %s\n", lock->name, commStateName(transport->lockState));
+	}
+	PRINT_MSG(logger, message);
+}
+
+int main(const int argc, const char *const argv[])
+{
 	
-	// Use the strCopy() function to copy the strings rather than point to the default strings in piLock.h
-	strCopy(commFilePath, COMM_FILE_PATH);
-	strCopy(lockLogFilePath, LOCK_LOG_FILE_PATH);
-	strCopy(keyLogFilePath, KEY_LOG_FILE_PATH);
+	///////////////////////////////////////////////////////////////////////////////////// DEFAULT VARIABLE INITIALIZATION //
+	// Declare the configuration that will be read from the configuration file and
+	// initialize it to the default values and file paths defined in the piLock.h header file
+	LockConfig settings;
+	setDefaultConfig(&settings);
 
 	// Extract the name of the program (while removing the "./") using findLength() and copyProgramName() for logging purposes later on
 	int length = findLength(argv[0]);
 	char programName[length + 1];
-	copyProgramName(programName, argv[0]);	char time[30]; 
+	copyProgramName(programName, argv[0]);
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	//////////////////////////////////////////////////////////////////////////////////////////// READING FROM CONFIG FILE //
-	// Open config file if possible invoking fopen() with "r" to set as a read-only file. 
-	// If config cannot be opened output a message to the user that the default values declared in the header will be used
-	FILE *config = fopen(CONFIG_FILE_PATH, "r");
-	if (!config)
+	// Map and parse the config file. Any parameter it does not set (or sets to an invalid value, which is
+	// reported on stderr) keeps the default value declared in the header. If the file cannot be read, output a message to the user
+	if (loadConfig(CONFIG_FILE_PATH, &settings) != 0)
 	{
 		perror("The config file could not be opened; using default values");
 	}
-	else
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+	////////////////////////////////////////////////////////////////////////////////////////////// SET UP THE EVENT LOOP //
+	// Every wakeup of the main loop comes from one epoll instance. SIGTERM and SIGINT are read from a signalfd,
+	// which needs them blocked before the logger, the watchdog supervisor and pigpio start their threads
+	EventLoop loop;
+	const int signals[] = { SIGTERM, SIGINT };
+	if (initEventLoop(&loop) != 0 || addSignalSource(&loop, signals, 2, handleStopOrReloadSignal, NULL) < 0)
 	{
-		// Read the configuration file once opened and 
-		readConfig(config, &timeout, &lockState, commFilePath, lockLogFilePath, keyLogFilePath);
+		perror("The event loop could not be set up");
+		return -1;
 	}
-	fclose(config);
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////////////// SET UP WRITING TO LOG FILE //
-	// Attempt to open log file invoking fopen() with "r" to see if the file exists
-	FILE *logFile = fopen(keyLogFilePath, "r");
-	if (!logFile)
+	// Open the log file once and start the logger thread, which writes queued messages to the file in batches.
+	// The log file is created at keyLogFilePath (either default or configuration based) if it does not exist yet
+	static Logger logger;
+	if (initLogger(&logger, settings.keyLogFilePath, programName, settings.logFlushInterval, settings.logSummaryInterval, settings.logFormat) != 0)
+	{
+		perror("The log file could not be opened");
+		return -1;
+	}
+	if (logger.created)
 	{
-		// If the file does not exist, create a new file at the lockLogFilePath (either default or configuration based)
-		// by invoking fopen() with "a" and immediately write a message that a new log file was created
-		logFile = fopen(keyLogFilePath, "a");
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "# A new log file was created\n\n");
-		fclose(logFile);
+		PRINT_MSG(&logger, "# A new log file was created\n\n");
 	}
-	fclose(logFile);
-	logFile = fopen(keyLogFilePath, "a");
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The log file has been opened.\n\n");
-	PRINT_MSG(logFile, time, programName, "# The program has started. \n\n");
+	PRINT_MSG(&logger, "# The log file has been opened.\n\n");
+	PRINT_MSG(&logger, "# The program has started. \n\n");
+
+	// Keep the log file from growing forever: it is rotated every LOG_SEGMENT_SIZE kilobytes by the logger thread
+	setLogRotation(&logger, settings.logSegmentSize, settings.logSegmentCount, settings.logCompress);
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////// OPEN COMM FILE //
 	// Attempt to open log file invoking fopen() with "r" to see if the file exists
-	FILE *commFile = fopen(commFilePath, "r");
+	FILE *commFile = fopen(settings.commFilePath, "r");
 	if (!commFile)
 	{
 		// If the comm file does not exist, write to the log file that a comm file was created
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "A new communication file was created\n\n");
+		PRINT_MSG(&logger, "A new communication file was created\n\n");
+	}
+	else
+	{
+		fclose(commFile);
+	}
+	// Open comm file using fopen() with "a". A new file will automatically be created at commFilePath (default or configuration based)
+	// if it does not exist. An existing file is left as it is, so the last command is not lost
+	commFile = fopen(settings.commFilePath, "a");
+	if (commFile)
+	{
+		fclose(commFile);
 	}
-	fclose(commFile);
-	// Open comm file using fopen() with "w". A new file will automatically be created at commFilePath (default or configuration based)
-	// if it does not exist
-	commFile = fopen(commFilePath, "w");
-	fclose(commFile);
 
 	// Print message to the log file that the communication file was successfuly opened
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The communication file has been opened.\n\n");
+	PRINT_MSG(&logger, "# The communication file has been opened.\n\n");
+
+	// Open the transport selected in the configuration file for every lock the key controls.
+	// Over udp every LOCK_ADDRESS is one lock, the other transports reach a single lock
+	LockFleet fleet;
+	if (openLockFleet(&fleet, &settings) != 0)
+	{
+		PRINT_MSG(&logger, "The command transport could not be opened!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+	char fleetMessage[LOG_MESSAGE_LENGTH];
+	snprintf(fleetMessage, sizeof(fleetMessage), "# The key controls %d lock(s)\n\n", fleet.count);
+	PRINT_MSG(&logger, fleetMessage);
+	if (settings.commTransport == COMM_TRANSPORT_UDP && settings.commSecret[0] == 0)
+	{
+		PRINT_MSG(&logger, "COMM_SECRET is not set, the commands received over the network are refused\n\n");
+	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	
 	
 	///////////////////////////////////////////////////////////////////////////////////////////// WATCHDOG INITIALIZATION //
-	int watchdog;
-	if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY)) < 0)
+	// The sim GPIO backend runs without a Pi, so there is no watchdog to open and watchdog stays -1
+	int watchdog = -1;
+	if (settings.gpioBackend == GPIO_BACKEND_SIM)
 	{
-		printf("Error: Couldn't open watchdog device! %d\n", watchdog);
-		return -1;
+		PRINT_MSG(&logger, "# The sim GPIO backend is in use, the Watchdog is not opened\n\n");
+	}
+	else
+	{
+		if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+		{
+			printf("Error: Couldn't open watchdog device! %d\n", watchdog);
+			PRINT_MSG(&logger, "The Watchdog file could not be opened!\n\n");
+			closeLogger(&logger);
+			return -1;
+		}
+		PRINT_MSG(&logger, "# The Watchdog file has been opened\n\n");
 	}
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The Watchdog file has been opened\n\n");
-
-	ioctl(watchdog, WDIOC_SETTIMEOUT, &timeout);
-
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The Watchdog time limit has been set\n\n");
 
-	//The value of timeout will be changed to whatever the current time limit of the watchdog timer is
-	ioctl(watchdog, WDIOC_GETTIMEOUT, &timeout);
+	// The watchdog is kicked by the supervisor thread, and only while the button machine, the logger and the fleet all
+	// show heartbeats. The time limit is set here, and the value of timeout is changed to whatever the driver actually uses
+	WatchdogSupervisor supervisor;
+	if (initWatchdogSupervisor(&supervisor, watchdog, settings.timeout, &logger) != 0)
+	{
+		PRINT_MSG(&logger, "The Watchdog supervisor could not be set up!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+	settings.timeout = supervisor.timeout;
+	PRINT_MSG(&logger, "# The Watchdog time limit has been set\n\n");
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////// INITIALIZE GPIO FOR BOTH LIBRARIES //
+	// Select the GPIO backend from the configuration file (the registers of the Pi, or simulated ones) before mapping it
+	selectGpioBackend(settings.gpioBackend, settings.gpioWaveformPath);
 	GPIO_Handle gpio;
 	gpio = gpiolib_init_gpio();
 	if (gpio == NULL)
 	{
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "GPIO could not be initialized!\n\n");
+		PRINT_MSG(&logger, "GPIO could not be initialized!\n\n");
+		closeLogger(&logger);
 		return -1;
 	}
 
-	gpioInitialise();
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The GPIO pins have been initialized\n\n");
+	if (settings.gpioBackend != GPIO_BACKEND_SIM)
+	{
+		gpioInitialise();
+	}
+	PRINT_MSG(&logger, "The GPIO pins have been initialized\n\n");
 
 	// SET PIN I/O CONFIGURATION //
 	selectPin(gpio, GREEN_LED, 1);
 	selectPin(gpio, RED_LED, 1);
 	selectPin(gpio, BUTTON, 0);
 	// PIGPIO will handle the servo pin
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "Pin 14, 15, 18 have been set to output\n Pin 23 has been set to input\n\n");
+	PRINT_MSG(&logger, "Pin 14, 15, 18 have been set to output\n Pin 23 has been set to input\n\n");
 	// INTIALIZE OUTPUT PINS //
-	clearPin(gpio, GREEN_LED);
-	clearPin(gpio, RED_LED);
+	clearPins(gpio, PIN_MASK(GREEN_LED) | PIN_MASK(RED_LED));
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// Close logFile before entering main execution loop to fully write messages to log file
-	fclose(logFile);
 	
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////// MAIN EXECUTION LOOP //
 
-	// Initialize the integer currentButtonValue (stores the current state of the pin connected to the button)
-	int currentButtonValue = readPin(gpio, BUTTON);
-	// Initialize the integer lastButtonValue (stores the previous state of the pin connected to the button)
-	// Used to compare with currentButtonValue to determine if the button state has changed or not
-	int lastButtonValue = readPin(gpio, BUTTON);
-
-	// Create and enum buttonState for use in the state machine receiving input from the button
-	// and controlling the commands written to the communication file
-	enum buttonState
+	// Debounce the button so that contact bounce does not send two commands for one press.
+	// A new level is only accepted once it has lasted DEBOUNCE_TIME milliseconds
+	Debouncer debouncer;
+	initDebouncer(&debouncer, gpio, PIN_MASK(BUTTON), settings.debounceTime);
+
+	// The button is driven by the button machine shared with the lock: releasing it calls onButtonRelease(),
+	// which sends the opposite of the current command to every lock
+	KeyContext context;
+	context.fleet = &fleet;
+	context.gpio = gpio;
+	context.logger = &logger;
+
+	StateTransition buttonTable[BUTTON_TRANSITIONS];
+	StateMachine buttonMachine;
+	initButtonMachine(&buttonMachine, buttonTable, onButtonRelease, &context);
+
+	atomic_ulong machineHeartbeat;
+	atomic_ulong fleetHeartbeat;
+	atomic_init(&machineHeartbeat, 0);
+	atomic_init(&fleetHeartbeat, 0);
+	addWatchdogSource(&supervisor, "button state machine", &machineHeartbeat, -1);
+	addWatchdogSource(&supervisor, "logger", &logger.heartbeat, logger.wakeFd);
+	addWatchdogSource(&supervisor, "lock fleet", &fleetHeartbeat, -1);
+	if (startWatchdogSupervisor(&supervisor) != 0)
 	{
-		START,
-		PRESSED,
-		UNPRESSED
-	};
-	enum buttonState buttonState = START;
+		PRINT_MSG(&logger, "The Watchdog supervisor could not be started!\n\n");
+	}
+
+	// The main loop sleeps in the event loop instead of spinning. It wakes up to sample the button every DEBOUNCE_POLL_INTERVAL_MS,
+	// when the epoll instance of the fleet is ready (a reply, or a retransmission that is due), on a signal, or when its heartbeats
+	// are due for the watchdog supervisor
+	addTimerSource(&loop, DEBOUNCE_POLL_INTERVAL_MS, NULL, NULL);
+	addEventSource(&loop, fleet.epollFd, NULL, NULL);
+	addTimerSource(&loop, heartbeatInterval(&supervisor), NULL, NULL);
 
 	// Enter main execution loop in which the button state will continuously be read
 	// and the lock mechanism will continously be controlled based on the command stored in the communication file
-	while (1)
+	while (!stopRequested)
 	{
-		
-		currentButtonValue = readPin(gpio, BUTTON);	// read the current state of the pin connected to the button
+		runEventLoop(&loop, -1);
 
-		switch (buttonState)
+		// Pick up commands given with the button on the lock, and over udp, acknowledgements and retransmissions
+		// from every lock of the fleet.  Only the locks whose sockets are ready are looked at
+		int outstanding = fleet.outstanding;
+		if (pollLockFleet(&fleet, 0, logFleetReply, &logger) >= 0)
 		{
-		case START:
-			if (currentButtonValue)
-			{
-				// Initial case transition to PRESSED if the button pin reads HIGH 
-				buttonState = PRESSED;
-			}
-			else
-			{
-				// Else if button is not pressed transition to UNPRESSED
-				buttonState = UNPRESSED;
-			}
-			break;
-
-		case PRESSED:
-			// button was pressed in previous loop and has been released -> write a command to the communication file based on the previous state
-			if (!currentButtonValue && lastButtonValue) 	
-			{
-				// if the previous command stored in the communication file is a 1 (locked)
-				if (readCommunicationFile(commFilePath))
-				{
-					commFile = fopen(commFilePath, "w");	// Open the communication file
-					fprintf(commFile, "0");			// Write a 0 to the communication file indicating that the new command is to unlock the door
-					fclose(commFile);			// Close the communication file to finish writing
-
-					// Write to the log file that a command has been written to the communication file to unlock the door
-                    			getTime(time);
-					logFile = fopen(keyLogFilePath, "a");
-                    			PRINT_MSG(logFile, time, programName, "Wrote command to unlock the door to communication file\n");
-					fclose(logFile);     			// Close the log file to finish writing
-
-					clearPin(gpio, RED_LED);		// Turn off RED_LED
-                  		  	setPin(gpio, GREEN_LED);		// Turn on GREEN_LED to indicate message sent to unlock
-               			}
-              			else 						// if the previous command stored in the communication file is a 0 (unlocked)
-                		{
-					commFile = fopen(commFilePath, "w");	// Open the communication file
-					fprintf(commFile, "1");			// Write a 1 to the communication file indicating that the new command is to lock the door
-					fclose(commFile);			// Close the communication file to finish writing
-
-					// Write to the log file that a command has been written to the communication file to lock the door
-                    			getTime(time);
-					logFile = fopen(keyLogFilePath, "a");
-					PRINT_MSG(logFile, time, programName, "Wrote command to lock the door to communication file\n");
-					fclose(logFile);			// Close the log file to finish writing
-					
-					clearPin(gpio, GREEN_LED);		// Turn off GREEN_LED
-					setPin(gpio, RED_LED);			// Turn on RED_LED to indicate message sent to lock
-				}
-				
-				buttonState = UNPRESSED;
-			}
-			break;
-
-		case UNPRESSED:
-
-			if (currentButtonValue && !lastButtonValue) 	// button is pressed and was pressed in the previous loop
-			{
-				buttonState = PRESSED;			// Simply change the buttonState to pressed as commands are only written to the communication file upon button release
-			}
-			break;
+			REPORT_HEARTBEAT(fleetHeartbeat);
+		}
+		if (outstanding > 0 && fleet.outstanding == 0 && fleet.count > 1)
+		{
+			char message[LOG_MESSAGE_LENGTH];
+			snprintf(message, sizeof(message), "All %d locks answered the command in %.1f ms\n",
+				fleet.count, (monotonicNanoseconds() - fleet.sendTime) / 1000000.0);
+			PRINT_MSG(&logger, message);
 		}
-		lastButtonValue = currentButtonValue;			// Assign current button state to previous button state for next iteration
-
 
-		ioctl(watchdog, WDIOC_KEEPALIVE, 0);			// kick the watchdog and log that the watchdog was updated
-		getTime(time);
-		logFile = fopen(keyLogFilePath, "a");
-		PRINT_MSG(logFile, time, programName, "The Watchdog was updated\n\n");
-		fclose(logFile);
+		updateDebouncer(&debouncer, gpio);
+		fireStateEvent(&buttonMachine, readDebouncedPin(&debouncer, BUTTON) ? EVENT_BUTTON_DOWN : EVENT_BUTTON_UP, monotonicNanoseconds());
+		REPORT_HEARTBEAT(machineHeartbeat);
 	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	logFile = fopen(keyLogFilePath, "a");	
-	
-	write(watchdog, "V", 1);		// write to the watchdog to let it know to stop its countdown
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The Watchdog was disabled\n\n");
+	stopWatchdogSupervisor(&supervisor);
+	if (watchdog >= 0)
+	{
+		write(watchdog, "V", 1);		// write to the watchdog to let it know to stop its countdown
+		PRINT_MSG(&logger, "The Watchdog was disabled\n\n");
 
-	close(watchdog);			// close the connection to the watchdog
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The Watchdog was closed\n\n");
+		close(watchdog);			// close the connection to the watchdog
+		PRINT_MSG(&logger, "The Watchdog was closed\n\n");
+	}
+
+	// Log how every lock of the fleet answered before closing the transports
+	for (int i = 0; i < fleet.count && settings.commTransport == COMM_TRANSPORT_UDP; ++i)
+	{
+		FleetLock* lock = &fleet.locks[i];
+		char message[LOG_MESSAGE_LENGTH];
+		snprintf(message, sizeof(message), "Lock %s: %lu command(s), %lu acknowledged (mean %.1f ms, max %.1f ms), %lu fell back to the communication file\n",
+			lock->name, lock->commands, lock->acks, lock->acks ? (lock->ackLatencyTotal / (double) lock->acks) / 1000000.0 : 0.0,
+			lock->ackLatencyMax / 1000000.0, lock->failures);
+		PRINT_MSG(&logger, message);
+	}
+	closeLockFleet(&fleet);
 
 	// Clear pins and free GPIO before exiting the program
-	clearPin(gpio, RED_LED);
-	clearPin(gpio, GREEN_LED);
-	gpioTerminate();
+	clearPins(gpio, PIN_MASK(RED_LED) | PIN_MASK(GREEN_LED));
+	if (settings.gpioBackend != GPIO_BACKEND_SIM)
+	{
+		gpioTerminate();
+	}
 	gpiolib_free_gpio(gpio);
-	PRINT_MSG(logFile, time, programName, "The GPIO pins have been freed\n\n");
+	PRINT_MSG(&logger, "The GPIO pins have been freed\n\n");
+
+	logEventLoopStats(&logger, &loop);
+	closeEventLoop(&loop);
 
-	fclose(logFile);
+	// Stop the logger thread once every queued message has been written to the log file
+	closeLogger(&logger);
+	return 0;
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 }
@@ -38,6 +38,9 @@
 #define GREEN_LED 15
 #define RED_LED 18
 
+// EDGE DETECTION CONSTANTS //
+#define MAX_BUTTON_EDGES 64				// button edges handled per pass through the main loop
+
 // SERVO POSITION FREQUENCY CONSTANTS //
 #define LOCKED_FREQUENCY 1050 // may need further calibration
 #define UNLOCKED_FREQUENCY 1950
@@ -48,131 +51,332 @@
 #define LOCKED_MESSAGE "The door has been LOCKED. \n"
 #define UNLOCKED_MESSAGE "The door has been UNLOCKED. \n"
 
-// SERVO/LED CONTROL FUNCTION DECLARATIONS //
-void lock(GPIO_Handle);
-void unlock(GPIO_Handle);
+// SERVO/LED CONTROL //
+// The servo and the LEDs are driven by the actuator thread, so the main loop goes on reading the button, the door and the
+// commands while the servo moves. The main loop hands it the moves through one ring, and it hands every move back through
+// another once the servo has been moved
+typedef struct ServoMove
+{
+	int position;					// LOCKED_FREQUENCY or UNLOCKED_FREQUENCY, 0 asks the actuator thread to stop
+	uint32_t traceId;				// Trace ID of the command the move is for
+	uint64_t eventTime;				// CLOCK_MONOTONIC of the event that caused the move, in nanoseconds
+	uint64_t commandTime;			// CLOCK_MONOTONIC of the command the servo moves for, 0 if it moves for the door
+	uint64_t movedAt;				// CLOCK_MONOTONIC when the servo was moved, set by the actuator thread
+} ServoMove;
+
+typedef struct Actuator
+{
+	GPIO_Handle gpio;
+	Logger* logger;
+	SpscRing moves;					// Main loop to actuator thread
+	SpscRing done;					// Actuator thread to main loop
+	atomic_ulong heartbeat;
+	pthread_t thread;
+} Actuator;
+
+void lock(Actuator* actuator, uint32_t traceId);
+void unlock(Actuator* actuator, uint32_t traceId);
 void cleanup(GPIO_Handle);
+void* actuatorThread(void* argument);
+
+// EDGE DETECTION //
+// The edges of the button and the photodiode reach the main loop through a ring. They are pushed by the pigpio alert
+// callbacks, which run on a pigpio thread, or if there are no alerts by the sensor thread, which debounces the pins itself
+typedef struct GpioEdge
+{
+	int gpio;
+	int level;
+} GpioEdge;
+
+typedef struct Sensor
+{
+	GPIO_Handle gpio;
+	Debouncer* debouncer;			// Only used by the sensor thread while it runs
+	atomic_int debounceTime;		// Changed by a reload of the configuration, applied by the sensor thread
+	atomic_int running;
+	atomic_ulong heartbeat;
+	pthread_t thread;
+} Sensor;
+
+static SpscRing edgeRing;
+static int pigpioReady = 0;			// 1 once pigpio has been started, which drives the servo and reports the edges
+void onGpioEdge(int gpio, int level, uint32_t tick);
+void* sensorThread(void* argument);
+
+// LOCK STATE MACHINE //
+// States of the lock mechanism and the events that move it between them
+enum LockState
+{
+	LOCK_START,
+	LOCK_LOCKED,
+	LOCK_UNLOCKED,
+	LOCK_WAITING_TO_LOCK,
+	LOCK_SETTLING					// the door is closed, and is left to settle before it is locked
+};
+
+enum LockEvent
+{
+	EVENT_LOCK_COMMAND,
+	EVENT_UNLOCK_COMMAND,
+	EVENT_DOOR_CLOSED,
+	EVENT_DOOR_OPENED,
+	EVENT_DOOR_SETTLED				// the door stayed closed for DOOR_SETTLE_TIME
+};
+
+// The door is left to settle for DOOR_SETTLE_TIME before it is locked, so that the lock does not jam if it is slammed or swung
+// really hard. The wait is a deadline of the event loop: the main loop keeps running, and an unlock command or the door
+// opening again cancels it
+#define DOOR_SETTLE_TIME 1000			// Milliseconds
+
+// Everything the actions of the lock machine and of the button machine need
+typedef struct LockContext LockContext;
+struct LockContext
+{
+	GPIO_Handle gpio;
+	Logger* logger;
+	CommTransport* transport;
+	int command;					// Command applied to the lock machine (1 if lock, 0 if unlock)
+	uint32_t traceId;				// Trace ID of that command (0 if it is not traced)
+	uint64_t commandTime;			// CLOCK_MONOTONIC when that command arrived, in nanoseconds
+	int requested;					// Latest command received, ahead of command while a lock is held for the coalescing window
+	uint32_t requestedTraceId;
+	uint64_t requestedTime;			// CLOCK_MONOTONIC when the latest command arrived, in nanoseconds
+	uint64_t appliedAt;				// CLOCK_MONOTONIC when the command last changed, in nanoseconds
+	int held;						// Commands to lock received since the coalescing window was opened (0 if it is not open)
+	unsigned long requests;			// Commands received
+	unsigned long coalesced;		// Commands replaced by a newer one before they were applied
+	unsigned long movesSaved;		// Transitions of the lock machine (and servo moves) that coalescing avoided
+	int doorClosed;					// 1 while the photodiode sees the laser
+	uint64_t doorTime;				// CLOCK_MONOTONIC when the door was last closed, in nanoseconds
+	LatencyHistogram commandLatency;	// From a command arriving to the servo moving
+	LatencyHistogram doorLatency;		// From the door closing (while waiting to lock) to the door being locked
+	uint32_t servoPulse;			// Pulse width the servo was last moved to, in microseconds (0 if not known)
+	StateSnapshotFile* snapshot;	// Written once the state of the lock machine is also the state of the servo
+	Actuator* actuator;
+	EventLoop* loop;
+	int settleTimer;				// Event loop timer that only runs while the door settles
+	uint64_t settleFrom;			// CLOCK_MONOTONIC when the door that is settling was closed, in nanoseconds
+	uint64_t settleDeadline;		// CLOCK_MONOTONIC when the door will have settled, in nanoseconds
+	unsigned long settles;			// Times the door was left to settle
+	unsigned long settleUnlocks;	// Settles cancelled by a command to unlock
+	unsigned long settleOpens;		// Settles cancelled by the door opening again
+};
+
+void actionUnlock(void* context);
+void actionWaitToLock(void* context);
+void actionDoorReopened(void* context);
+void onButtonRelease(void* context);
+void onLockTransition(StateMachine* machine, const StateTransition* transition, uint64_t eventTime);
+void onServoMoved(LockContext* context, const ServoMove* move);
+void applyRequestedCommand(LockContext* context, uint64_t now);
+void logLockCounters(LockContext* context);
+
+static const StateTransition lockTransitions[] =
+{
+	{ LOCK_START, EVENT_LOCK_COMMAND, LOCK_WAITING_TO_LOCK, actionWaitToLock },	// it is not known yet if the door can be locked
+	{ LOCK_START, EVENT_UNLOCK_COMMAND, LOCK_UNLOCKED, actionUnlock },
+	{ LOCK_LOCKED, EVENT_UNLOCK_COMMAND, LOCK_UNLOCKED, actionUnlock },
+	{ LOCK_UNLOCKED, EVENT_LOCK_COMMAND, LOCK_WAITING_TO_LOCK, actionWaitToLock },
+	{ LOCK_WAITING_TO_LOCK, EVENT_UNLOCK_COMMAND, LOCK_UNLOCKED, actionUnlock },	// failsafe unlock, the servo may already be there
+	{ LOCK_WAITING_TO_LOCK, EVENT_DOOR_CLOSED, LOCK_SETTLING, NULL },		// onLockTransition() starts the settle deadline
+	{ LOCK_SETTLING, EVENT_DOOR_SETTLED, LOCK_LOCKED, NULL },				// onLockTransition() has the servo moved
+	{ LOCK_SETTLING, EVENT_UNLOCK_COMMAND, LOCK_UNLOCKED, actionUnlock },
+	{ LOCK_SETTLING, EVENT_DOOR_OPENED, LOCK_WAITING_TO_LOCK, actionDoorReopened }
+};
 
 // MAIN METHOD //
 int main(const int argc, const char *const argv[])
 {
 	
 	///////////////////////////////////////////////////////////////////////////////////// DEFAULT VARIABLE INITIALIZATION //
-	//Declare default variables and file paths that will be read from the configuration file
-	int timeout;					// Watchdog timout
-	int lockState;					// Initial lock state (1 for locked, 0 for unlocked)
-
-	char commFilePath[255];			// File path to the communication file shared between Pis
-	char lockLogFilePath[255];		// File path to the log file for the lock mechanism
-	char keyLogFilePath[255];		// File path to the log file for the remote access key
-
-	// Initialize default variables and file paths to those defined in the piLock.h header file
-	timeout = DEFAULT_TIMEOUT;
-	lockState = DEFAULT_LOCK_STATE;
-	
-	// Use the strCopy() function to copy the strings rather than point to the default strings in piLock.h
-	strCopy(commFilePath, COMM_FILE_PATH);
-	strCopy(lockLogFilePath, LOCK_LOG_FILE_PATH);
-	strCopy(keyLogFilePath, KEY_LOG_FILE_PATH);
+	// Declare the configuration that will be read from the configuration file and
+	// initialize it to the default values and file paths defined in the piLock.h header file
+	// The configuration is kept as two snapshots: the one in use, and the one a reload is parsed into and
+	// applied from before the two are swapped (see RELOAD THE CONFIGURATION in the main loop)
+	static LockConfig configs[2];
+	LockConfig* settings = &configs[0];
+	setDefaultConfig(settings);
 
 	// Extract the name of the program (while removing the "./") using findLength() and copyProgramName() for logging purposes later on
 	int length = findLength(argv[0]);
 	char programName[length + 1];
-	copyProgramName(programName, argv[0]);	char time[30]; 
+	copyProgramName(programName, argv[0]);
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	//////////////////////////////////////////////////////////////////////////////////////////// READING FROM CONFIG FILE //
-	// Open config file if possible invoking fopen() with "r" to set as a read-only file. 
-	// If config cannot be opened output a message to the user that the default values declared in the header will be used
-	FILE *config = fopen(CONFIG_FILE_PATH, "r");
-	if (!config)
+	// Map and parse the config file. Any parameter it does not set (or sets to an invalid value, which is
+	// reported on stderr) keeps the default value declared in the header. If the file cannot be read, output a message to the user
+	if (loadConfig(CONFIG_FILE_PATH, settings) != 0)
 	{
 		perror("The config file could not be opened; using default values");
 	}
-	else
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+	////////////////////////////////////////////////////////////////////////////////////////////// SET UP THE EVENT LOOP //
+	// Every wakeup of the main loop comes from one epoll instance. SIGTERM and SIGINT (stop cleanly, so that the logger is
+	// flushed) and SIGHUP (reload the configuration) are read from a signalfd, which needs them blocked before the logger,
+	// the watchdog supervisor and pigpio start their threads
+	EventLoop loop;
+	const int signals[] = { SIGTERM, SIGINT, SIGHUP };
+	if (initEventLoop(&loop) != 0 || addSignalSource(&loop, signals, 3, handleStopOrReloadSignal, NULL) < 0)
 	{
-		// Read the configuration file once opened and 
-		readConfig(config, &timeout, &lockState, commFilePath, lockLogFilePath, keyLogFilePath);
+		perror("The event loop could not be set up");
+		return -1;
 	}
-	fclose(config);
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////////////// SET UP WRITING TO LOG FILE //
-	// Attempt to open log file invoking fopen() with "r" to see if the file exists
-	FILE *logFile = fopen(lockLogFilePath, "r");
-	if (!logFile)
-	{
-		// If the file does not exist, create a new file at the lockLogFilePath (either default or configuration based)
-		// by invoking fopen() with "a" and immediately write a message that a new log file was created
-		logFile = fopen(lockLogFilePath, "a");
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "# A new log file was created\n\n");
-		fclose(logFile);
-	}
-	fclose(logFile);
-	logFile = fopen(lockLogFilePath, "a");
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The log file has been opened.\n\n");
-	PRINT_MSG(logFile, time, programName, "# The program has started. \n\n");
+	// Open the log file once and start the logger thread, which writes queued messages to the file in batches.
+	// The log file is created at lockLogFilePath (either default or configuration based) if it does not exist yet
+	static Logger logger;
+	if (initLogger(&logger, settings->lockLogFilePath, programName, settings->logFlushInterval, settings->logSummaryInterval, settings->logFormat) != 0)
+	{
+		perror("The log file could not be opened");
+		return -1;
+	}
+	if (logger.created)
+	{
+		PRINT_MSG(&logger, "# A new log file was created\n\n");
+	}
+	PRINT_MSG(&logger, "# The log file has been opened.\n\n");
+	PRINT_MSG(&logger, "# The program has started. \n\n");
+
+	// Keep the log file from growing forever: it is rotated every LOG_SEGMENT_SIZE kilobytes by the logger thread
+	setLogRotation(&logger, settings->logSegmentSize, settings->logSegmentCount, settings->logCompress);
+
+	// Reload the configuration on SIGHUP, or as soon as the config file is changed
+	CommWatcher configWatcher;
+	if (initCommWatcher(&configWatcher, CONFIG_FILE_PATH) != 0)
+	{
+		configWatcher.fd = -1;
+		PRINT_MSG(&logger, "The config file cannot be watched, send SIGHUP to reload it\n\n");
+	}
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+	/////////////////////////////////////////////////////////////////////////////////////////////// READ THE STATE SNAPSHOT //
+	// The snapshot holds the state the lock was in when it stopped (or was reset by the watchdog), the last command and the
+	// position of the servo. If there is one, the lock resumes from it below instead of starting over, and its command is
+	// used until the transport reports one
+	StateSnapshotFile snapshot;
+	int snapshotFound = openStateSnapshot(&snapshot, settings->stateFilePath);
+	if (snapshotFound < 0)
+	{
+		PRINT_MSG(&logger, "The lock state snapshot could not be opened, the lock state will not survive a restart\n\n");
+	}
+	else if (snapshotFound == 1)
+	{
+		settings->lockState = snapshot.last.command;
+	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////// OPEN COMM FILE //
 	// Attempt to open log file invoking fopen() with "r" to see if the file exists
-	FILE *commFile = fopen(commFilePath, "r");
+	FILE *commFile = fopen(settings->commFilePath, "r");
 	if (!commFile)
 	{
 		// If the comm file does not exist, write to the log file that a comm file was created
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "A new communication file was created\n\n");
+		PRINT_MSG(&logger, "A new communication file was created\n\n");
+	}
+	else
+	{
+		fclose(commFile);
+	}
+	// Open comm file using fopen() with "a". A new file will automatically be created at commFilePath (default or configuration based)
+	// if it does not exist. An existing file is left as it is, so the last command survives a restart
+	commFile = fopen(settings->commFilePath, "a");
+	if (commFile)
+	{
+		fclose(commFile);
 	}
-	fclose(commFile);
-	// Open comm file using fopen() with "w". A new file will automatically be created at commFilePath (default or configuration based)
-	// if it does not exist
-	commFile = fopen(commFilePath, "w");
-	fclose(commFile);
 
 	// Print message to the log file that the communication file was successfuly opened
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The communication file has been opened.\n\n");
+	PRINT_MSG(&logger, "# The communication file has been opened.\n\n");
+
+	// Open the transport selected in the configuration file (the communication file or a shared memory record)
+	// The file transport watches the communication file so it is only re-read once it has been changed
+	CommTransport transport;
+	if (openCommTransport(&transport, settings, COMM_ROLE_LOCK) != 0)
+	{
+		PRINT_MSG(&logger, "The command transport could not be opened!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+	if (transport.type == COMM_TRANSPORT_SHM)
+	{
+		PRINT_MSG(&logger, "# Reading commands from the shared memory record.\n\n");
+	}
+	else if (transport.type == COMM_TRANSPORT_UDP)
+	{
+		PRINT_MSG(&logger, "# Listening for commands over UDP and TCP, the communication file is kept as a fallback.\n\n");
+		if (settings->commSecret[0] == 0)
+		{
+			PRINT_MSG(&logger, "COMM_SECRET is not set, the commands received over the network are refused\n\n");
+		}
+	}
+	else if (transport.watcher.mode == COMM_WATCH_INOTIFY)
+	{
+		PRINT_MSG(&logger, "# Watching the communication file with inotify.\n\n");
+	}
+	else
+	{
+		PRINT_MSG(&logger, "# Polling the status of the communication file on a timer.\n\n");
+	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	
 	
 	///////////////////////////////////////////////////////////////////////////////////////////// WATCHDOG INITIALIZATION //
-	int watchdog;
-	if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY)) < 0)
+	// The sim GPIO backend runs without a Pi, so there is no watchdog to open and watchdog stays -1
+	int watchdog = -1;
+	if (settings->gpioBackend == GPIO_BACKEND_SIM)
 	{
-		printf("Error: Couldn't open watchdog device! %d\n", watchdog);
-		return -1;
+		PRINT_MSG(&logger, "# The sim GPIO backend is in use, the Watchdog is not opened\n\n");
+	}
+	else
+	{
+		if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+		{
+			printf("Error: Couldn't open watchdog device! %d\n", watchdog);
+			PRINT_MSG(&logger, "The Watchdog file could not be opened!\n\n");
+			closeLogger(&logger);
+			return -1;
+		}
+		PRINT_MSG(&logger, "# The Watchdog file has been opened\n\n");
 	}
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The Watchdog file has been opened\n\n");
-
-	ioctl(watchdog, WDIOC_SETTIMEOUT, &timeout);
-
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "# The Watchdog time limit has been set\n\n");
 
-	//The value of timeout will be changed to whatever the current time limit of the watchdog timer is
-	ioctl(watchdog, WDIOC_GETTIMEOUT, &timeout);
+	// The watchdog is kicked by the supervisor thread, and only while the state machine, the logger and the transport all
+	// show heartbeats. The time limit is set here, and the value of timeout is changed to whatever the driver actually uses
+	WatchdogSupervisor supervisor;
+	if (initWatchdogSupervisor(&supervisor, watchdog, settings->timeout, &logger) != 0)
+	{
+		PRINT_MSG(&logger, "The Watchdog supervisor could not be set up!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+	settings->timeout = supervisor.timeout;
+	PRINT_MSG(&logger, "# The Watchdog time limit has been set\n\n");
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 	////////////////////////////////////////////////////////////////////////////////// INITIALIZE GPIO FOR BOTH LIBRARIES //
+	// Select the GPIO backend from the configuration file (the registers of the Pi, or simulated ones) before mapping it
+	selectGpioBackend(settings->gpioBackend, settings->gpioWaveformPath);
 	GPIO_Handle gpio;
 	gpio = gpiolib_init_gpio();
 	if (gpio == NULL)
 	{
-		getTime(time);
-		PRINT_MSG(logFile, time, programName, "GPIO could not be initialized!\n\n");
+		PRINT_MSG(&logger, "GPIO could not be initialized!\n\n");
+		closeLogger(&logger);
 		return -1;
 	}
 
-	gpioInitialise();
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The GPIO pins have been initialized\n\n");
+	// pigpio needs the hardware of the Pi, so it is not started with the sim GPIO backend (the servo is then left alone)
+	pigpioReady = (settings->gpioBackend != GPIO_BACKEND_SIM && gpioInitialise() >= 0);
+	PRINT_MSG(&logger, "The GPIO pins have been initialized\n\n");
 
 	// SET PIN I/O CONFIGURATION //
 	selectPin(gpio, GREEN_LED, 1);
@@ -180,268 +384,839 @@ int main(const int argc, const char *const argv[])
 	selectPin(gpio, BUTTON, 0);
 	selectPin(gpio, PHOTODIODE, 0);
 	// PIGPIO will handle the servo pin
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "Pin 14, 15, 18 have been set to output\n Pin 23, 24 have been set to input\n\n");
+	PRINT_MSG(&logger, "Pin 14, 15, 18 have been set to output\n Pin 23, 24 have been set to input\n\n");
 	// INTIALIZE OUTPUT PINS //
-	clearPin(gpio, GREEN_LED);
-	clearPin(gpio, RED_LED);
+	clearPins(gpio, PIN_MASK(GREEN_LED) | PIN_MASK(RED_LED));
+
+	// REGISTER EDGE CALLBACKS //
+	// pigpio samples the inputs and calls onGpioEdge() for every edge that lasted DEBOUNCE_TIME, so the main loop can sleep until one arrives.
+	// If the alerts cannot be registered the sensor thread debounces the pins instead, every DEBOUNCE_POLL_INTERVAL_MS
+	int edgeAlerts = 0;
+	Debouncer debouncer;
+	initDebouncer(&debouncer, gpio, PIN_MASK(BUTTON) | PIN_MASK(PHOTODIODE), settings->debounceTime);
+	if (initSpscRing(&edgeRing, sizeof(GpioEdge)) != 0)
+	{
+		PRINT_MSG(&logger, "The edge ring could not be set up!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+	if (pigpioReady)
+	{
+		edgeAlerts = (gpioGlitchFilter(BUTTON, settings->debounceTime * 1000) == 0 && gpioGlitchFilter(PHOTODIODE, settings->debounceTime * 1000) == 0
+			&& gpioSetAlertFunc(BUTTON, onGpioEdge) == 0 && gpioSetAlertFunc(PHOTODIODE, onGpioEdge) == 0);
+		if (!edgeAlerts)
+		{
+			// The sensor thread must then be the only producer of the edge ring: undo whatever part was registered
+			gpioSetAlertFunc(BUTTON, NULL);
+			gpioSetAlertFunc(PHOTODIODE, NULL);
+			gpioGlitchFilter(BUTTON, 0);
+			gpioGlitchFilter(PHOTODIODE, 0);
+		}
+	}
+	if (edgeAlerts)
+	{
+		PRINT_MSG(&logger, "# Waiting for edges on pin 23, 24 with pigpio alerts\n\n");
+	}
+	else
+	{
+		PRINT_MSG(&logger, "The pigpio alerts could not be registered, the pins will be polled\n\n");
+	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// Close logFile before entering main execution loop to fully write messages to log file
-	fclose(logFile);
 	
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////// MAIN EXECUTION LOOP //
-	// Initialize the integer currentCommand which stores the value of the integer in the communication file
-	int currentCommand = 0;
-
-	// Create enum LockState for use in the state machine controlling the lock mechanism
-	enum LockState
-	{
-		START,
-		LOCKED,
-		UNLOCKED,
-		WAITING_TO_LOCK
-	};
-	enum LockState lockState = START;
-
-	// Initialize the integer currentButtonValue (stores the current state of the pin connected to the button)
-	int currentButtonValue = readPin(gpio, BUTTON);
-	// Initialize the integer lastButtonValue (stores the previous state of the pin connected to the button)
-	// Used to compare with currentButtonValue to determine if the button state has changed or not
-	int lastButtonValue = readPin(gpio, BUTTON);
-
-	// Create and enum buttonState for use in the state machine receiving input from the button
-	// and controlling the commands written to the communication file
-	enum buttonState
-	{
-		START,
-		PRESSED,
-		UNPRESSED
-	};
-	enum buttonState buttonState = START;
+	// The lock mechanism and the button are driven by the transition tables at the top of this file.
+	// The context holds everything their actions need, along with the latency histograms filled by onLockTransition()
+	Actuator actuator;
+	LockContext context;
+	context.gpio = gpio;
+	context.logger = &logger;
+	context.transport = &transport;
+	context.command = transport.command;		// latest command (1 if lock, 0 if unlock), refreshed once the transport reports a new one
+	context.traceId = transport.traceId;
+	context.commandTime = monotonicNanoseconds();
+	context.requested = context.command;
+	context.requestedTraceId = context.traceId;
+	context.requestedTime = context.commandTime;
+	context.appliedAt = 0;
+	context.held = 0;
+	context.requests = 0;
+	context.coalesced = 0;
+	context.movesSaved = 0;
+	context.doorClosed = readDebouncedPin(&debouncer, PHOTODIODE);	// 1 while the laser hits the photodiode, i.e. the door is closed
+	context.doorTime = context.commandTime;
+	initLatencyHistogram(&context.commandLatency, "Command received to servo moved");
+	initLatencyHistogram(&context.doorLatency, "Door closed to locked");
+	context.servoPulse = 0;
+	context.snapshot = &snapshot;
+	context.actuator = &actuator;
+	context.loop = &loop;
+	context.settleTimer = -1;
+	context.settleFrom = 0;
+	context.settleDeadline = 0;
+	context.settles = 0;
+	context.settleUnlocks = 0;
+	context.settleOpens = 0;
+
+	// Resume the state of the snapshot. The servo is already where the snapshot says, so it is not moved; only the LEDs
+	// (cleared when the Pi restarted) are set again. A command that arrived while the lock was down moves it as usual
+	int initialState = LOCK_START;
+	if (snapshotFound == 1 && (snapshot.last.state == LOCK_LOCKED || snapshot.last.state == LOCK_UNLOCKED || snapshot.last.state == LOCK_WAITING_TO_LOCK))
+	{
+		initialState = snapshot.last.state;
+		context.servoPulse = snapshot.last.servoPulse;
+		if (context.servoPulse == LOCKED_FREQUENCY)
+		{
+			PIN_CLEAR(gpio, GREEN_LED);
+			PIN_SET(gpio, RED_LED);
+		}
+		else if (context.servoPulse == UNLOCKED_FREQUENCY)
+		{
+			PIN_CLEAR(gpio, RED_LED);
+			PIN_SET(gpio, GREEN_LED);
+		}
+
+		char message[128];
+		snprintf(message, sizeof(message), "# The lock state has been restored from the snapshot: %s\n\n",
+			(initialState == LOCK_LOCKED) ? "locked" : (initialState == LOCK_UNLOCKED) ? "unlocked" : "waiting to lock");
+		PRINT_MSG(&logger, message);
+	}
+
+	StateMachine lockMachine;
+	initStateMachine(&lockMachine, lockTransitions, sizeof(lockTransitions) / sizeof(lockTransitions[0]), initialState, &context);
+	lockMachine.onTransition = onLockTransition;
+
+	StateTransition buttonTable[BUTTON_TRANSITIONS];
+	StateMachine buttonMachine;
+	initButtonMachine(&buttonMachine, buttonTable, onButtonRelease, &context);
+
+	// START THE SENSOR AND ACTUATOR THREADS //
+	// The sensor thread is only needed without the pigpio alerts, and takes the debouncer over from here.
+	// Both threads start with SIGTERM, SIGINT and SIGHUP blocked, so the signals still only reach the event loop
+	Sensor sensor;
+	sensor.gpio = gpio;
+	sensor.debouncer = &debouncer;
+	atomic_init(&sensor.debounceTime, settings->debounceTime);
+	atomic_init(&sensor.running, 1);
+	atomic_init(&sensor.heartbeat, 0);
+	if (!edgeAlerts && pthread_create(&sensor.thread, NULL, sensorThread, &sensor) != 0)
+	{
+		PRINT_MSG(&logger, "The sensor thread could not be started!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+
+	actuator.gpio = gpio;
+	actuator.logger = &logger;
+	atomic_init(&actuator.heartbeat, 0);
+	if (initSpscRing(&actuator.moves, sizeof(ServoMove)) != 0 || initSpscRing(&actuator.done, sizeof(ServoMove)) != 0
+		|| pthread_create(&actuator.thread, NULL, actuatorThread, &actuator) != 0)
+	{
+		PRINT_MSG(&logger, "The actuator thread could not be started!\n\n");
+		closeLogger(&logger);
+		return -1;
+	}
+
+	// The main loop sleeps in the event loop on the edge ring, the servo moves done, the config file watcher, the descriptors of the
+	// transport and a heartbeat timer. It wakes up on an edge, on a move done, on a new command, on a change of the configuration, on a
+	// signal or when its heartbeats are due for the watchdog supervisor, and never otherwise
+	addEventSource(&loop, edgeRing.wakeFd, NULL, NULL);
+	addEventSource(&loop, actuator.done.wakeFd, NULL, NULL);
+	if (configWatcher.fd >= 0)
+	{
+		addEventSource(&loop, configWatcher.fd, NULL, NULL);
+	}
+	addCommTransportSources(&loop, &transport);
+	int heartbeatTimer = addTimerSource(&loop, heartbeatInterval(&supervisor), NULL, NULL);
+	int coalesceTimer = addTimerSource(&loop, 0, NULL, NULL);	// only runs while commands are held
+	context.settleTimer = addTimerSource(&loop, 0, NULL, NULL);
+
+	int buttonEdges[MAX_BUTTON_EDGES];
+	atomic_ulong machineHeartbeat;
+	atomic_ulong transportHeartbeat;
+	atomic_init(&machineHeartbeat, 0);
+	atomic_init(&transportHeartbeat, 0);
+	addWatchdogSource(&supervisor, "lock state machine", &machineHeartbeat, -1);
+	addWatchdogSource(&supervisor, "logger", &logger.heartbeat, logger.wakeFd);
+	addWatchdogSource(&supervisor, "command transport", &transportHeartbeat, -1);
+	addWatchdogSource(&supervisor, "actuator", &actuator.heartbeat, actuator.moves.wakeFd);
+	if (!edgeAlerts)
+	{
+		addWatchdogSource(&supervisor, "sensor", &sensor.heartbeat, -1);
+	}
+	if (startWatchdogSupervisor(&supervisor) != 0)
+	{
+		PRINT_MSG(&logger, "The Watchdog supervisor could not be started!\n\n");
+	}
+	uint64_t nextLatencyReport = monotonicNanoseconds() + LATENCY_REPORT_INTERVAL * 1000000000ULL;
+	int wakeNow = 1;
+	int commandCarried = 0;			// 1 if a command taken from a replaced transport has not been handled yet
 
 	// Enter main execution loop in which the button state will continuously be read
 	// and the lock mechanism will continously be controlled based on the command stored in the communication file
-	while (1)
+	while (!stopRequested)
 	{
-		
-		currentButtonValue = readPin(gpio, BUTTON);	// read the current state of the pin connected to the button
-
-		switch (buttonState)
+		// Sleep until one of the sources is ready (not at all on the first pass). The sources are read by the rest of the pass
+		runEventLoop(&loop, wakeNow ? 0 : -1);
+		wakeNow = 0;
+		uint64_t now = monotonicNanoseconds();
+
+		// Take the servo moves the actuator thread has done
+		ServoMove move;
+		waitSpscRing(&actuator.done, 0);
+		while (popSpscRing(&actuator.done, &move))
 		{
-		case START:
-			if (currentButtonValue)					
-			{
-				buttonState = PRESSED;		// Initial case transition to PRESSED if the button pin reads HIGH 
-			}
-			else
-			{
-				buttonState = UNPRESSED;	// Else if button is not pressed transition to UNPRESSED
-			}
-			break;
-
-		case PRESSED:
+			onServoMoved(&context, &move);
+		}
 
-			if (!currentButtonValue && lastButtonValue) 	// button was pressed in previous loop and has been released -> write a command to the communication file based on the previous state of the
+		// Collect the button levels seen since the last pass, in order, so that a short press is never missed
+		int buttonEdgeCount = 0;
+		int photodiodeValue = context.doorClosed;
+		if (edgeAlerts && buttonMachine.state == BUTTON_START)
+		{
+			buttonEdges[buttonEdgeCount++] = readDebouncedPin(&debouncer, BUTTON);
+		}
+		else if (waitSpscRing(&edgeRing, 0))
+		{
+			GpioEdge edge;
+			while (buttonEdgeCount < MAX_BUTTON_EDGES && popSpscRing(&edgeRing, &edge))
 			{
-				if (readCommunicationFile(commFilePath))	// if the previous command stored in the communication file is a 1 (locked)
+				if (edge.gpio == BUTTON)
 				{
-					commFile = fopen(commFilePath, "w");	// Open the communication file
-                    			fprintf(commFile, "0");			// Write a 0 to the communication file indicating that the new command is to unlock the door
-					fclose(commFile);			// Close the communication file to finish writing
-
-					// Write to the log file that a command has been written to the communication file to unlock the door
-					getTime(time);
-					logFile = fopen(lockLogFilePath, "a");
-					PRINT_MSG(logFile, time, programName, "Wrote command to unlock the door to communication file\n");
-					fclose(logFile);     			// Close the log file to finish writing
+					buttonEdges[buttonEdgeCount++] = edge.level;
 				}
-				else 										// if the previous command stored in the communication file is a 0 (unlocked)
+				else if (edge.gpio == PHOTODIODE)
 				{
-					commFile = fopen(commFilePath, "w");	// Open the communication file
-					fprintf(commFile, "1");			// Write a 1 to the communication file indicating that the new command is to lock the door
-					fclose(commFile);			// Close the communication file to finish writing
-
-					// Write to the log file that a command has been written to the communication file to lock the door
-					getTime(time);
-					logFile = fopen(lockLogFilePath, "a");
-					PRINT_MSG(logFile, time, programName, "Wrote command to lock the door to communication file\n");
-					fclose(logFile);			// Close the log file to finish writing
-                		}
-                		buttonState = UNPRESSED;
+					photodiodeValue = edge.level;
+				}
 			}
-			break;
-
-		case UNPRESSED:
+			wakeNow = (buttonEdgeCount == MAX_BUTTON_EDGES);	// the rest of the edges are taken on the next pass
+		}
 
-			if (currentButtonValue && !lastButtonValue) 	// button is pressed and was pressed in the previous loop
-			{
-				buttonState = PRESSED;			// Simply change the buttonState to pressed as commands are only written to the communication file upon button release
-			}
-			break;
+		// Feed every button level to the button machine; releasing the button writes the opposite of the current command
+		for (int edge = 0; edge < buttonEdgeCount; ++edge)
+		{
+			fireStateEvent(&buttonMachine, buttonEdges[edge] ? EVENT_BUTTON_DOWN : EVENT_BUTTON_UP, now);
 		}
-		lastButtonValue = currentButtonValue;			// Assign current button state to previous button state for next iteration
 
 		/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		currentCommand = readCommunicationFile(commFilePath); 	// Read communication file and assign command to int currentCommand (1 if lock, 0 if unlock)
-
-		switch (lockState)
+		int polled = pollCommTransport(&transport);
+		if (commandCarried && polled >= 0)
 		{
-		case START:
-
-			if (currentCommand)				// If the current command received is 1 or to lock the door
+			commandCarried = 0;
+			polled = 1;		// the last command of the replaced transport, or a newer one
+		}
+		if (polled >= 0)
+		{
+			REPORT_HEARTBEAT(transportHeartbeat);
+		}
+		if (polled == 1 && transport.command != context.requested)	// Only read the command once the transport reports that it has changed
+		{
+			context.requested = transport.command; 	// Remember the new command (1 if lock, 0 if unlock) and when it arrived
+			context.requestedTime = now;
+			context.requestedTraceId = transport.traceId;
+			context.requests++;
+			logTrace(&logger, context.requestedTraceId, "observe", now);
+
+			// A command to lock is applied right away, unless the last command was applied less than COMMAND_COALESCE_WINDOW
+			// ago (e.g. the button is being mashed). It is then held until the window is over, and is dropped if a command
+			// to unlock comes first. A command to unlock is never held: nobody should wait at the door to get in
+			uint64_t windowEnd = context.appliedAt + settings->coalesceWindow * 1000000ULL;
+			if (context.requested == 0)
 			{
-				// Write to the log file that a command to lock the door has been received
-				logFile = fopen(lockLogFilePath, "a");
-				getTime(time);		
-				PRINT_MSG(logFile, time, programName, LOCK_COMMAND_MESSAGE);	
-				fclose(logFile);
-				
-				// Transition to the WAITING TO LOCK state as it is not known yet if the door can be locked
-				lockState = WAITING_TO_LOCK;
+				if (context.held > 0)
+				{
+					context.held++;		// the unlock replaces the held lock, so it is counted with it
+					setTimerSource(&loop, coalesceTimer, 0);
+				}
+				applyRequestedCommand(&context, now);
+			}
+			else if (context.held == 0 && now >= windowEnd)
+			{
+				applyRequestedCommand(&context, now);
 			}
 			else
 			{
-				// Otherwise write to the log file that a command to unlock the door has been received
-				getTime(time);
-				logFile = fopen(lockLogFilePath, "a");
-				PRINT_MSG(logFile, time, programName, UNLOCK_COMMAND_MESSAGE);
-
-				// Unlock the door before printing a message to the log file that the door has been successfully unlocked
-				unlock(gpio);
-
-				PRINT_MSG(logFile, time, programName, UNLOCKED_MESSAGE);
-				fclose(logFile);
-
-				// Transition to UNLOCKED state
-				lockState = UNLOCKED;
+				if (context.held++ == 0)
+				{
+					setTimerSource(&loop, coalesceTimer, (int) ((windowEnd - now) / 1000000ULL) + 1);
+				}
+				PRINT_MSG(&logger, "Received command to LOCK, held until the coalescing window is over \n");
 			}
-			break;
+		}
+		if (context.held > 0 && now >= context.appliedAt + settings->coalesceWindow * 1000000ULL)
+		{
+			setTimerSource(&loop, coalesceTimer, 0);
+			applyRequestedCommand(&context, now);
+		}
 
-		case LOCKED:
+		////////////////////////////////////////////////////////////////////////////////////////// RELOAD THE CONFIGURATION //
+		// The new configuration is parsed into the spare snapshot and applied one part at a time; the part that cannot be
+		// applied keeps its current value. The snapshots are then swapped, between two passes of the loop, so the rest of
+		// the loop never sees a half applied configuration. The lock state machine and pigpio are left running
+		if (reloadRequested || (configWatcher.fd >= 0 && commFileChanged(&configWatcher) == 1))
+		{
+			reloadRequested = 0;
+			LockConfig* update = (settings == &configs[0]) ? &configs[1] : &configs[0];
+			setDefaultConfig(update);
 
-			if (!currentCommand)		// Continuously check if a command to unlock the door is received from the communication file
+			if (loadConfig(CONFIG_FILE_PATH, update) != 0)
 			{
-				// If a command is received to unlock the door, write to the log file that the command was recieved
-				getTime(time);
-				logFile = fopen(lockLogFilePath, "a");
-				PRINT_MSG(logFile, time, programName, UNLOCK_COMMAND_MESSAGE);
-
-				// Unlock the door before printing a message to the log file that the door has been successfully unlocked
-				unlock(gpio);
-
-				PRINT_MSG(logFile, time, programName, UNLOCKED_MESSAGE);
-				fclose(logFile);
-
-				// Transition to UNLOCKED state
-				lockState = UNLOCKED;
+				PRINT_MSG(&logger, "The config file could not be read, the current configuration is kept\n\n");
 			}
-			break;
+			else
+			{
+				// Watchdog: the supervisor kicks it with the new time limit right away, and times its next kicks from it
+				if (update->timeout != settings->timeout)
+				{
+					update->timeout = setWatchdogTimeout(&supervisor, update->timeout);
+					setTimerSource(&loop, heartbeatTimer, heartbeatInterval(&supervisor));
+					PRINT_MSG(&logger, "# The Watchdog time limit has been changed\n\n");
+				}
 
-		case UNLOCKED:
+				// Log file: the writer thread moves to the new file once everything queued has been written to the old one
+				if (!strCompare(update->lockLogFilePath, settings->lockLogFilePath) ||
+					update->logFlushInterval != settings->logFlushInterval || update->logSummaryInterval != settings->logSummaryInterval)
+				{
+					if (reopenLogger(&logger, update->lockLogFilePath, update->logFlushInterval, update->logSummaryInterval) == 0)
+					{
+						PRINT_MSG(&logger, "# The log file has been opened.\n\n");
+					}
+					else
+					{
+						strCopy(update->lockLogFilePath, settings->lockLogFilePath);
+						PRINT_MSG(&logger, "The new log file could not be opened, the current one is kept\n\n");
+					}
+				}
+				// Rotation: the new limits apply to the active segment right away, which is preallocated again
+				if (!strCompare(update->lockLogFilePath, settings->lockLogFilePath) || update->logSegmentSize != settings->logSegmentSize ||
+					update->logSegmentCount != settings->logSegmentCount || update->logCompress != settings->logCompress)
+				{
+					setLogRotation(&logger, update->logSegmentSize, update->logSegmentCount, update->logCompress);
+				}
 
-			if (currentCommand)		// Continously check if a command to lock the door is received from the communication file
-			{
-				// If a command is received to lock the door but the PHOTODIODE is not reading that the laser is hitting it (i.e. reading that the door is not closed)
-				if (!readPin(gpio, PHOTODIODE))
+				// Transport: once the new transport is open the old one is polled one last time, as a command may have
+				// reached it since it was polled above. The new transport starts from the last command of the old one,
+				// which the next pass of the loop handles if it is new, and only reports the commands that arrive on it
+				if (update->commTransport != settings->commTransport || update->commPort != settings->commPort ||
+					!strCompare(update->commBindAddress, settings->commBindAddress) ||
+					!strCompare(update->commFilePath, settings->commFilePath) || !strCompare(update->shmFilePath, settings->shmFilePath))
 				{
-					// Print to the log file that the command to lock has been successfully read from the log file, 
-					// but the door is open and the program will wait until the door is closed to lock the door
-					getTime(time);
-					logFile = fopen(lockLogFilePath, "a");
-					PRINT_MSG(logFile, time, programName, LOCK_COMMAND_MESSAGE);
-					PRINT_MSG(logFile, time, programName, "The door is open, waiting until door is closed to lock \n");
-					fclose(logFile);
+					CommTransport replacement;
+					if (openCommTransport(&replacement, update, COMM_ROLE_LOCK) == 0)
+					{
+						while (pollCommTransport(&transport) == 1);
+						if (transport.command != context.requested)
+						{
+							commandCarried = 1;
+							wakeNow = 1;
+						}
+						replacement.command = transport.command;
+						replacement.traceId = transport.traceId;
+						if (replacement.type == COMM_TRANSPORT_UDP && transport.type == COMM_TRANSPORT_UDP)
+						{
+							// Keep the replay protection of the old transport, which covers the time since the start
+							replacement.session = transport.session;
+							replacement.sequence = transport.sequence;
+							replacement.sendTime = transport.sendTime;
+							replacement.openTime = transport.openTime;
+						}
+						removeCommTransportSources(&loop, &transport);
+						closeCommTransport(&transport);
+						transport = replacement;
+						addCommTransportSources(&loop, &transport);
+						PRINT_MSG(&logger, "# The command transport has been changed\n\n");
+					}
+					else
+					{
+						update->commTransport = settings->commTransport;
+						update->commPort = settings->commPort;
+						strCopy(update->commBindAddress, settings->commBindAddress);
+						strCopy(update->commFilePath, settings->commFilePath);
+						strCopy(update->shmFilePath, settings->shmFilePath);
+						PRINT_MSG(&logger, "The new command transport could not be opened, the current one is kept\n\n");
+					}
+				}
+				// Secret: the packets that arrive from now on are checked with the new one
+				if (!strCompare(update->commSecret, settings->commSecret))
+				{
+					strCopy(transport.secret, update->commSecret);
+				}
+				if (transport.type == COMM_TRANSPORT_UDP && update->commSecret[0] == 0)
+				{
+					PRINT_MSG(&logger, "COMM_SECRET is not set, the commands received over the network are refused\n\n");
 				}
-				// In any case, transition to the WAITING TO LOCK state
-				lockState = WAITING_TO_LOCK;
-			}
-			break;
 
-		case WAITING_TO_LOCK:
-			if (!currentCommand) 	// Even in the WAITING TO LOCK state, continously check if a command to unlock the door is received from the communication file
-			{
-				// If so print a message to the log file that a command has been received to unlock the door
-				getTime(time);
-				logFile = fopen(lockLogFilePath, "a");
-				PRINT_MSG(logFile, time, programName, UNLOCK_COMMAND_MESSAGE);
+				// Debounce time: the sensor thread picks it up on its next sample
+				if (update->debounceTime != settings->debounceTime)
+				{
+					if (edgeAlerts)
+					{
+						initDebouncer(&debouncer, gpio, PIN_MASK(BUTTON) | PIN_MASK(PHOTODIODE), update->debounceTime);
+						gpioGlitchFilter(BUTTON, update->debounceTime * 1000);
+						gpioGlitchFilter(PHOTODIODE, update->debounceTime * 1000);
+					}
+					else
+					{
+						atomic_store(&sensor.debounceTime, update->debounceTime);
+					}
+				}
 
-				// Although the door should not be locked in this state, add a failsafe unlock command to tell the servo to move to that position if it is already not
-				// If the servo is already in the unlocked position, this command will not have any bad effects
-				unlock(gpio);
+				// State snapshot: the current state is written to the new file right away
+				if (!strCompare(update->stateFilePath, settings->stateFilePath))
+				{
+					StateSnapshotFile replacement;
+					if (openStateSnapshot(&replacement, update->stateFilePath) >= 0)
+					{
+						closeStateSnapshot(&snapshot);
+						snapshot = replacement;
+						saveStateSnapshot(&snapshot, lockMachine.state, context.command, context.traceId, context.servoPulse);
+						PRINT_MSG(&logger, "# The lock state snapshot has been moved\n\n");
+					}
+					else
+					{
+						strCopy(update->stateFilePath, settings->stateFilePath);
+						PRINT_MSG(&logger, "The new lock state snapshot could not be opened, the current one is kept\n\n");
+					}
+				}
+
+				// The GPIO backend is only chosen when the program starts
+				if (update->gpioBackend != settings->gpioBackend || !strCompare(update->gpioWaveformPath, settings->gpioWaveformPath))
+				{
+					update->gpioBackend = settings->gpioBackend;
+					strCopy(update->gpioWaveformPath, settings->gpioWaveformPath);
+					PRINT_MSG(&logger, "GPIO_BACKEND and GPIO_WAVEFORM_PATH only take effect when the program is restarted\n\n");
+				}
 
-				PRINT_MSG(logFile, time, programName, UNLOCKED_MESSAGE);
-				fclose(logFile);
+				// So is the format of the log file, which would otherwise mix text lines and binary records
+				if (update->logFormat != settings->logFormat)
+				{
+					update->logFormat = settings->logFormat;
+					PRINT_MSG(&logger, "LOG_FORMAT only takes effect when the program is restarted\n\n");
+				}
 
-				// Transition back to the UNLOCKED state
-				lockState = UNLOCKED;
+				settings = update;
+				PRINT_MSG(&logger, "# The configuration has been reloaded\n\n");
 			}
+		}
+		/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+		if (photodiodeValue && !context.doorClosed)
+		{
+			context.doorTime = now;				// Remember when the door was closed
+		}
+		context.doorClosed = photodiodeValue;
 
-			if (readPin(gpio, PHOTODIODE)) 		// Continously read the photodiode to see if the laser hits the photodiode (i.e. the door has been closed)
-			{
-				usleep(1000000);		// Sleep for 1 second to prevent the door from jamming on the lock if it is slammed or swung really hard
-				lock(gpio);			// Execute the command to lock the door
+		// The command and the door are levels: they are given to the lock machine on every pass, and only cause a
+		// transition from the states that care about them (e.g. a command to lock does nothing once LOCKED)
+		fireStateEvent(&lockMachine, context.command ? EVENT_LOCK_COMMAND : EVENT_UNLOCK_COMMAND, context.commandTime);
+		if (context.doorClosed)
+		{
+			// The door only counts from the moment the lock started waiting for it
+			fireStateEvent(&lockMachine, EVENT_DOOR_CLOSED, (context.doorTime > lockMachine.enteredAt) ? context.doorTime : lockMachine.enteredAt);
+		}
+		else
+		{
+			fireStateEvent(&lockMachine, EVENT_DOOR_OPENED, now);
+		}
+		if (lockMachine.state == LOCK_SETTLING && now >= context.settleDeadline)
+		{
+			fireStateEvent(&lockMachine, EVENT_DOOR_SETTLED, context.settleFrom);	// the door latency still counts from the door closing
+		}
 
-				// Write to the log file that the door was successfully locked
-				getTime(time);
-				logFile = fopen(lockLogFilePath, "a");
-				PRINT_MSG(logFile, time, programName, LOCKED_MESSAGE);
-				fclose(logFile);
+		// Report the actual state of the lock to the key (only sent over the udp transport, and only when it changes).
+		// The lock is only locked or unlocked once the actuator thread has moved the servo there
+		if (lockMachine.state == LOCK_LOCKED && context.servoPulse == LOCKED_FREQUENCY)
+		{
+			setCommLockState(&transport, COMM_STATE_LOCKED);
+		}
+		else if (lockMachine.state == LOCK_UNLOCKED && context.servoPulse == UNLOCKED_FREQUENCY)
+		{
+			setCommLockState(&transport, COMM_STATE_UNLOCKED);
+		}
+		else if (lockMachine.state == LOCK_WAITING_TO_LOCK || lockMachine.state == LOCK_SETTLING || lockMachine.state == LOCK_LOCKED)
+		{
+			setCommLockState(&transport, COMM_STATE_WAITING_TO_LOCK);
+		}
 
-				// Transition to the LOCKED state
-				lockState = LOCKED;
-			}
-			break;
+		// Write the latency histograms to the log file every LATENCY_REPORT_INTERVAL seconds
+		if (now >= nextLatencyReport)
+		{
+			logLatencyHistogram(&logger, &context.commandLatency);
+			logLatencyHistogram(&logger, &context.doorLatency);
+			logLockCounters(&context);
+			nextLatencyReport = now + LATENCY_REPORT_INTERVAL * 1000000000ULL;
 		}
 
-		ioctl(watchdog, WDIOC_KEEPALIVE, 0);	// kick the watchdog
-		getTime(time);
-		logFile = fopen(lockLogFilePath, "a");
-		PRINT_MSG(logFile, time, programName, "The Watchdog was updated\n\n");
-		fclose(logFile);
+		REPORT_HEARTBEAT(machineHeartbeat);
 	}
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	logFile = fopen(lockLogFilePath, "a");	
-	
-	write(watchdog, "V", 1);	// write to the watchdog to let it know to stop its countdown
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The Watchdog was disabled\n\n");
+	stopWatchdogSupervisor(&supervisor);
+	if (watchdog >= 0)
+	{
+		write(watchdog, "V", 1);	// write to the watchdog to let it know to stop its countdown
+		PRINT_MSG(&logger, "The Watchdog was disabled\n\n");
+
+		close(watchdog);			// close the connection to the watchdog
+		PRINT_MSG(&logger, "The Watchdog was closed\n\n");
+	}
+
+	closeCommTransport(&transport);
+	freeCommWatcher(&configWatcher);
 
-	close(watchdog);			// close the connection to the watchdog
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "The Watchdog was closed\n\n");
+	// Stop the sensor thread, then let the actuator thread finish the moves it was given and take them
+	if (!edgeAlerts)
+	{
+		atomic_store(&sensor.running, 0);
+		pthread_join(sensor.thread, NULL);
+	}
+	ServoMove stop = { 0 };
+	while (pushSpscRing(&actuator.moves, &stop) != 0)
+	{
+		usleep(1000);
+	}
+	pthread_join(actuator.thread, NULL);
+	while (popSpscRing(&actuator.done, &stop))
+	{
+		onServoMoved(&context, &stop);
+	}
+	freeSpscRing(&actuator.moves);
+	freeSpscRing(&actuator.done);
+
+	logLatencyHistogram(&logger, &context.commandLatency);
+	logLatencyHistogram(&logger, &context.doorLatency);
+	logLockCounters(&context);
+
+	if (snapshot.writes > 0)
+	{
+		char message[128];
+		snprintf(message, sizeof(message), "Lock state snapshot: %lu writes, %.3f ms on average\n",
+			snapshot.writes, snapshot.writeTime / (double) snapshot.writes / 1000000.0);
+		PRINT_MSG(&logger, message);
+	}
+	closeStateSnapshot(&snapshot);
 
 	// Clear pins and free GPIO before exiting the program
+	if (edgeAlerts)
+	{
+		gpioSetAlertFunc(BUTTON, NULL);
+		gpioSetAlertFunc(PHOTODIODE, NULL);
+	}
 	cleanup(gpio);				
-	gpioTerminate();
+	if (pigpioReady)
+	{
+		gpioTerminate();
+	}
+	freeSpscRing(&edgeRing);
 	gpiolib_free_gpio(gpio);
-	PRINT_MSG(logFile, time, programName, "The GPIO pins have been freed\n\n");
+	PRINT_MSG(&logger, "The GPIO pins have been freed\n\n");
 
-	fclose(logFile);
+	logEventLoopStats(&logger, &loop);
+	closeEventLoop(&loop);
+
+	// Stop the logger thread once every queued message has been written to the log file
+	closeLogger(&logger);
+	return 0;
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void lock(GPIO_Handle gpio)
+void lock(Actuator* actuator, uint32_t traceId)
 {
-	clearPin(gpio, GREEN_LED);			// Turn off GREEN LED
-	gpioServo(SERVO, LOCKED_FREQUENCY);		// Turn the servo to the locked state
-	setPin(gpio, RED_LED);				// Turn on the RED LED to indicate locked state
+	PIN_CLEAR(actuator->gpio, GREEN_LED);	// Turn off the GREEN LED
+	PIN_SET(actuator->gpio, RED_LED);		// and turn on the RED LED to indicate locked state
+	logTrace(actuator->logger, traceId, "led", 0);
+	if (pigpioReady)
+	{
+		gpioServo(SERVO, LOCKED_FREQUENCY);	// Turn the servo to the locked state
+	}
+	logTrace(actuator->logger, traceId, "servo", 0);
 }
 
-void unlock(GPIO_Handle gpio)
+void unlock(Actuator* actuator, uint32_t traceId)
 {
-	clearPin(gpio, RED_LED);			// Turn off the RED LED
-	gpioServo(SERVO, UNLOCKED_FREQUENCY);		// Turn the servo to the unlocked state
-	setPin(gpio, GREEN_LED);			// Turn on the GREEN LED to indicate unlocked state
+	PIN_CLEAR(actuator->gpio, RED_LED);		// Turn off the RED LED
+	PIN_SET(actuator->gpio, GREEN_LED);		// and turn on the GREEN LED to indicate unlocked state
+	logTrace(actuator->logger, traceId, "led", 0);
+	if (pigpioReady)
+	{
+		gpioServo(SERVO, UNLOCKED_FREQUENCY);	// Turn the servo to the unlocked state
+	}
+	logTrace(actuator->logger, traceId, "servo", 0);
 }
 
 void cleanup(GPIO_Handle gpio)
 {
-	clearPin(gpio, RED_LED);			// Clear RED LED / turn it off
-	clearPin(gpio, GREEN_LED);			// Clear GREEN LED / turn it off
+	clearPins(gpio, PIN_MASK(RED_LED) | PIN_MASK(GREEN_LED));	// Clear the RED and GREEN LEDs / turn them off
+}
+
+void actionUnlock(void* context)
+{
+	LockContext* lockContext = context;
+
+	// Write to the log file that a command to unlock the door has been received (onLockTransition() has the door unlocked)
+	PRINT_MSG(lockContext->logger, UNLOCK_COMMAND_MESSAGE);
+}
+
+void actionWaitToLock(void* context)
+{
+	LockContext* lockContext = context;
+
+	// Write to the log file that a command to lock the door has been received
+	PRINT_MSG(lockContext->logger, LOCK_COMMAND_MESSAGE);
+	if (!lockContext->doorClosed)
+	{
+		// The door is open and the program will wait until the door is closed to lock the door
+		PRINT_MSG(lockContext->logger, "The door is open, waiting until door is closed to lock \n");
+	}
+}
+
+void actionDoorReopened(void* context)
+{
+	LockContext* lockContext = context;
+
+	// The door was opened again before it settled, so it is not locked yet
+	PRINT_MSG(lockContext->logger, "The door was opened before it settled, waiting until door is closed to lock \n");
+}
+
+void onButtonRelease(void* context)
+{
+	LockContext* lockContext = context;
+
+	if (lockContext->requested)			// if the previous command stored in the communication file is a 1 (locked)
+	{
+		writeCommTransport(lockContext->transport, 0);	// Write a 0 to the communication file indicating that the new command is to unlock the door
+		logTrace(lockContext->logger, lockContext->transport->traceId, "press", 0);
+
+		// Write to the log file that a command has been written to the communication file to unlock the door
+		PRINT_MSG(lockContext->logger, "Wrote command to unlock the door to communication file\n");
+	}
+	else 								// if the previous command stored in the communication file is a 0 (unlocked)
+	{
+		writeCommTransport(lockContext->transport, 1);	// Write a 1 to the communication file indicating that the new command is to lock the door
+		logTrace(lockContext->logger, lockContext->transport->traceId, "press", 0);
+
+		// Write to the log file that a command has been written to the communication file to lock the door
+		PRINT_MSG(lockContext->logger, "Wrote command to lock the door to communication file\n");
+	}
+}
+
+void onLockTransition(StateMachine* machine, const StateTransition* transition, uint64_t eventTime)
+{
+	LockContext* lockContext = machine->context;
+	ServoMove move = { 0 };
+	move.traceId = lockContext->traceId;
+	move.eventTime = eventTime;
+
+	if (transition->to == LOCK_UNLOCKED)
+	{
+		move.position = UNLOCKED_FREQUENCY;
+		move.commandTime = eventTime;		// the servo moves for the command
+	}
+	else if (transition->to == LOCK_LOCKED)
+	{
+		logTrace(lockContext->logger, lockContext->traceId, "door", eventTime);
+		move.position = LOCKED_FREQUENCY;
+		if (lockContext->doorTime <= lockContext->commandTime)
+		{
+			move.commandTime = lockContext->commandTime;	// the door was already closed, so the servo moves for the command
+		}
+	}
+
+	// The settle deadline runs while the machine is in LOCK_SETTLING, and is cancelled if it leaves for any other reason
+	if (transition->to == LOCK_SETTLING)
+	{
+		lockContext->settles++;
+		lockContext->settleFrom = eventTime;
+		lockContext->settleDeadline = monotonicNanoseconds() + DOOR_SETTLE_TIME * 1000000ULL;
+		setTimerSource(lockContext->loop, lockContext->settleTimer, DOOR_SETTLE_TIME);
+	}
+	else if (transition->from == LOCK_SETTLING)
+	{
+		setTimerSource(lockContext->loop, lockContext->settleTimer, 0);
+		if (transition->to == LOCK_UNLOCKED)
+		{
+			lockContext->settleUnlocks++;
+		}
+		else if (transition->to == LOCK_WAITING_TO_LOCK)
+		{
+			lockContext->settleOpens++;
+		}
+	}
+
+	if (move.position == 0)
+	{
+		// Waiting to lock leaves the servo where it is, so the snapshot can be written right away (a restart while the door
+		// settles also resumes waiting to lock, so there is nothing to write for LOCK_SETTLING)
+		if (transition->to == LOCK_WAITING_TO_LOCK && transition->from != LOCK_SETTLING && lockContext->snapshot->fd >= 0 && saveStateSnapshot(lockContext->snapshot, transition->to, lockContext->command, lockContext->traceId, lockContext->servoPulse) != 0)
+		{
+			PRINT_REPEATED_MSG(lockContext->logger, "The lock state snapshot could not be written\n\n");
+		}
+	}
+	else if (pushSpscRing(&lockContext->actuator->moves, &move) != 0)
+	{
+		PRINT_MSG(lockContext->logger, "The servo move could not be queued!\n\n");
+	}
+}
+
+void onServoMoved(LockContext* context, const ServoMove* move)
+{
+	context->servoPulse = move->position;
+	if (move->position == LOCKED_FREQUENCY)
+	{
+		recordLatency(&context->doorLatency, move->movedAt - move->eventTime);
+	}
+	if (move->commandTime != 0)
+	{
+		recordLatency(&context->commandLatency, move->movedAt - move->commandTime);
+	}
+
+	// Keep the snapshot in step with the lock, now that the servo has moved
+	if (context->snapshot->fd >= 0 && saveStateSnapshot(context->snapshot, (move->position == LOCKED_FREQUENCY) ? LOCK_LOCKED : LOCK_UNLOCKED,
+		context->command, move->traceId, context->servoPulse) != 0)
+	{
+		PRINT_REPEATED_MSG(context->logger, "The lock state snapshot could not be written\n\n");
+	}
+}
+
+void* actuatorThread(void* argument)
+{
+	Actuator* actuator = argument;
+	ServoMove move;
+
+	for (;;)
+	{
+		// The watchdog supervisor writes to the eventfd of the ring after every check, so an idle thread still beats
+		REPORT_HEARTBEAT(actuator->heartbeat);
+		waitSpscRing(&actuator->moves, -1);
+
+		while (popSpscRing(&actuator->moves, &move))
+		{
+			if (move.position == 0)
+			{
+				return NULL;
+			}
+
+			if (move.position == LOCKED_FREQUENCY)
+			{
+				lock(actuator, move.traceId);
+				PRINT_MSG(actuator->logger, LOCKED_MESSAGE);
+			}
+			else
+			{
+				unlock(actuator, move.traceId);
+				PRINT_MSG(actuator->logger, UNLOCKED_MESSAGE);
+			}
+			move.movedAt = monotonicNanoseconds();
+			pushSpscRing(&actuator->done, &move);
+		}
+	}
+}
+
+void* sensorThread(void* argument)
+{
+	Sensor* sensor = argument;
+	uint64_t mask = PIN_MASK(BUTTON) | PIN_MASK(PHOTODIODE);
+	int debounceTime = atomic_load(&sensor->debounceTime);
+	uint64_t reported = sensor->debouncer->levels;
+
+	// The button machine starts from the first level of the button
+	GpioEdge first = { BUTTON, readDebouncedPin(sensor->debouncer, BUTTON) };
+	pushSpscRing(&edgeRing, &first);
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (atomic_load(&sensor->running))
+	{
+		REPORT_HEARTBEAT(sensor->heartbeat);
+
+		if (atomic_load(&sensor->debounceTime) != debounceTime)
+		{
+			debounceTime = atomic_load(&sensor->debounceTime);
+			initDebouncer(sensor->debouncer, sensor->gpio, mask, debounceTime);
+		}
+		updateDebouncer(sensor->debouncer, sensor->gpio);
+
+		// Pass the pins whose debounced level differs from the one last reported to the main loop
+		uint64_t changed = (sensor->debouncer->levels ^ reported) & mask;
+		if (changed & PIN_MASK(BUTTON))
+		{
+			GpioEdge edge = { BUTTON, readDebouncedPin(sensor->debouncer, BUTTON) };
+			pushSpscRing(&edgeRing, &edge);
+		}
+		if (changed & PIN_MASK(PHOTODIODE))
+		{
+			GpioEdge edge = { PHOTODIODE, readDebouncedPin(sensor->debouncer, PHOTODIODE) };
+			pushSpscRing(&edgeRing, &edge);
+		}
+		reported ^= changed;
+
+		next.tv_nsec += DEBOUNCE_POLL_INTERVAL_MS * 1000000L;
+		if (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+void applyRequestedCommand(LockContext* context, uint64_t now)
+{
+	if (context->held > 0)
+	{
+		// Every command held but the last was replaced before it was applied, and the last one is only a transition
+		// of the lock machine if it differs from the command in effect
+		context->coalesced += context->held - 1;
+		context->movesSaved += context->held - (context->requested != context->command);
+		if (context->held > 1)
+		{
+			PRINT_MSG(context->logger, "Commands received during the coalescing window were coalesced, only the last one is applied \n");
+		}
+		context->held = 0;
+	}
+
+	if (context->requested != context->command)
+	{
+		context->command = context->requested;
+		context->commandTime = context->requestedTime;
+		context->traceId = context->requestedTraceId;
+		context->appliedAt = now;
+	}
+}
+
+void logLockCounters(LockContext* context)
+{
+	char message[160];
+	snprintf(message, sizeof(message), "Commands: %lu received, %lu coalesced, %lu servo moves saved\n",
+		context->requests, context->coalesced, context->movesSaved);
+	PRINT_MSG(context->logger, message);
+
+	snprintf(message, sizeof(message), "Door settles: %lu started, %lu cancelled by a command to unlock, %lu cancelled by the door opening\n",
+		context->settles, context->settleUnlocks, context->settleOpens);
+	PRINT_MSG(context->logger, message);
+
+	if (context->transport->type == COMM_TRANSPORT_UDP)
+	{
+		snprintf(message, sizeof(message), "Command packets refused: %lu (failed authentication or replayed)\n", context->transport->refused);
+		PRINT_MSG(context->logger, message);
+	}
+}
+
+void onGpioEdge(int gpio, int level, uint32_t tick)
+{
+	(void) tick;
+
+	if (level > 1)					// pigpio reports a level of 2 for a watchdog timeout on the pin, which is not an edge
+	{
+		return;
+	}
+
+	GpioEdge edge = { gpio, level };
+	pushSpscRing(&edgeRing, &edge);		// pigpio calls the alerts from a single thread; if the ring is full the edge is dropped
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
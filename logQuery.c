@@ -0,0 +1,444 @@
+/* ==================================================================================
+ * logQuery: answers time range queries over the lock and key log files without
+ * reading them from one end to the other, e.g. who unlocked the door between
+ * 14:00 and 15:00.
+ *
+ * Usage: ./logQuery [-f "MM-DD-YYYY HH:MM[:SS]"] [-t "MM-DD-YYYY HH:MM[:SS]"]
+ *                   [-g text] [-c] logFile.log [more log files...]
+ *
+ *   -f  first time of the range (inclusive), the start of the file by default
+ *   -t  end of the range (exclusive), the end of the file by default
+ *   -g  only print the lines of the range that contain text
+ *   -c  only print the number of lock and unlock events of the range
+ *
+ * Every log file is mapped, and a sparse index of its timestamps is built by
+ * jumping INDEX_STRIDE bytes at a time and looking for the next line with a
+ * timestamp, so the index costs a few pages per megabyte instead of a full
+ * read.  The range is found with a binary search of the index and then a scan
+ * of a single stride; the lines of the range are only walked with memchr() and
+ * the events counted with memmem(), which glibc vectorizes.  The log files are
+ * assumed to be in time order, as the logger writes them (a clock step backwards
+ * may hide the lines logged just after it).  Rotated segments compressed with
+ * gzip must be decompressed first.
+ * ================================================================================= */
+
+#define _GNU_SOURCE		// memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_STRIDE 65536			// Bytes between two entries of the sparse index
+#define TIMESTAMP_LENGTH 26			// "MM-DD-YYYY HH:MM:SS.uuuuuu" at the start of every log line
+#define TIMESTAMP_SECONDS_LENGTH 20	// "MM-DD-YYYY HH:MM:SS.", the fraction that follows may be empty
+#define NO_TIME INT64_MIN
+
+// Events counted with -c, as written by lock.c and key.c
+typedef struct LogEvent
+{
+	const char* name;
+	const char* text;
+} LogEvent;
+
+static const LogEvent events[] =
+{
+	{ "locked", "The door has been LOCKED." },
+	{ "unlocked", "The door has been UNLOCKED." },
+	{ "lock cmds", "received command to LOCK " },
+	{ "unlock cmds", "received command to UNLOCK " },
+	{ "lock sent", "Wrote command to lock the door" },
+	{ "unlock sent", "Wrote command to unlock the door" }
+};
+
+#define EVENT_COUNT ((int) (sizeof(events) / sizeof(events[0])))
+
+typedef struct IndexEntry
+{
+	size_t offset;					// Start of the first line with a timestamp at or after the stride
+	int64_t time;					// Its timestamp, in microseconds
+} IndexEntry;
+
+static int64_t parseTimestamp(const char* text, size_t length);
+static int64_t parseQueryTime(const char* text);
+static size_t nextLine(const char* data, size_t size, size_t offset);
+static IndexEntry* buildIndex(const char* data, size_t size, int* count);
+static size_t findTime(const char* data, size_t size, const IndexEntry* index, int count, int64_t time);
+static size_t countOccurrences(const char* data, size_t length, const char* text);
+static double elapsedMilliseconds(const struct timespec* start);
+
+int main(int argc, char* argv[])
+{
+	int64_t from = NO_TIME;
+	int64_t to = NO_TIME;
+	const char* grep = NULL;
+	int countOnly = 0;
+	int option;
+
+	while ((option = getopt(argc, argv, "f:t:g:c")) != -1)
+	{
+		if (option == 'f' || option == 't')
+		{
+			int64_t time = parseQueryTime(optarg);
+			if (time == NO_TIME)
+			{
+				fprintf(stderr, "Could not read the time \"%s\", use \"MM-DD-YYYY HH:MM[:SS]\"\n", optarg);
+				return 1;
+			}
+			if (option == 'f')
+			{
+				from = time;
+			}
+			else
+			{
+				to = time;
+			}
+		}
+		else if (option == 'g')
+		{
+			grep = optarg;
+		}
+		else if (option == 'c')
+		{
+			countOnly = 1;
+		}
+		else
+		{
+			optind = argc;		// print the usage below
+			break;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-f \"MM-DD-YYYY HH:MM[:SS]\"] [-t \"MM-DD-YYYY HH:MM[:SS]\"] [-g text] [-c] logFile.log [more log files...]\n", argv[0]);
+		return 1;
+	}
+
+	if (countOnly)
+	{
+		printf("%-40s %10s", "log file", "lines");
+		for (int e = 0; e < EVENT_COUNT; ++e)
+		{
+			printf(" %12s", events[e].name);
+		}
+		printf("\n");
+	}
+
+	for (int file = optind; file < argc; ++file)
+	{
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		size_t nameLength = strlen(argv[file]);
+		if (nameLength > 3 && strcmp(argv[file] + nameLength - 3, ".gz") == 0)
+		{
+			fprintf(stderr, "%s is compressed, decompress it with gunzip first\n", argv[file]);
+			continue;
+		}
+
+		int fd = open(argv[file], O_RDONLY);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0)
+		{
+			fprintf(stderr, "Could not read %s\n", argv[file]);
+			return 1;
+		}
+
+		size_t size = (size_t) status.st_size;
+		if (size == 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+		{
+			fprintf(stderr, "Could not map %s\n", argv[file]);
+			return 1;
+		}
+
+		int entries;
+		IndexEntry* index = buildIndex(data, size, &entries);
+		if (index == NULL && entries < 0)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		// The range starts at the first line at or after from, and ends before the first line at or after to
+		size_t first = (from == NO_TIME) ? 0 : findTime(data, size, index, entries, from);
+		size_t last = (to == NO_TIME) ? size : findTime(data, size, index, entries, to);
+		if (last < first)
+		{
+			last = first;
+		}
+
+		// The range is only read sequentially from here on
+		madvise((void*) data, size, MADV_SEQUENTIAL);
+
+		size_t lines = 0;
+		for (const char* line = data + first; line < data + last; )
+		{
+			const char* end = memchr(line, '\n', (data + last) - line);
+			end = (end != NULL) ? end + 1 : data + last;
+			if (!countOnly && (grep == NULL || memmem(line, end - line, grep, strlen(grep)) != NULL))
+			{
+				fwrite(line, 1, end - line, stdout);
+			}
+			lines++;
+			line = end;
+		}
+
+		if (countOnly)
+		{
+			printf("%-40s %10zu", argv[file], lines);
+			for (int e = 0; e < EVENT_COUNT; ++e)
+			{
+				printf(" %12zu", countOccurrences(data + first, last - first, events[e].text));
+			}
+			printf("\n");
+		}
+
+		fprintf(stderr, "%s: %d index entries, %zu of %zu bytes in range, %.2f ms\n",
+			argv[file], entries, last - first, size, elapsedMilliseconds(&start));
+
+		free(index);
+		munmap((void*) data, size);
+	}
+
+	return 0;
+}
+
+/* =================================================
+ * This function reads the timestamp at the start of
+ * a log line, "MM-DD-YYYY HH:MM:SS.uuuuuu".  The
+ * fraction of a second is optional: log files
+ * written before the logger had microseconds have
+ * "MM-DD-YYYY HH:MM:SS. " and count as .000000.
+ * Times are only compared with each other, so the
+ * local time of the line is counted from a fixed day
+ * rather than converted with a time zone.
+ *
+ * @param: char* text, size_t length available
+ * @return: int64_t microseconds, NO_TIME if the line has no timestamp
+ * ============================================== */
+
+static int64_t parseTimestamp(const char* text, size_t length)
+{
+	static const char pattern[] = "dd-dd-dddd dd:dd:dd.";
+	int values[7] = { 0 };
+	int field = 0;
+
+	if (length < TIMESTAMP_SECONDS_LENGTH)
+	{
+		return NO_TIME;
+	}
+
+	for (int i = 0; i < TIMESTAMP_SECONDS_LENGTH; ++i)
+	{
+		if (pattern[i] == 'd')
+		{
+			if (text[i] < '0' || text[i] > '9')
+			{
+				return NO_TIME;
+			}
+			values[field] = values[field] * 10 + (text[i] - '0');
+		}
+		else if (text[i] != pattern[i])
+		{
+			return NO_TIME;
+		}
+		else
+		{
+			field++;
+		}
+	}
+
+	// Microseconds, from as many digits as there are (none in the older log files)
+	int digits = 0;
+	for (size_t i = TIMESTAMP_SECONDS_LENGTH; i < length && digits < 6 && text[i] >= '0' && text[i] <= '9'; ++i, ++digits)
+	{
+		values[6] = values[6] * 10 + (text[i] - '0');
+	}
+	for (; digits < 6; ++digits)
+	{
+		values[6] *= 10;
+	}
+
+	// Days from the civil date (month, day, year), counted from 03-01-0000 so that leap days fall at the end of a year
+	int month = values[0];
+	int day = values[1];
+	int year = values[2] - (month <= 2);
+	int era = year / 400;
+	int yearOfEra = year - era * 400;
+	int dayOfYear = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+	int64_t days = (int64_t) era * 146097 + yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+
+	return ((days * 24 + values[3]) * 60 + values[4]) * 60000000LL + values[5] * 1000000LL + values[6];
+}
+
+/* =================================================
+ * This function reads a time given on the command
+ * line, "MM-DD-YYYY HH:MM" or "MM-DD-YYYY HH:MM:SS",
+ * in the same units as parseTimestamp().
+ *
+ * @param: char* text
+ * @return: int64_t microseconds, NO_TIME if it cannot be read
+ * ============================================== */
+
+static int64_t parseQueryTime(const char* text)
+{
+	int month, day, year, hour, minute, second = 0;
+	char timestamp[TIMESTAMP_LENGTH + 1];
+
+	if (sscanf(text, "%d-%d-%d %d:%d:%d", &month, &day, &year, &hour, &minute, &second) < 5)
+	{
+		return NO_TIME;
+	}
+	snprintf(timestamp, sizeof(timestamp), "%02d-%02d-%04d %02d:%02d:%02d.000000", month, day, year, hour, minute, second);
+	return parseTimestamp(timestamp, TIMESTAMP_LENGTH);
+}
+
+/* =================================================
+ * This function returns the start of the line after
+ * the one offset points into.
+ *
+ * @param: char* data, size_t size, size_t offset
+ * @return: size_t offset of the next line, size if there is none
+ * ============================================== */
+
+static size_t nextLine(const char* data, size_t size, size_t offset)
+{
+	const char* end = memchr(data + offset, '\n', size - offset);
+	return (end != NULL) ? (size_t) (end - data) + 1 : size;
+}
+
+/* =================================================
+ * This function builds the sparse index of a log
+ * file: one entry per INDEX_STRIDE bytes, for the
+ * first line with a timestamp that starts in or
+ * after the stride.  Lines without a timestamp
+ * (blank lines, the rest of a message that spans
+ * several lines) are skipped.
+ *
+ * @param: char* data, size_t size, int* count (set to -1 if out of memory)
+ * @return: IndexEntry*, NULL if empty or out of memory
+ * ============================================== */
+
+static IndexEntry* buildIndex(const char* data, size_t size, int* count)
+{
+	int capacity = (int) (size / INDEX_STRIDE) + 1;
+	IndexEntry* index = malloc(sizeof(IndexEntry) * capacity);
+	*count = 0;
+
+	if (index == NULL)
+	{
+		*count = -1;
+		return NULL;
+	}
+
+	for (size_t stride = 0; stride < size; stride += INDEX_STRIDE)
+	{
+		size_t offset = (stride == 0) ? 0 : nextLine(data, size, stride - 1);
+		while (offset < size)
+		{
+			int64_t time = parseTimestamp(data + offset, size - offset);
+			if (time != NO_TIME)
+			{
+				// A long stretch without timestamps may run into the next stride, which then finds the same line
+				if (*count == 0 || index[*count - 1].offset != offset)
+				{
+					index[*count].offset = offset;
+					index[*count].time = time;
+					(*count)++;
+				}
+				break;
+			}
+			offset = nextLine(data, size, offset);
+		}
+	}
+	return index;
+}
+
+/* =================================================
+ * This function finds the first line stamped at or
+ * after the given time: a binary search of the index
+ * gives the last entry before the time, and the
+ * lines after it are then scanned.
+ *
+ * @param: char* data, size_t size, IndexEntry* index, int count, int64_t time
+ * @return: size_t offset of the line, size if every line is older
+ * ============================================== */
+
+static size_t findTime(const char* data, size_t size, const IndexEntry* index, int count, int64_t time)
+{
+	int low = 0;
+	int high = count;
+
+	// First entry at or after the time
+	while (low < high)
+	{
+		int middle = low + (high - low) / 2;
+		if (index[middle].time < time)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	if (low == 0)
+	{
+		return 0;
+	}
+
+	size_t offset = index[low - 1].offset;
+	size_t limit = (low < count) ? index[low].offset : size;
+	while (offset < limit)
+	{
+		int64_t stamp = parseTimestamp(data + offset, size - offset);
+		if (stamp != NO_TIME && stamp >= time)
+		{
+			return offset;
+		}
+		offset = nextLine(data, size, offset);
+	}
+	return limit;
+}
+
+/* =================================================
+ * This function counts the occurrences of a text in
+ * a block of the log file.
+ *
+ * @param: char* data, size_t length, char* text
+ * @return: size_t number of occurrences
+ * ============================================== */
+
+static size_t countOccurrences(const char* data, size_t length, const char* text)
+{
+	size_t textLength = strlen(text);
+	size_t count = 0;
+	const char* end = data + length;
+
+	for (const char* found = data; (found = memmem(found, end - found, text, textLength)) != NULL; found += textLength)
+	{
+		count++;
+	}
+	return count;
+}
+
+static double elapsedMilliseconds(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
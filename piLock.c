@@ -25,7 +25,12 @@
  * Functions from gpiolib
  * ===================================== */
 
-GPIO_Handle gpiolib_init_gpio(void)
+/* =================================================
+ * These functions make up the "mmap" backend, which
+ * maps the GPIO registers of the Pi from /dev/gpiomem.
+ * ============================================== */
+
+static GPIO_Handle mmapInit(void)
 {
 	int fd;
 	if ((fd = open(GPIO_MEM_FILE, O_RDWR | O_SYNC)) == -1)
@@ -42,21 +47,237 @@ GPIO_Handle gpiolib_init_gpio(void)
 	return ret;
 }
 
-void gpiolib_free_gpio(GPIO_Handle handle)
+static void mmapFree(GPIO_Handle handle)
 {
 	munmap(handle, GPIO_LEN);
 }
 
-void gpiolib_write_reg(GPIO_Handle handle, uint32_t offst, uint32_t data)
+static void mmapWriteReg(GPIO_Handle handle, uint32_t offst, uint32_t data)
 {
 	*(handle + offst) = data;
 }
 
-uint32_t gpiolib_read_reg(GPIO_Handle handle, uint32_t offst)
+static uint32_t mmapReadReg(GPIO_Handle handle, uint32_t offst)
 {
 	return *(handle + offst);
 }
 
+/* =================================================
+ * These functions make up the "sim" backend: a block
+ * of registers in a memfd laid out like the real one,
+ * so the programs run without a Pi.  Writes to GPSETx
+ * and GPCLRx change the levels in GPLEVx, and the
+ * inputs follow a waveform read from a text file with
+ * one "<milliseconds> <pin> <level>" line per change,
+ * timed from the call to gpiolib_init_gpio().  A
+ * "LOOP <milliseconds>" line replays the waveform
+ * with that period, and lines starting with '#' are
+ * comments.
+ * ============================================== */
+
+typedef struct SimEvent
+{
+	uint32_t time;				// milliseconds from the start of the waveform
+	int pin;
+	int level;
+} SimEvent;
+
+static struct
+{
+	SimEvent events[GPIO_SIM_MAX_EVENTS];
+	int count;					// events in the waveform
+	int next;					// next event to apply
+	uint32_t loop;				// period of the waveform in milliseconds, 0 = play it once
+	uint64_t start;				// CLOCK_MONOTONIC of the start of the current period, in nanoseconds
+	uint64_t driven;			// pins driven by the waveform; writes to them are ignored
+	char waveformPath[255];
+} simGpio;
+
+static void loadSimWaveform(const char* path)
+{
+	FILE* waveform = (path[0] != 0) ? fopen(path, "r") : NULL;
+	char line[255];
+
+	simGpio.count = 0;
+	simGpio.loop = 0;
+	simGpio.driven = 0;
+	if (waveform == NULL)
+	{
+		return;
+	}
+
+	while (fgets(line, sizeof(line), waveform) != NULL && simGpio.count < GPIO_SIM_MAX_EVENTS)
+	{
+		SimEvent* event = &simGpio.events[simGpio.count];
+		unsigned loop;
+
+		if (sscanf(line, " LOOP %u", &loop) == 1)
+		{
+			simGpio.loop = loop;
+		}
+		else if (line[0] != '#' && sscanf(line, "%u %d %d", &event->time, &event->pin, &event->level) == 3
+			&& event->pin >= 0 && event->pin <= 53 && (simGpio.count == 0 || event->time >= simGpio.events[simGpio.count - 1].time))
+		{
+			simGpio.driven |= PIN_MASK(event->pin);
+			simGpio.count++;
+		}
+	}
+	fclose(waveform);
+}
+
+static void applySimWaveform(GPIO_Handle handle)
+{
+	uint64_t now = monotonicNanoseconds();
+
+	for (;;)
+	{
+		uint64_t elapsed = (now - simGpio.start) / 1000000;
+
+		while (simGpio.next < simGpio.count && simGpio.events[simGpio.next].time <= elapsed)
+		{
+			SimEvent* event = &simGpio.events[simGpio.next++];
+			uint32_t bit = 1U << (event->pin % 32);
+
+			if (event->level)
+			{
+				__atomic_fetch_or(&handle[GPLEV(event->pin / 32)], bit, __ATOMIC_RELAXED);
+			}
+			else
+			{
+				__atomic_fetch_and(&handle[GPLEV(event->pin / 32)], ~bit, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (simGpio.loop == 0 || elapsed < simGpio.loop)
+		{
+			return;
+		}
+		simGpio.start += simGpio.loop * 1000000ULL;
+		simGpio.next = 0;
+	}
+}
+
+static GPIO_Handle simInit(void)
+{
+	int fd = syscall(SYS_memfd_create, "piLockGpio", 0);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, GPIO_LEN) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	GPIO_Handle ret;
+	ret = mmap(NULL, GPIO_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (ret == MAP_FAILED)
+		return NULL;
+
+	loadSimWaveform(simGpio.waveformPath);
+	simGpio.next = 0;
+	simGpio.start = monotonicNanoseconds();
+	applySimWaveform(ret);
+	return ret;
+}
+
+// The level registers are updated atomically: the outputs may be written by one thread while another samples the inputs
+static void simWriteReg(GPIO_Handle handle, uint32_t offst, uint32_t data)
+{
+	if (offst == GPSET(0) || offst == GPSET(1))
+	{
+		int bank = offst - GPSET(0);
+		__atomic_fetch_or(&handle[GPLEV(bank)], data & ~(uint32_t) (simGpio.driven >> (32 * bank)), __ATOMIC_RELAXED);
+	}
+	else if (offst == GPCLR(0) || offst == GPCLR(1))
+	{
+		int bank = offst - GPCLR(0);
+		__atomic_fetch_and(&handle[GPLEV(bank)], ~(data & ~(uint32_t) (simGpio.driven >> (32 * bank))), __ATOMIC_RELAXED);
+	}
+	else
+	{
+		handle[offst] = data;
+	}
+}
+
+static uint32_t simReadReg(GPIO_Handle handle, uint32_t offst)
+{
+	if (offst == GPLEV(0) || offst == GPLEV(1))
+	{
+		applySimWaveform(handle);
+	}
+	return handle[offst];
+}
+
+static const GpioBackend mmapBackend = { "mmap", mmapInit, mmapFree, mmapWriteReg, mmapReadReg };
+static const GpioBackend simBackend = { "sim", simInit, mmapFree, simWriteReg, simReadReg };
+static const GpioBackend* gpioBackend = &mmapBackend;
+int gpioRegistersMapped = 1;
+
+/* =================================================
+ * This function selects the backend used by the
+ * gpiolib functions below, and so by every GPIO
+ * function of this file.  It must be called before
+ * gpiolib_init_gpio().
+ *
+ * @param: int backend (GPIO_BACKEND_MMAP or GPIO_BACKEND_SIM), char* waveform file of the sim backend
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int selectGpioBackend(int backend, const char* waveformPath)
+{
+	if (backend == GPIO_BACKEND_MMAP)
+	{
+		gpioBackend = &mmapBackend;
+		gpioRegistersMapped = 1;
+		return 0;
+	}
+	else if (backend == GPIO_BACKEND_SIM)
+	{
+		gpioBackend = &simBackend;
+		gpioRegistersMapped = 0;
+		strncpy(simGpio.waveformPath, (waveformPath != NULL) ? waveformPath : "", sizeof(simGpio.waveformPath) - 1);
+		return 0;
+	}
+	return -1;
+}
+
+/* =================================================
+ * This function returns the name of the backend in
+ * use ("mmap" or "sim").
+ *
+ * @param: void
+ * @return: char*, name of the backend
+ * ============================================== */
+
+const char* gpioBackendName(void)
+{
+	return gpioBackend->name;
+}
+
+GPIO_Handle gpiolib_init_gpio(void)
+{
+	return gpioBackend->init();
+}
+
+void gpiolib_free_gpio(GPIO_Handle handle)
+{
+	gpioBackend->free(handle);
+}
+
+void gpiolib_write_reg(GPIO_Handle handle, uint32_t offst, uint32_t data)
+{
+	gpioBackend->writeReg(handle, offst, data);
+}
+
+uint32_t gpiolib_read_reg(GPIO_Handle handle, uint32_t offst)
+{
+	return gpioBackend->readReg(handle, offst);
+}
+
 /* =================================================
  * This function changes the I/O type of a GPIO pin.
  * The function accepts an integer value for the number
@@ -131,7 +352,7 @@ int setPin(GPIO_Handle gpio, int pinNumber)
 			registerNumber = 1;
 		}
 
-		gpiolib_write_reg(gpio, GPSET(registerNumber), 1 << pinNumber); // set bit for pin N at bit N in GPSETx
+		gpiolib_write_reg(gpio, GPSET(registerNumber), 1U << (pinNumber % 32)); // set bit for pin N at bit N in GPSETx
 
 		return 0;
 	}
@@ -168,7 +389,7 @@ int clearPin(GPIO_Handle gpio, int pinNumber)
 			registerNumber = 1;
 		}
 
-		gpiolib_write_reg(gpio, GPCLR(registerNumber), 1 << pinNumber); // clear bit for pin N at bit N in GPCLRx
+		gpiolib_write_reg(gpio, GPCLR(registerNumber), 1U << (pinNumber % 32)); // clear bit for pin N at bit N in GPCLRx
 
 		return 0;
 	}
@@ -216,11 +437,11 @@ int writePin(GPIO_Handle gpio, int pinNumber, int state)
 
 		if (state == 1)
 		{
-			gpiolib_write_reg(gpio, GPSET(registerNumber), 1 << pinNumber); // set bit for pin N at bit N in GPSETx
+			gpiolib_write_reg(gpio, GPSET(registerNumber), 1U << (pinNumber % 32)); // set bit for pin N at bit N in GPSETx
 		}
 		else
 		{
-			gpiolib_write_reg(gpio, GPCLR(registerNumber), 1 << pinNumber); // clear bit for pin N at bit N in GPCLRx
+			gpiolib_write_reg(gpio, GPCLR(registerNumber), 1U << (pinNumber % 32)); // clear bit for pin N at bit N in GPCLRx
 		}
 
 		return 0;
@@ -263,7 +484,7 @@ int readPin(GPIO_Handle gpio, int pinNumber)
 
 		levelRegister = gpiolib_read_reg(gpio, GPLEV(registerNumber)); // get value of GPLEVx register
 
-		if (levelRegister & (1 << pinNumber)) // check if pin N is zero or not
+		if (levelRegister & (1U << (pinNumber % 32))) // check if pin N is zero or not
 		{
 			return 1; // if not zero, return TRUE (pin is HIGH)
 		}
@@ -278,6 +499,229 @@ int readPin(GPIO_Handle gpio, int pinNumber)
 	}
 }
 
+/* =================================================
+ * This function sets up a debouncer for the pins in
+ * pinMask (PIN_MASK() of each pin).  The level of a
+ * pin is only accepted once the raw level has been
+ * different from the debounced one for debounceTime
+ * milliseconds in a row.  The debounced levels start
+ * at the current raw levels.
+ *
+ * @param: Debouncer*, GPIO_Handle, uint64_t pinMask, int debounceTime (ms, 0 = no debouncing)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initDebouncer(Debouncer* debouncer, GPIO_Handle gpio, uint64_t pinMask, int debounceTime)
+{
+	if (debouncer == NULL || gpio == NULL || pinMask >> 54)
+	{
+		return -1;
+	}
+
+	memset(debouncer, 0, sizeof(Debouncer));
+	debouncer->mask = pinMask;
+	debouncer->threshold = (debounceTime > 0) ? debounceTime : 0;
+	if (debouncer->threshold >= (1U << (DEBOUNCE_COUNTER_BITS - 1)))
+	{
+		debouncer->threshold = (1U << (DEBOUNCE_COUNTER_BITS - 1)) - 1;
+	}
+	debouncer->levels = readPins(gpio, pinMask);
+	debouncer->lastSample = monotonicNanoseconds();
+	return 0;
+}
+
+/* =================================================
+ * This function samples every pin of the debouncer
+ * from one read of the level registers and updates
+ * the debounced levels.  Each pin has a counter of
+ * the milliseconds its raw level has disagreed with
+ * its debounced level.  The counters are stored
+ * "vertically" (bit N of counter[b] is bit b of the
+ * counter of pin N), so every pin is integrated at
+ * once with a few mask operations instead of a branch
+ * per pin: the elapsed time is added to the counters
+ * of the disagreeing pins, the counters of the other
+ * pins are cleared, and the pins whose counter reached
+ * the threshold take their new level.
+ *
+ * @param: Debouncer*, GPIO_Handle
+ * @return: uint64_t mask of the pins whose debounced level changed
+ * ============================================== */
+
+uint64_t updateDebouncer(Debouncer* debouncer, GPIO_Handle gpio)
+{
+	uint64_t raw = readPins(gpio, debouncer->mask);
+	uint64_t disagree = raw ^ debouncer->levels;
+	uint64_t now = monotonicNanoseconds();
+
+	// Whole milliseconds since the last sample; the remainder is carried over to the next one
+	uint64_t elapsed = (now - debouncer->lastSample) / 1000000;
+	debouncer->lastSample += elapsed * 1000000;
+	if (elapsed > debouncer->threshold)
+	{
+		elapsed = debouncer->threshold;	// a counter can never pass twice the threshold, so it cannot overflow
+	}
+
+	// Add elapsed to the counter of every disagreeing pin (ripple carry through the bit planes),
+	// and reset the counters of the pins that agree with their debounced level
+	uint64_t carry = 0;
+	for (int b = 0; b < DEBOUNCE_COUNTER_BITS; ++b)
+	{
+		uint64_t addend = ((elapsed >> b) & 1) ? disagree : 0;
+		uint64_t plane = debouncer->counter[b] & disagree;
+
+		debouncer->counter[b] = plane ^ addend ^ carry;
+		carry = (plane & addend) | (carry & (plane ^ addend));
+	}
+
+	// Compare every counter with the threshold from the most significant plane down
+	uint64_t greater = 0;
+	uint64_t equal = disagree;
+	for (int b = DEBOUNCE_COUNTER_BITS - 1; b >= 0; --b)
+	{
+		if ((debouncer->threshold >> b) & 1)
+		{
+			equal &= debouncer->counter[b];
+		}
+		else
+		{
+			greater |= equal & debouncer->counter[b];
+			equal &= ~debouncer->counter[b];
+		}
+	}
+
+	// Accept the new level of the pins that disagreed for long enough and restart their counters
+	uint64_t changed = (greater | equal) & disagree;
+	debouncer->levels ^= changed;
+	for (int b = 0; b < DEBOUNCE_COUNTER_BITS; ++b)
+	{
+		debouncer->counter[b] &= ~changed;
+	}
+
+	return changed;
+}
+
+/* =================================================
+ * This function returns the debounced level of a pin
+ * as of the last updateDebouncer().
+ *
+ * @param: Debouncer*, pin number (int) - [0 - 53]
+ * @return: 1,0 = successful execution, -1 = pin not debounced
+ * ============================================== */
+
+int readDebouncedPin(const Debouncer* debouncer, int pinNumber)
+{
+	if (debouncer == NULL || pinNumber < 0 || pinNumber > 53 || !(debouncer->mask & PIN_MASK(pinNumber)))
+	{
+		return -1;
+	}
+
+	return (debouncer->levels >> pinNumber) & 1;
+}
+
+/* =================================================
+ * This function sets every pin in the mask to HIGH
+ * (bit N of the mask = pin N, see PIN_MASK()), with a
+ * single write to the GPSETx register of each bank
+ * that holds one of them.  If the mask holds a pin
+ * that does not exist, no pin is changed and the
+ * function returns -1.
+ *
+ * @param: GPIO_Handle, uint64_t mask of pins - [0 - 53]
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int setPins(GPIO_Handle gpio, uint64_t mask)
+{
+	return writePins(gpio, mask, 0);
+}
+
+/* =================================================
+ * This function clears every pin in the mask to LOW,
+ * with a single write to the GPCLRx register of each
+ * bank that holds one of them.  If the mask holds a
+ * pin that does not exist, no pin is changed and the
+ * function returns -1.
+ *
+ * @param: GPIO_Handle, uint64_t mask of pins - [0 - 53]
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int clearPins(GPIO_Handle gpio, uint64_t mask)
+{
+	return writePins(gpio, 0, mask);
+}
+
+/* =================================================
+ * This function sets the pins in setMask to HIGH and
+ * clears the pins in clearMask to LOW.  The arguments
+ * are checked once, then each bank gets at most one
+ * GPCLRx write followed by one GPSETx write, so a
+ * group of LEDs changes with back to back register
+ * writes.  A pin in both masks ends up HIGH.  If a
+ * mask holds a pin that does not exist, no pin is
+ * changed and the function returns -1.
+ *
+ * @param: GPIO_Handle, uint64_t setMask, uint64_t clearMask - pins [0 - 53]
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int writePins(GPIO_Handle gpio, uint64_t setMask, uint64_t clearMask)
+{
+	if (gpio == NULL || ((setMask | clearMask) >> 54))
+	{
+		return -1;
+	}
+
+	clearMask &= ~setMask;
+	for (int bank = 0; bank < 2; ++bank)
+	{
+		uint32_t clearBits = (uint32_t) (clearMask >> (32 * bank));
+		uint32_t setBits = (uint32_t) (setMask >> (32 * bank));
+
+		if (clearBits)
+		{
+			gpiolib_write_reg(gpio, GPCLR(bank), clearBits); // clear bit N for every pin N of this bank in GPCLRx
+		}
+		if (setBits)
+		{
+			gpiolib_write_reg(gpio, GPSET(bank), setBits); // set bit N for every pin N of this bank in GPSETx
+		}
+	}
+
+	return 0;
+}
+
+/* =================================================
+ * This function reads the levels of every pin in the
+ * mask, with a single read of each GPLEVx register
+ * that holds one of them.  Bit N of the result is the
+ * level of pin N; the bits of pins outside the mask
+ * are 0.
+ *
+ * @param: GPIO_Handle, uint64_t mask of pins - [0 - 53]
+ * @return: uint64_t levels of the pins in the mask (0 if the handle is NULL)
+ * ============================================== */
+
+uint64_t readPins(GPIO_Handle gpio, uint64_t mask)
+{
+	uint64_t levels = 0;
+
+	if (gpio == NULL)
+	{
+		return 0;
+	}
+	if (mask & 0xFFFFFFFFULL)
+	{
+		levels |= gpiolib_read_reg(gpio, GPLEV(0)); // get value of GPLEV0 register
+	}
+	if (mask >> 32)
+	{
+		levels |= (uint64_t) gpiolib_read_reg(gpio, GPLEV(1)) << 32; // get value of GPLEV1 register
+	}
+	return levels & mask;
+}
+
 /* =================================================
  * This function resets the control registers of the
  * GPIO to 0.  This ensures that all pins are set to
@@ -307,8 +751,9 @@ int freeGPIO(GPIO_Handle gpio)
 
 /* =================================================
  * This function takes in a buffer character array 
- * and returns the current date in yyyy-mm-dd format
- * and the time in 24 hour notation. 
+ * and returns the current date in mm-dd-yyyy format
+ * and the time in 24 hour notation with microseconds.
+ * The buffer must hold at least 30 characters.
  * 
  * Taken from lab4Sample
  *
@@ -318,17 +763,86 @@ int freeGPIO(GPIO_Handle gpio)
 
 void getTime(char *buffer)
 {
-	struct timeval tv;
-	time_t currentTime;
+	struct timespec currentTime;
+
+	clock_gettime(CLOCK_REALTIME, &currentTime);
+
+	formatTime(&currentTime, buffer);
+}
+
+/* =================================================
+ * This function writes the value passed to it as a
+ * zero padded decimal number of the given width.
+ *
+ * @param: char*, long value, int width
+ * @return: void
+ * ============================================== */
+
+static void writeDigits(char* buffer, long value, int width)
+{
+	for (int i = width - 1; i >= 0; --i)
+	{
+		buffer[i] = (char) ('0' + value % 10);
+		value /= 10;
+	}
+}
+
+/* =================================================
+ * This function takes in a point in time and a
+ * buffer character array and writes the date in
+ * mm-dd-yyyy format and the time in 24 hour
+ * notation with microseconds to the buffer.  It is
+ * used by the logger to stamp messages with the
+ * time they were queued rather than the time they
+ * were written.
+ *
+ * localtime() takes a lock and may read the time
+ * zone file, so it is only called once per hour per
+ * thread.  The "mm-dd-yyyy HH:" prefix is cached for
+ * that hour, the minutes and seconds are re-rendered
+ * once per second, and only the microseconds are
+ * rendered on every call.
+ *
+ * @param: struct timespec*, char*
+ * @return: void
+ * ============================================== */
+
+void formatTime(const struct timespec* time, char* buffer)
+{
+	static __thread time_t hourStart = 1;	// first second of the cached hour (1 never matches a real hour start)
+	static __thread time_t cachedSecond = -1;
+	static __thread char cached[27];	// "mm-dd-yyyy HH:MM:SS." followed by the microseconds
+
+	if (time->tv_sec != cachedSecond)
+	{
+		if (time->tv_sec < hourStart || time->tv_sec >= hourStart + 3600)
+		{
+			struct tm localTime;
+			localtime_r(&time->tv_sec, &localTime);
 
-	gettimeofday(&tv, NULL);
+			writeDigits(cached, localTime.tm_mon + 1, 2);
+			cached[2] = '-';
+			writeDigits(cached + 3, localTime.tm_mday, 2);
+			cached[5] = '-';
+			writeDigits(cached + 6, localTime.tm_year + 1900, 4);
+			cached[10] = ' ';
+			writeDigits(cached + 11, localTime.tm_hour, 2);
+			cached[13] = ':';
+			cached[16] = ':';
+			cached[19] = '.';
+			cached[26] = 0;
 
-	currentTime = tv.tv_sec;
+			hourStart = time->tv_sec - (localTime.tm_min * 60 + localTime.tm_sec);
+		}
 
-	// set buffer to a string of current date in mm-dd-yyyy
-	// and current time in 24 hour notation
+		long secondOfHour = time->tv_sec - hourStart;
+		writeDigits(cached + 14, secondOfHour / 60, 2);
+		writeDigits(cached + 17, secondOfHour % 60, 2);
+		cachedSecond = time->tv_sec;
+	}
 
-	strftime(buffer, 30, "%m-%d-%Y %T.", localtime(&currentTime));
+	writeDigits(cached + 20, time->tv_nsec / 1000, 6);
+	memcpy(buffer, cached, sizeof(cached));
 }
 
 /* =================================================
@@ -429,347 +943,4726 @@ void strCopy(char *dest, const char *source)
 }
 
 /* =================================================
- * This function takes in the pointer for the config
- * file and uses it to find the values to define
- * parameters that are given to it. Based on the
- * information in the config file, it defines the
- * number of seconds before the watchdog should time 
- * out, the default initial lock state, the file 
- * paths to the key specific log file, the lock
- * specific log file as well as the log file. 
- * 
- * @param: FILE*, int*, int*, char*, char*, char*
+ * This function sets every value stored in the
+ * configuration structure to the defaults defined
+ * in piLock.h.  It is called before loadConfig() so
+ * that parameters missing from the config file keep
+ * a sensible value.
+ *
+ * @param: LockConfig*
  * @return: void
  * ============================================== */
 
-void readConfig(FILE* config, int* timeout, int* lockState, char* commFilePath, char* lockLogFilePath, char* keyLogFilePath)
+void setDefaultConfig(LockConfig* settings)
 {
-	enum configReadState {START, DONE, COMMENT, WHITESPACE, PARAMETER, TIMEOUT, LOCKSTATE, FILEPATH};
-	enum configReadState configRead = START;
-	
-	char buffer[255];
+	settings->timeout = DEFAULT_TIMEOUT;
+	settings->lockState = DEFAULT_LOCK_STATE;
+	strCopy(settings->commFilePath, COMM_FILE_PATH);
+	strCopy(settings->lockLogFilePath, LOCK_LOG_FILE_PATH);
+	strCopy(settings->keyLogFilePath, KEY_LOG_FILE_PATH);
+	settings->logFlushInterval = DEFAULT_LOG_FLUSH_INTERVAL;
+	settings->logSummaryInterval = DEFAULT_LOG_SUMMARY_INTERVAL;
+	settings->logSegmentSize = DEFAULT_LOG_SEGMENT_SIZE;
+	settings->logSegmentCount = DEFAULT_LOG_SEGMENT_COUNT;
+	settings->logCompress = DEFAULT_LOG_COMPRESS;
+	settings->logFormat = LOG_FORMAT_TEXT;
+	settings->commTransport = COMM_TRANSPORT_FILE;
+	strCopy(settings->shmFilePath, SHM_FILE_PATH);
+	strCopy(settings->stateFilePath, STATE_FILE_PATH);
+	settings->lockCount = 0;
+	settings->commPort = DEFAULT_COMM_PORT;
+	strCopy(settings->commBindAddress, DEFAULT_COMM_BIND_ADDRESS);
+	settings->commSecret[0] = 0;
+	settings->debounceTime = DEFAULT_DEBOUNCE_TIME;
+	settings->coalesceWindow = DEFAULT_COALESCE_WINDOW;
+	settings->gpioBackend = GPIO_BACKEND_MMAP;
+	settings->gpioWaveformPath[0] = 0;
+}
 
-	int i = 0;
-	int n = 0;
-	char input = buffer[i];
-	char parameterName[255];
-
-	while(fgets(buffer, 255, config) != NULL) {
-		i = 0;
-		n = 0;
-		input = buffer[i];
-		configRead = START;
-		while (input != '\n') {
-			input = buffer[i];
-			if (input == 0) {
-				configRead = DONE;
-			}
-
-			switch (configRead)
-			{
-				case START:
-					if (('a' <= input && input <= 'z') || ('A' <= input && input <= 'Z'))
-					{
-						configRead = PARAMETER;
-					}
-					else if (input == '\n' || input == ' ')
-					{
-						configRead = WHITESPACE;
-					}
-					else if (input == '#')
-					{
-						configRead = COMMENT;
-					}
-					else
-					{
-						configRead = COMMENT;
-						// perror("Invalid characters in config file.");
-						// return;
-					}
-				break;
+/* =================================================
+ * Parameters that can be set in the config file.
+ * The table is searched with bsearch(), so it must
+ * stay sorted by name (in strcmp() order).  Every
+ * entry names the type of its value and where it is
+ * stored in the configuration structure.
+ * ============================================== */
 
-				case WHITESPACE:
-					if (('a' <= input && input <= 'z') || ('A' <= input && input <= 'Z'))
-					{
-						configRead = PARAMETER;
-					}
-					else
-					{
-						configRead = COMMENT;
-						// perror("Invalid characters in config file.");
-						// return;
-					}
-				break;
+enum ConfigType
+{
+	CONFIG_INTEGER,			// non-negative decimal integer
+	CONFIG_LOCKSTATE,		// 0 (unlocked) or 1 (locked)
+	CONFIG_PATH,			// absolute file path
+	CONFIG_TRANSPORT,		// "file", "shm" or "udp"
+	CONFIG_BACKEND,			// "mmap" or "sim"
+	CONFIG_LOG_FORMAT,		// "text" or "binary"
+	CONFIG_LOCK_ADDRESS,	// appended to the list of locks
+	CONFIG_ADDRESS,			// dotted IPv4 address
+	CONFIG_SECRET			// any text without blanks
+};
 
-				case PARAMETER:
-					if (strCompare("WATCHDOG_TIMEOUT", parameterName))
-					{
-						configRead = TIMEOUT;
-					}
-					else if (strCompare("DEFAULT_LOCK_STATE", parameterName))
-					{
-						configRead = LOCKSTATE;
-					}
-					else if (strCompare("COMMMUNICATION_FILE_PATH", parameterName)) 
-					{
-						configRead = FILEPATH;
-					}
-					else if (strCompare("LOCK_LOG_FILE_PATH", parameterName))
-					{
-						configRead = FILEPATH;
-					}
-					else if (strCompare("KEY_LOG_FILE_PATH", parameterName))
-					{
-						configRead = FILEPATH;
-					}
-					else
-					{
-						configRead = COMMENT;
-						// perror("Invalid characters in config file.");
-						// return;					
-					}
-					++i;
-				break;
+typedef struct ConfigParameter
+{
+	const char* name;
+	int type;				// ConfigType
+	size_t offset;			// offsetof() the value in LockConfig
+	size_t size;			// size of the value (paths, addresses and secrets only)
+} ConfigParameter;
 
-				case COMMENT:
-					while (input != '\n')
-					{
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-				break;
+#define CONFIG_FIELD(_name, _type, _field) { _name, _type, offsetof(LockConfig, _field), sizeof(((LockConfig*) 0)->_field) }
 
-				case TIMEOUT:
-				case LOCKSTATE
-				case FILEPATH:
-					if (input == '\n' || input == ' ')
-					{
-						configRead = WHITESPACE;
-						break;
-					}
-					else
-					{
-						configRead = COMMENT;
-						break;
-						// perror("Invalid characters in config file.");
-						// return;
-					}
-				break;	
-
-				case DONE:
-					return;
-				break;
+static const ConfigParameter configParameters[] =
+{
+	CONFIG_FIELD("COMMAND_COALESCE_WINDOW", CONFIG_INTEGER, coalesceWindow),
+	CONFIG_FIELD("COMMMUNICATION_FILE_PATH", CONFIG_PATH, commFilePath),
+	CONFIG_FIELD("COMM_BIND_ADDRESS", CONFIG_ADDRESS, commBindAddress),
+	CONFIG_FIELD("COMM_PORT", CONFIG_INTEGER, commPort),
+	CONFIG_FIELD("COMM_SECRET", CONFIG_SECRET, commSecret),
+	CONFIG_FIELD("COMM_TRANSPORT", CONFIG_TRANSPORT, commTransport),
+	CONFIG_FIELD("DEBOUNCE_TIME", CONFIG_INTEGER, debounceTime),
+	CONFIG_FIELD("DEFAULT_LOCK_STATE", CONFIG_LOCKSTATE, lockState),
+	CONFIG_FIELD("GPIO_BACKEND", CONFIG_BACKEND, gpioBackend),
+	CONFIG_FIELD("GPIO_WAVEFORM_PATH", CONFIG_PATH, gpioWaveformPath),
+	CONFIG_FIELD("KEY_LOG_FILE_PATH", CONFIG_PATH, keyLogFilePath),
+	CONFIG_FIELD("LOCK_ADDRESS", CONFIG_LOCK_ADDRESS, lockAddresses),
+	CONFIG_FIELD("LOCK_LOG_FILE_PATH", CONFIG_PATH, lockLogFilePath),
+	CONFIG_FIELD("LOG_COMPRESS", CONFIG_INTEGER, logCompress),
+	CONFIG_FIELD("LOG_FLUSH_INTERVAL", CONFIG_INTEGER, logFlushInterval),
+	CONFIG_FIELD("LOG_FORMAT", CONFIG_LOG_FORMAT, logFormat),
+	CONFIG_FIELD("LOG_SEGMENT_COUNT", CONFIG_INTEGER, logSegmentCount),
+	CONFIG_FIELD("LOG_SEGMENT_SIZE", CONFIG_INTEGER, logSegmentSize),
+	CONFIG_FIELD("LOG_SUMMARY_INTERVAL", CONFIG_INTEGER, logSummaryInterval),
+	CONFIG_FIELD("SHM_FILE_PATH", CONFIG_PATH, shmFilePath),
+	CONFIG_FIELD("STATE_FILE_PATH", CONFIG_PATH, stateFilePath),
+	CONFIG_FIELD("WATCHDOG_TIMEOUT", CONFIG_INTEGER, timeout)
+};
+
+#define CONFIG_PARAMETER_COUNT (sizeof(configParameters) / sizeof(configParameters[0]))
+
+// Name of a parameter as found in the config file, which is not NUL terminated
+typedef struct ConfigToken
+{
+	const char* text;
+	size_t length;
+} ConfigToken;
+
+static int compareConfigParameter(const void* key, const void* element)
+{
+	const ConfigToken* token = key;
+	const char* name = ((const ConfigParameter*) element)->name;
+
+	int difference = strncmp(token->text, name, token->length);
+	if (difference != 0)
+	{
+		return difference;
+	}
+	return (name[token->length] == 0) ? 0 : -1;	// the token is a prefix of a longer name
+}
+
+/* =================================================
+ * This function stores the value of one parameter
+ * in the configuration structure.
+ *
+ * @param: ConfigParameter*, char* value (not NUL terminated), size_t length of the value, LockConfig*
+ * @return: 0 = stored, -1 = invalid value
+ * ============================================== */
+
+static int setConfigValue(const ConfigParameter* parameter, const char* value, size_t length, LockConfig* settings)
+{
+	char* field = (char*) settings + parameter->offset;
+
+	switch (parameter->type)
+	{
+		case CONFIG_INTEGER:
+		case CONFIG_LOCKSTATE:
+		{
+			long number = 0;
+			for (size_t i = 0; i < length; ++i)
+			{
+				if (value[i] < '0' || value[i] > '9' || number > INT_MAX / 10)
+				{
+					return -1;
+				}
+				number = number * 10 + (value[i] - '0');
 			}
+			if (number > INT_MAX || (parameter->type == CONFIG_LOCKSTATE && number > 1))
+			{
+				return -1;
+			}
+			*(int*) field = (int) number;
+			return 0;
+		}
 
-			switch (configRead)
+		case CONFIG_PATH:
+			if (value[0] != '/' || length >= parameter->size)
 			{
-				case COMMENT:
-					while (input != '\n')
-					{
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-				break;
-				
-				case WHITESPACE:
-					while (input == ' ')
-					{
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-				break;
+				return -1;
+			}
+			memcpy(field, value, length);
+			field[length] = 0;
+			return 0;
 
-				case PARAMETER:
-					
-					n = 0;
-					input = buffer[i];
-					while (input != ' ' && input != '=') 
-					{
-						if (!(('a' <= input && input <= 'z') || ('A' <= input && input <= 'Z') || ('0' <= input && input <= '9') || input == '_'))
-						{
-							configRead = COMMENT;
-							// perror("Invalid characters in config file.");
-							// return;
-							break;					
-						}
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						parameterName[n] = input;
-						++n;
-						++i;
-						input = buffer[i];
-					}
-					if (configRead != PARAMETER) {
-						break;
-					}
-					parameterName[n] = 0;
-
-					while (input != '=') 
-					{
-						if (input != ' ')
-						{
-							configRead = COMMENT;
-							// perror("Invalid characters in config file.");
-							// return;
-							break;
-						}
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];	
-					}
-				break;
+		case CONFIG_TRANSPORT:
+			if (length == 4 && memcmp(value, "file", 4) == 0)
+			{
+				*(int*) field = COMM_TRANSPORT_FILE;
+			}
+			else if (length == 3 && memcmp(value, "shm", 3) == 0)
+			{
+				*(int*) field = COMM_TRANSPORT_SHM;
+			}
+			else if (length == 3 && memcmp(value, "udp", 3) == 0)
+			{
+				*(int*) field = COMM_TRANSPORT_UDP;
+			}
+			else
+			{
+				return -1;
+			}
+			return 0;
 
-				case TIMEOUT:
-					input = buffer[i];
-					while (!('0' <= input && input <= '9'))
-					{
-						if (input != ' ')
-						{
-							configRead = COMMENT;
-							// perror("Invalid characters in config file.");
-							// return;
-							break;
-						}
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-					if (configRead == TIMEOUT) {
-						*timeout = 0;
-					} else {
-						break;
-					}
-					while ('0' <= input && input <= '9') {
-						*timeout = (*timeout *10) + (input - '0');
-						++i;
-						input = buffer[i];
-					}
-				break;
+		case CONFIG_BACKEND:
+			if (length == 4 && memcmp(value, "mmap", 4) == 0)
+			{
+				*(int*) field = GPIO_BACKEND_MMAP;
+			}
+			else if (length == 3 && memcmp(value, "sim", 3) == 0)
+			{
+				*(int*) field = GPIO_BACKEND_SIM;
+			}
+			else
+			{
+				return -1;
+			}
+			return 0;
 
-				case LOCKSTATE:
-					input = buffer[i];
-					while (!('0' <= input && input <= '1'))
-					{
-						if (input != ' ')
-						{
-							configRead = COMMENT;
-							// perror("Invalid characters in config file.");
-							// return;
-							break;
-						}
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-					if (configRead != LOCKSTATE) {
-						break;
-					}
-
-					if (buffer[i] == '1') {
-						*lockState = 1;
-					} else {
-						*lockState = 0;
-					}
-					++i;
-					input = buffer[i];
-				break;
+		case CONFIG_LOG_FORMAT:
+			if (length == 4 && memcmp(value, "text", 4) == 0)
+			{
+				*(int*) field = LOG_FORMAT_TEXT;
+			}
+			else if (length == 6 && memcmp(value, "binary", 6) == 0)
+			{
+				*(int*) field = LOG_FORMAT_BINARY;
+			}
+			else
+			{
+				return -1;
+			}
+			return 0;
 
-				case FILEPATH:
-					input = buffer[i];
-					
-					char* copyPath;
-					if (strCompare("COMMMUNICATION_FILE_PATH", parameterName)) 
-					{
-						copyPath = commFilePath;
-					}
-					else if (strCompare("LOCK_LOG_FILE_PATH", parameterName))
-					{
-						copyPath = lockLogFilePath;
-					}
-					else if (strCompare("KEY_LOG_FILE_PATH", parameterName))
-					{
-						copyPath = keyLogFilePath;
-					}
-					else
-					{
-						break;
-					}
-
-
-					while (input != '/')
-					{
-						if (input != ' ')
-						{
-							configRead = COMMENT;
-							// perror("Invalid characters in config file.");
-							// return;
-							break;
-						}
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						++i;
-						input = buffer[i];
-					}
-					if (configRead != FILEPATH) {
-						break;
-					}
-					
-					n = 0;
-					while (input != ' ' && input != '\n')
-					{
-						if (input == 0) {
-							configRead = DONE;
-							break;
-						}
-						copyPath[n] = input;
-						++n;
-						++i;
-						input = buffer[i];
-					}
-					copyPath[n] = 0;
-				break;
+		case CONFIG_ADDRESS:
+		{
+			struct in_addr address;
+			if (length >= parameter->size)
+			{
+				return -1;
 			}
+			memcpy(field, value, length);
+			field[length] = 0;
+			return (inet_pton(AF_INET, field, &address) == 1) ? 0 : -1;
+		}
+
+		case CONFIG_SECRET:
+			if (length >= parameter->size)
+			{
+				return -1;
+			}
+			memcpy(field, value, length);
+			field[length] = 0;
+			return 0;
+
+		case CONFIG_LOCK_ADDRESS:
+			// Every LOCK_ADDRESS line adds one lock to the list controlled by the key
+			if (settings->lockCount >= MAX_LOCKS || length >= LOCK_ADDRESS_LENGTH)
+			{
+				return -1;
+			}
+			memcpy(settings->lockAddresses[settings->lockCount], value, length);
+			settings->lockAddresses[settings->lockCount][length] = 0;
+			settings->lockCount++;
+			return 0;
+	}
+
+	return -1;
+}
+
+/* =================================================
+ * This function parses the text of a config file in
+ * a single pass.  Every line is either blank, a
+ * comment starting with '#', or "NAME = value"
+ * (optionally followed by a comment).  The name is
+ * looked up in the sorted parameter table and the
+ * value is stored with its type.  Parameters that
+ * are not set keep their current value.  Lines that
+ * cannot be used are reported on stderr and skipped
+ * rather than guessed at.
+ *
+ * @param: char* text (not NUL terminated), size_t length, LockConfig*
+ * @return: number of lines that were skipped
+ * ============================================== */
+
+int parseConfig(const char* text, size_t length, LockConfig* settings)
+{
+	const char* position = text;
+	const char* end = text + length;
+	int lineNumber = 0;
+	int invalid = 0;
+
+	while (position < end)
+	{
+		const char* lineEnd = memchr(position, '\n', end - position);
+		if (lineEnd == NULL)
+		{
+			lineEnd = end;
+		}
+		const char* line = position;
+		position = lineEnd + 1;
+		lineNumber++;
+
+		// Name
+		const char* c = line;
+		while (c < lineEnd && (*c == ' ' || *c == '\t' || *c == '\r'))
+		{
+			++c;
+		}
+		if (c == lineEnd || *c == '#')
+		{
+			continue;	// blank line or comment
+		}
+
+		ConfigToken name = { c, 0 };
+		while (c < lineEnd && (isalnum((unsigned char) *c) || *c == '_'))
+		{
+			++c;
+		}
+		name.length = c - name.text;
+
+		// "="
+		while (c < lineEnd && (*c == ' ' || *c == '\t'))
+		{
+			++c;
+		}
+		if (name.length == 0 || c == lineEnd || *c != '=')
+		{
+			fprintf(stderr, "Config file line %d: expected \"NAME = value\", line ignored\n", lineNumber);
+			invalid++;
+			continue;
+		}
+		++c;
+
+		// Value, which may only be followed by a comment
+		while (c < lineEnd && (*c == ' ' || *c == '\t'))
+		{
+			++c;
+		}
+		const char* value = c;
+		while (c < lineEnd && *c != ' ' && *c != '\t' && *c != '\r')
+		{
+			++c;
+		}
+		size_t valueLength = c - value;
+		while (c < lineEnd && (*c == ' ' || *c == '\t' || *c == '\r'))
+		{
+			++c;
+		}
+
+		const ConfigParameter* parameter = bsearch(&name, configParameters, CONFIG_PARAMETER_COUNT, sizeof(ConfigParameter), compareConfigParameter);
+		if (parameter == NULL)
+		{
+			fprintf(stderr, "Config file line %d: unknown parameter %.*s, line ignored\n", lineNumber, (int) name.length, name.text);
+			invalid++;
+		}
+		else if (valueLength == 0 || (c < lineEnd && *c != '#') || setConfigValue(parameter, value, valueLength, settings) != 0)
+		{
+			fprintf(stderr, "Config file line %d: invalid value for %s, line ignored\n", lineNumber, parameter->name);
+			invalid++;
 		}
 	}
+
+	return invalid;
+}
+
+/* =================================================
+ * This function maps the config file at the path
+ * passed to it and parses it with parseConfig().
+ * Based on the information in the config file, it
+ * defines the number of seconds before the watchdog
+ * should time out, the default initial lock state,
+ * the file paths to the key specific log file, the
+ * lock specific log file as well as the log file,
+ * how often the logger flushes messages to disk, how
+ * often repeated messages are summarized, which
+ * transport ("file", "shm" or "udp") carries the
+ * commands between the key and the lock (along with
+ * the port and address of the lock, the secret that
+ * authenticates the packets and the list of locks
+ * the key controls for "udp"), the debounce time and
+ * the GPIO backend.
+ *
+ * @param: char* path, LockConfig*
+ * @return: 0 = successful execution, -1 = the file could not be read
+ * ============================================== */
+
+int loadConfig(const char* path, LockConfig* settings)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if (status.st_size == 0)
+	{
+		close(fd);
+		return 0;	// an empty file leaves every parameter at its default, and cannot be mapped
+	}
+
+	void* text = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	parseConfig(text, status.st_size, settings);
+	munmap(text, status.st_size);
+	return 0;
 }
 
 /* =================================================
  * This function reads the first character of the 
  * file passed to it, and returns the first 
- * integer that it reads. 
+ * integer that it reads.  The trace ID written
+ * after the command (in hexadecimal) is stored if
+ * traceId is not NULL, or 0 if there is none.
  *
- * @param: char*
+ * @param: char*, uint32_t* trace ID (may be NULL)
  * @return: int, first character read in the file. 
  * ============================================== */
 
-int readCommunicationFile(char *commFilePath) // returns 1 if should be locked, 0 otherwise
+int readCommunicationFile(char *commFilePath, uint32_t* traceId) // returns 1 if should be locked, 0 otherwise
 {
 	FILE *commFile = fopen(commFilePath, "r");
-	return (fgetc(commFile) - '0');
+	if (commFile == NULL)
+	{
+		return -1;
+	}
+
+	int command = fgetc(commFile);
+	unsigned int trace = 0;
+	if (command != EOF && fscanf(commFile, " %x", &trace) != 1)
+	{
+		trace = 0;
+	}
+	fclose(commFile);
+
+	if (traceId != NULL)
+	{
+		*traceId = trace;
+	}
+
+	if (command == EOF)
+	{
+		return -1;
+	}
+	return (command - '0');
+}
+
+/* =================================================
+ * This function writes a command and its trace ID
+ * to the file passed to it, replacing its contents.
+ *
+ * @param: char*, int command (1 = lock, 0 = unlock), uint32_t trace ID
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int writeCommunicationFile(char *commFilePath, int command, uint32_t traceId)
+{
+	FILE *commFile = fopen(commFilePath, "w");
+	if (commFile == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(commFile, "%d %08x", command ? 1 : 0, traceId);
 	fclose(commFile);
-}
\ No newline at end of file
+	return 0;
+}
+
+/* =================================================
+ * This function returns 1 if the file system that
+ * holds the path passed to it is a network share.
+ * inotify only reports changes made by this machine,
+ * so writes made by the other Pi over Samba or NFS
+ * are never seen through it.
+ *
+ * @param: char*
+ * @return: 1 if network file system, 0 otherwise
+ * ============================================== */
+
+static int isNetworkFileSystem(const char* path)
+{
+	struct statfs fileSystem;
+	if (statfs(path, &fileSystem) != 0)
+	{
+		return 0;
+	}
+
+	switch ((uint32_t) fileSystem.f_type)
+	{
+		case 0xFF534D42: // CIFS
+		case 0xFE534D42: // SMB2
+		case 0x517B:     // SMB
+		case 0x6969:     // NFS
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* =================================================
+ * This function sets up a watcher on the communication
+ * file so that it only has to be opened once it has
+ * actually changed.  If the file lives on a local file
+ * system, inotify is used on its directory (so the file
+ * can be re-created or replaced).  If the file lives on
+ * a network share, or inotify is unavailable, a timerfd
+ * fires every COMM_POLL_INTERVAL_MS and the status of
+ * the file is compared instead of opening it.
+ *
+ * @param: CommWatcher*, char*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initCommWatcher(CommWatcher* watcher, const char* commFilePath)
+{
+	if (watcher == NULL || commFilePath == NULL)
+	{
+		return -1;
+	}
+
+	char directory[255];
+	strCopy(watcher->commFilePath, commFilePath);
+	strCopy(directory, commFilePath);
+
+	// Split the path into the directory to watch and the name of the file inside of it
+	char* slash = strrchr(directory, '/');
+	if (slash == NULL)
+	{
+		strCopy(watcher->fileName, directory);
+		strCopy(directory, ".");
+	}
+	else
+	{
+		strCopy(watcher->fileName, slash + 1);
+		if (slash == directory)
+		{
+			slash[1] = 0;
+		}
+		else
+		{
+			slash[0] = 0;
+		}
+	}
+
+	watcher->fd = -1;
+	if (!isNetworkFileSystem(directory))
+	{
+		watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (watcher->fd >= 0 && inotify_add_watch(watcher->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0)
+		{
+			close(watcher->fd);
+			watcher->fd = -1;
+		}
+		watcher->mode = COMM_WATCH_INOTIFY;
+	}
+
+	if (watcher->fd < 0)
+	{
+		// Fall back to checking the status of the file on a timer
+		watcher->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (watcher->fd < 0)
+		{
+			return -1;
+		}
+
+		struct itimerspec interval;
+		interval.it_interval.tv_sec = COMM_POLL_INTERVAL_MS / 1000;
+		interval.it_interval.tv_nsec = (COMM_POLL_INTERVAL_MS % 1000) * 1000000L;
+		interval.it_value = interval.it_interval;
+		timerfd_settime(watcher->fd, 0, &interval, NULL);
+
+		if (stat(watcher->commFilePath, &watcher->lastStat) != 0)
+		{
+			memset(&watcher->lastStat, 0, sizeof(watcher->lastStat));
+		}
+		watcher->mode = COMM_WATCH_TIMER;
+	}
+
+	return 0;
+}
+
+/* =================================================
+ * This function checks, without blocking, if the
+ * communication file has changed since the last
+ * call.  Any pending notifications are drained so
+ * that each change is only reported once.
+ *
+ * @param: CommWatcher*
+ * @return: 1 = file changed, 0 = no change, -1 = error
+ * ============================================== */
+
+int commFileChanged(CommWatcher* watcher)
+{
+	if (watcher == NULL || watcher->fd < 0)
+	{
+		return -1;
+	}
+
+	int changed = 0;
+
+	if (watcher->mode == COMM_WATCH_INOTIFY)
+	{
+		char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t length;
+
+		while ((length = read(watcher->fd, events, sizeof(events))) > 0)
+		{
+			char* event = events;
+			while (event < events + length)
+			{
+				struct inotify_event* notification = (struct inotify_event*) event;
+				if (notification->len > 0 && strCompare(watcher->fileName, notification->name))
+				{
+					changed = 1;
+				}
+				event += sizeof(struct inotify_event) + notification->len;
+			}
+		}
+
+		if (length < 0 && errno != EAGAIN)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		uint64_t expirations;
+		if (read(watcher->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		{
+			return 0; // the timer has not fired yet, so do not touch the share
+		}
+
+		struct stat current;
+		if (stat(watcher->commFilePath, &current) != 0)
+		{
+			memset(&current, 0, sizeof(current));
+		}
+
+		if (current.st_ino != watcher->lastStat.st_ino ||
+			current.st_size != watcher->lastStat.st_size ||
+			current.st_mtim.tv_sec != watcher->lastStat.st_mtim.tv_sec ||
+			current.st_mtim.tv_nsec != watcher->lastStat.st_mtim.tv_nsec ||
+			current.st_ctim.tv_sec != watcher->lastStat.st_ctim.tv_sec ||
+			current.st_ctim.tv_nsec != watcher->lastStat.st_ctim.tv_nsec)
+		{
+			changed = 1;
+		}
+		watcher->lastStat = current;
+	}
+
+	return changed;
+}
+
+/* =================================================
+ * This function blocks until the communication file
+ * changes or until timeoutMs milliseconds have passed
+ * (a negative timeout waits forever).
+ *
+ * @param: CommWatcher*, int
+ * @return: 1 = file changed, 0 = timed out, -1 = error
+ * ============================================== */
+
+int waitCommFileChange(CommWatcher* watcher, int timeoutMs)
+{
+	if (watcher == NULL || watcher->fd < 0)
+	{
+		return -1;
+	}
+
+	struct pollfd waitFd = { watcher->fd, POLLIN, 0 };
+	struct timespec now, deadline;
+	int changed = 0;
+	int remaining = timeoutMs;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+
+	// Timer mode wakes up every COMM_POLL_INTERVAL_MS even if nothing changed, so keep waiting until it does
+	while (!changed)
+	{
+		int ready = poll(&waitFd, 1, remaining);
+		if (ready < 0 && errno != EINTR)
+		{
+			return -1;
+		}
+		if (ready > 0)
+		{
+			changed = commFileChanged(watcher);
+		}
+
+		if (!changed && timeoutMs >= 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = (int) ((deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L);
+			if (remaining <= 0)
+			{
+				return 0;
+			}
+		}
+	}
+
+	return changed;
+}
+
+/* =================================================
+ * This function closes the descriptor used by the
+ * communication file watcher.
+ *
+ * @param: CommWatcher*
+ * @return: void
+ * ============================================== */
+
+void freeCommWatcher(CommWatcher* watcher)
+{
+	if (watcher != NULL && watcher->fd >= 0)
+	{
+		close(watcher->fd);
+		watcher->fd = -1;
+	}
+}
+
+/* ======================================
+ * Asynchronous logger
+ * ===================================== */
+
+volatile sig_atomic_t stopRequested = 0;
+volatile sig_atomic_t reloadRequested = 0;
+
+/* =================================================
+ * Messages of the binary log format that are stored
+ * as a single record, by code.  The code of a message
+ * is its index plus AUDIT_EVENT_MESSAGE, so entries
+ * must only ever be added at the end.
+ * ============================================== */
+
+const char* const auditMessages[] =
+{
+	"# A new log file was created\n\n",
+	"# The log file has been opened.\n\n",
+	"# The program has started. \n\n",
+	"# The communication file has been opened.\n\n",
+	"A new communication file was created\n\n",
+	"# Reading commands from the shared memory record.\n\n",
+	"# Listening for commands over UDP and TCP, the communication file is kept as a fallback.\n\n",
+	"# Watching the communication file with inotify.\n\n",
+	"# Polling the status of the communication file on a timer.\n\n",
+	"The command transport could not be opened!\n\n",
+	"# The sim GPIO backend is in use, the Watchdog is not opened\n\n",
+	"The Watchdog file could not be opened!\n\n",
+	"# The Watchdog file has been opened\n\n",
+	"The Watchdog supervisor could not be set up!\n\n",
+	"The Watchdog supervisor could not be started!\n\n",
+	"# The Watchdog time limit has been set\n\n",
+	"# The Watchdog time limit has been changed\n\n",
+	"The Watchdog could not be updated!\n\n",
+	"The Watchdog was disabled\n\n",
+	"The Watchdog was closed\n\n",
+	"GPIO could not be initialized!\n\n",
+	"The GPIO pins have been initialized\n\n",
+	"Pin 14, 15, 18 have been set to output\n Pin 23, 24 have been set to input\n\n",
+	"Pin 14, 15, 18 have been set to output\n Pin 23 has been set to input\n\n",
+	"# Waiting for edges on pin 23, 24 with pigpio alerts\n\n",
+	"The pigpio alerts could not be registered, the pins will be polled\n\n",
+	"The GPIO pins have been freed\n\n",
+	"Read communication file, received command to LOCK \n",
+	"Read communication file, received command to UNLOCK \n",
+	"The door has been LOCKED. \n",
+	"The door has been UNLOCKED. \n",
+	"The door is open, waiting until door is closed to lock \n",
+	"Wrote command to lock the door to communication file\n",
+	"Wrote command to unlock the door to communication file\n",
+	"The config file cannot be watched, send SIGHUP to reload it\n\n",
+	"The config file could not be read, the current configuration is kept\n\n",
+	"# The configuration has been reloaded\n\n",
+	"The new log file could not be opened, the current one is kept\n\n",
+	"# The command transport has been changed\n\n",
+	"The new command transport could not be opened, the current one is kept\n\n",
+	"GPIO_BACKEND and GPIO_WAVEFORM_PATH only take effect when the program is restarted\n\n",
+	"gzip could not be started, the rotated log segments are left uncompressed\n\n",
+	"LOG_FORMAT only takes effect when the program is restarted\n\n",
+	"COMM_SECRET is not set, the commands received over the network are refused\n\n",
+	"Received command to LOCK, held until the coalescing window is over \n",
+	"Commands received during the coalescing window were coalesced, only the last one is applied \n",
+	"The door was opened before it settled, waiting until door is closed to lock \n"
+};
+
+const int auditMessageCount = sizeof(auditMessages) / sizeof(auditMessages[0]);
+
+// Stages of logTrace() lines, stored as the length of an AUDIT_EVENT_TRACE record
+const char* const auditTraceStages[] = { "press", "sent", "ack", "observe", "door", "led", "servo" };
+
+const int auditTraceStageCount = sizeof(auditTraceStages) / sizeof(auditTraceStages[0]);
+
+/* =================================================
+ * This function updates a CRC-32 (the polynomial of
+ * zlib and Ethernet) with a block of data, half a
+ * byte at a time so that the table stays small.
+ * Start with a CRC of 0.
+ *
+ * @param: uint32_t crc, void* data, size_t length
+ * @return: uint32_t updated CRC
+ * ============================================== */
+
+uint32_t crc32(uint32_t crc, const void* data, size_t length)
+{
+	static const uint32_t table[16] =
+	{
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	const unsigned char* bytes = data;
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; ++i)
+	{
+		crc ^= bytes[i];
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+	return ~crc;
+}
+
+/* =================================================
+ * This function appends a record followed by a text
+ * to the batch buffer, the text padded with zeros to
+ * a whole number of records.
+ *
+ * @param: char* batch, size_t* length, AuditRecord*, char* text
+ * @return: void
+ * ============================================== */
+
+static void appendAuditText(char* batch, size_t* length, AuditRecord* record, const char* text)
+{
+	size_t textLength = strlen(text);
+	size_t padded = (textLength + sizeof(AuditRecord) - 1) & ~(sizeof(AuditRecord) - 1);
+
+	record->length = (uint16_t) textLength;
+	memcpy(batch + *length, record, sizeof(AuditRecord));
+	memcpy(batch + *length + sizeof(AuditRecord), text, textLength);
+	memset(batch + *length + sizeof(AuditRecord) + textLength, 0, padded - textLength);
+	*length += sizeof(AuditRecord) + padded;
+}
+
+/* =================================================
+ * This function completes the header of the block
+ * being filled in the batch buffer, if there is one.
+ * Its sequence number and CRC are only filled in by
+ * writeAuditBlocks().
+ *
+ * @param: Logger*, char* batch
+ * @return: void
+ * ============================================== */
+
+static void closeAuditBlock(Logger* logger, char* batch)
+{
+	if (logger->blockStart == LOG_BATCH_SIZE)
+	{
+		return;
+	}
+
+	AuditBlockHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = AUDIT_BLOCK_MAGIC;
+	header.records = (uint16_t) logger->blockRecords;
+	header.version = 1;
+	memcpy(batch + logger->blockStart, &header, sizeof(header));
+	logger->blockStart = LOG_BATCH_SIZE;
+}
+
+/* =================================================
+ * This function appends the records of one message
+ * to the batch buffer.  Blocks are built in the
+ * buffer itself, and a message never straddles two
+ * blocks, so the blocks that follow a damaged one
+ * can still be read.
+ *
+ * @param: Logger*, char* batch, size_t* length, char* records, size_t records length
+ * @return: void
+ * ============================================== */
+
+static void appendAuditMessage(Logger* logger, char* batch, size_t* length, const char* records, size_t recordsLength)
+{
+	int count = (int) (recordsLength / sizeof(AuditRecord));
+
+	if (logger->blockStart == LOG_BATCH_SIZE || logger->blockRecords + count > AUDIT_BLOCK_RECORDS)
+	{
+		closeAuditBlock(logger, batch);
+		logger->blockStart = *length;			// the header is written once the block is complete
+		logger->blockRecords = 0;
+		*length += sizeof(AuditBlockHeader);
+	}
+
+	memcpy(batch + *length, records, recordsLength);
+	*length += recordsLength;
+	logger->blockRecords += count;
+}
+
+/* =================================================
+ * This function appends the records of one message
+ * to the batch buffer: a single record for the
+ * messages of auditMessages[], two for a TRACE line
+ * and a record followed by the text for any other
+ * message.
+ *
+ * @param: Logger*, char* batch, size_t* length, struct timespec*, char* message
+ * @return: void
+ * ============================================== */
+
+static void appendAuditRecords(Logger* logger, char* batch, size_t* length, const struct timespec* time, const char* message)
+{
+	char records[2 * sizeof(AuditRecord) + LOG_MESSAGE_LENGTH];
+	size_t recordsLength = 0;
+	AuditRecord record;
+	memset(&record, 0, sizeof(record));
+	record.time = (uint64_t) time->tv_sec * 1000000ULL + time->tv_nsec / 1000;
+
+	for (int code = 0; code < auditMessageCount && recordsLength == 0; ++code)
+	{
+		if (strcmp(message, auditMessages[code]) == 0)
+		{
+			record.event = AUDIT_EVENT_MESSAGE + code;
+			memcpy(records, &record, sizeof(record));
+			recordsLength = sizeof(record);
+		}
+	}
+
+	unsigned int traceId;
+	char stage[16];
+	unsigned long long clocks[2];
+	if (recordsLength == 0 && strncmp(message, "TRACE ", 6) == 0 &&
+		sscanf(message, "TRACE %x %15s %llu %llu", &traceId, stage, &clocks[0], &clocks[1]) == 4)
+	{
+		for (int index = 0; index < auditTraceStageCount && recordsLength == 0; ++index)
+		{
+			if (strcmp(stage, auditTraceStages[index]) == 0)
+			{
+				uint64_t times[2] = { clocks[0], clocks[1] };		// CLOCK_REALTIME and CLOCK_MONOTONIC, in nanoseconds
+				record.event = AUDIT_EVENT_TRACE;
+				record.length = (uint16_t) index;
+				record.argument = traceId;
+				memcpy(records, &record, sizeof(record));
+				memcpy(records + sizeof(record), times, sizeof(times));
+				recordsLength = sizeof(record) + sizeof(times);
+			}
+		}
+	}
+
+	if (recordsLength == 0)
+	{
+		record.event = AUDIT_EVENT_TEXT;
+		appendAuditText(records, &recordsLength, &record, message);
+	}
+
+	appendAuditMessage(logger, batch, length, records, recordsLength);
+}
+
+/* =================================================
+ * This function writes the blocks of the batch
+ * buffer to the log file in a single writev(),
+ * after giving each one its sequence number and the
+ * CRC-32 of its records.  The first blocks written
+ * to a log file are preceded by one that names the
+ * program.  The caller holds fileLock.
+ *
+ * @param: Logger*, char* batch, size_t length
+ * @return: ssize_t bytes written, -1 = error
+ * ============================================== */
+
+static ssize_t writeAuditBlocks(Logger* logger, char* batch, size_t length)
+{
+	char program[sizeof(AuditBlockHeader) + 2 * sizeof(AuditRecord) + sizeof(logger->programName)];
+	size_t programLength = 0;
+	AuditBlockHeader header;
+
+	closeAuditBlock(logger, batch);
+
+	if (logger->blockSequence == 0)
+	{
+		struct timespec now;
+		AuditRecord record;
+		clock_gettime(CLOCK_REALTIME, &now);
+		memset(&record, 0, sizeof(record));
+		record.time = (uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+		record.event = AUDIT_EVENT_PROGRAM;
+		programLength = sizeof(AuditBlockHeader);
+		appendAuditText(program, &programLength, &record, logger->programName);
+
+		memset(&header, 0, sizeof(header));
+		header.magic = AUDIT_BLOCK_MAGIC;
+		header.records = (uint16_t) ((programLength - sizeof(AuditBlockHeader)) / sizeof(AuditRecord));
+		header.version = 1;
+		header.sequence = logger->blockSequence++;
+		header.crc = crc32(0, program + sizeof(AuditBlockHeader), programLength - sizeof(AuditBlockHeader));
+		memcpy(program, &header, sizeof(header));
+	}
+
+	for (size_t offset = 0; offset + sizeof(AuditBlockHeader) <= length; )
+	{
+		memcpy(&header, batch + offset, sizeof(header));
+		size_t recordsLength = header.records * sizeof(AuditRecord);
+		header.sequence = logger->blockSequence++;
+		header.crc = crc32(0, batch + offset + sizeof(AuditBlockHeader), recordsLength);
+		memcpy(batch + offset, &header, sizeof(header));
+		offset += sizeof(AuditBlockHeader) + recordsLength;
+	}
+
+	struct iovec vectors[2] = { { program, programLength }, { batch, length } };
+	return writev(logger->fd, (programLength > 0) ? vectors : &vectors[1], (programLength > 0) ? 2 : 1);
+}
+
+// ioprio_set() values (linux/ioprio.h), used to give the compressor thread the idle I/O class
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+/* =================================================
+ * This function finds the rotated segments of a log
+ * file, "<log file>.<N>" or "<log file>.<N>.gz", and
+ * returns the lowest and highest N.  If there is
+ * none, oldest is newest + 1.
+ *
+ * @param: char* log file path, unsigned long* oldest, unsigned long* newest
+ * @return: void
+ * ============================================== */
+
+static void findLogSegments(const char* path, unsigned long* oldest, unsigned long* newest)
+{
+	char directory[255];
+	const char* name = strrchr(path, '/');
+
+	if (name == NULL)
+	{
+		strCopy(directory, ".");
+		name = path;
+	}
+	else
+	{
+		snprintf(directory, sizeof(directory), "%.*s", (name == path) ? 1 : (int) (name - path), path);
+		name++;
+	}
+
+	*oldest = 1;
+	*newest = 0;
+	size_t nameLength = strlen(name);
+	int found = 0;
+	DIR* list = opendir(directory);
+	if (list == NULL)
+	{
+		return;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(list)) != NULL)
+	{
+		const char* suffix = entry->d_name + nameLength;
+		if (strncmp(entry->d_name, name, nameLength) != 0 || suffix[0] != '.' || !isdigit((unsigned char) suffix[1]))
+		{
+			continue;
+		}
+
+		char* end;
+		unsigned long number = strtoul(suffix + 1, &end, 10);
+		if (*end != 0 && strcmp(end, ".gz") != 0)
+		{
+			continue;
+		}
+
+		if (!found || number < *oldest)
+		{
+			*oldest = number;
+		}
+		if (!found || number > *newest)
+		{
+			*newest = number;
+		}
+		found = 1;
+	}
+	closedir(list);
+}
+
+/* =================================================
+ * This function reads the size of the active
+ * segment and reserves the rest of it on the disk,
+ * so that appending to it does not fragment the
+ * file.  FALLOC_FL_KEEP_SIZE leaves the size of the
+ * file alone, so readers only see the lines written
+ * so far.  File systems that cannot preallocate
+ * (e.g. a CIFS share) simply skip it.  The caller
+ * holds fileLock.
+ *
+ * @param: Logger*
+ * @return: void
+ * ============================================== */
+
+static void startLogSegment(Logger* logger)
+{
+	struct stat status;
+	logger->segmentBytes = (fstat(logger->fd, &status) == 0) ? status.st_size : 0;
+
+	if (logger->segmentSize > logger->segmentBytes)
+	{
+		fallocate(logger->fd, FALLOC_FL_KEEP_SIZE, 0, logger->segmentSize);
+	}
+}
+
+/* =================================================
+ * This function deletes the oldest rotated segments
+ * until only segmentCount of them are left.  The
+ * caller holds fileLock.
+ *
+ * @param: Logger*
+ * @return: void
+ * ============================================== */
+
+static void pruneLogSegments(Logger* logger)
+{
+	char segment[sizeof(logger->path) + 32];
+
+	while (logger->oldestSegment <= logger->newestSegment &&
+		logger->newestSegment - logger->oldestSegment + 1 > (unsigned long) logger->segmentCount)
+	{
+		snprintf(segment, sizeof(segment), "%s.%lu", logger->path, logger->oldestSegment);
+		unlink(segment);
+		snprintf(segment, sizeof(segment), "%s.%lu.gz", logger->path, logger->oldestSegment);
+		unlink(segment);
+		logger->oldestSegment++;
+	}
+}
+
+/* =================================================
+ * This function closes the active segment: it is
+ * renamed to "<log file>.<N>" and a new, empty
+ * segment is put in place of the log file with
+ * dup2().  The oldest segments are then deleted and
+ * the compressor thread is woken up.  Only the
+ * writer thread rotates, with fileLock held.
+ *
+ * @param: Logger*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int rotateLogSegment(Logger* logger)
+{
+	char segment[sizeof(logger->path) + 32];
+	unsigned long number = logger->newestSegment + 1;
+	snprintf(segment, sizeof(segment), "%s.%lu", logger->path, number);
+
+	if (rename(logger->path, segment) != 0)
+	{
+		return -1;
+	}
+
+	int fd = open(logger->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || dup2(fd, logger->fd) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		rename(segment, logger->path);
+		return -1;
+	}
+	close(fd);
+
+	if (logger->oldestSegment > logger->newestSegment)
+	{
+		logger->oldestSegment = number;
+	}
+	logger->newestSegment = number;
+	logger->rotations++;
+	logger->blockSequence = 0;
+	startLogSegment(logger);
+	pruneLogSegments(logger);
+
+	if (logger->compress)
+	{
+		uint64_t wakeup = 1;
+		write(logger->compressFd, &wakeup, sizeof(wakeup));
+	}
+
+	// Start the new segment with a line that points its reader to the previous lines (a binary segment starts with the program instead)
+	if (logger->format == LOG_FORMAT_BINARY)
+	{
+		return 0;
+	}
+
+	char line[LOG_MESSAGE_LENGTH + 128];
+	char timeString[30];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	formatTime(&now, timeString);
+	int length = snprintf(line, sizeof(line), "%s : %s : # The log file was rotated, the previous lines are in %.180s\n\n",
+		timeString, logger->programName, segment);
+	ssize_t written = write(logger->fd, line, (length < (int) sizeof(line)) ? length : (int) sizeof(line) - 1);
+	if (written > 0)
+	{
+		logger->segmentBytes += written;
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function writes a batch of formatted lines
+ * to the log file, rotating it first if the batch
+ * would take the active segment past segmentSize.
+ * Only the writer thread calls this function.
+ *
+ * @param: Logger*, char* batch, size_t length
+ * @return: void
+ * ============================================== */
+
+static void writeLogBatch(Logger* logger, char* batch, size_t length)
+{
+	pthread_mutex_lock(&logger->fileLock);
+
+	if (logger->segmentSize > 0 && logger->segmentBytes > 0 && logger->segmentBytes + (off_t) length > logger->segmentSize)
+	{
+		rotateLogSegment(logger);
+	}
+
+	ssize_t written = (logger->format == LOG_FORMAT_BINARY) ? writeAuditBlocks(logger, batch, length) : write(logger->fd, batch, length);
+	if (written > 0)
+	{
+		logger->segmentBytes += written;
+		logger->unsynced = 1;
+	}
+
+	pthread_mutex_unlock(&logger->fileLock);
+}
+
+/* =================================================
+ * This function gzips every rotated segment that is
+ * not compressed yet, oldest first, one gzip process
+ * at a time.  gzip inherits the idle priorities of
+ * the compressor thread.  If the logger is closed
+ * meanwhile, gzip is left to finish on its own.
+ *
+ * @param: Logger*
+ * @return: void
+ * ============================================== */
+
+static void compressLogSegments(Logger* logger)
+{
+	char path[sizeof(logger->path)];
+	char segment[sizeof(logger->path) + 32];
+
+	pthread_mutex_lock(&logger->fileLock);
+	strCopy(path, logger->path);
+	unsigned long oldest = logger->oldestSegment;
+	unsigned long newest = logger->newestSegment;
+	int compress = logger->compress;
+	pthread_mutex_unlock(&logger->fileLock);
+
+	// gzip gets a clear signal mask, the one of the programs blocks SIGTERM and SIGINT for their signalfd
+	sigset_t noSignals;
+	sigemptyset(&noSignals);
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	posix_spawnattr_setsigmask(&attributes, &noSignals);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+	for (unsigned long number = oldest; compress && number <= newest && atomic_load(&logger->running); ++number)
+	{
+		snprintf(segment, sizeof(segment), "%s.%lu", path, number);
+		if (access(segment, F_OK) != 0)
+		{
+			continue;		// already compressed, or deleted
+		}
+
+		char* arguments[] = { "gzip", "-f", "-q", segment, NULL };
+		pid_t pid;
+		if (posix_spawnp(&pid, "gzip", NULL, &attributes, arguments, environ) != 0)
+		{
+			PRINT_MSG(logger, "gzip could not be started, the rotated log segments are left uncompressed\n\n");
+			break;
+		}
+
+		int status = 0;
+		pid_t done;
+		while ((done = waitpid(pid, &status, WNOHANG)) == 0 && atomic_load(&logger->running))
+		{
+			usleep(100000);
+		}
+		if (done == pid && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+		{
+			char message[LOG_MESSAGE_LENGTH];
+			snprintf(message, sizeof(message), "The log segment %.200s could not be compressed\n\n", segment);
+			PRINT_MSG(logger, message);
+		}
+	}
+
+	posix_spawnattr_destroy(&attributes);
+}
+
+/* =================================================
+ * This function is the body of the compressor
+ * thread.  It only runs when nothing else wants the
+ * CPU (SCHED_IDLE) or the SD card (idle I/O class),
+ * and sleeps until a segment is rotated.
+ *
+ * @param: void*, the Logger
+ * @return: void*
+ * ============================================== */
+
+static void* compressorThread(void* argument)
+{
+	Logger* logger = (Logger*) argument;
+	struct pollfd wake = { logger->compressFd, POLLIN, 0 };
+	uint64_t wakeups;
+
+	struct sched_param parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+	while (atomic_load_explicit(&logger->running, memory_order_acquire))
+	{
+		if (poll(&wake, 1, -1) > 0)
+		{
+			read(logger->compressFd, &wakeups, sizeof(wakeups));
+		}
+		compressLogSegments(logger);
+	}
+	return NULL;
+}
+
+/* =================================================
+ * This function appends one formatted log line to
+ * the batch buffer, writing the buffer out first if
+ * the line might not fit.
+ *
+ * @param: Logger*, char* batch, size_t* length, struct timespec*, char* message
+ * @return: void
+ * ============================================== */
+
+static void appendLogLine(Logger* logger, char* batch, size_t* length, const struct timespec* time, const char* message)
+{
+	char timeString[30];
+
+	if (*length + LOG_MESSAGE_LENGTH + 128 > LOG_BATCH_SIZE)
+	{
+		writeLogBatch(logger, batch, *length);
+		*length = 0;
+	}
+
+	if (logger->format == LOG_FORMAT_BINARY)
+	{
+		appendAuditRecords(logger, batch, length, time, message);
+		return;
+	}
+
+	formatTime(time, timeString);
+	int printed = snprintf(batch + *length, LOG_BATCH_SIZE - *length, "%s : %s : %s", timeString, logger->programName, message);
+	if (printed > 0)
+	{
+		*length += ((size_t) printed < LOG_BATCH_SIZE - *length) ? (size_t) printed : LOG_BATCH_SIZE - *length - 1;
+	}
+}
+
+/* =================================================
+ * This function returns the number of milliseconds
+ * between two points in time.
+ *
+ * @param: struct timespec* start, struct timespec* end
+ * @return: long, milliseconds from start to end
+ * ============================================== */
+
+static long millisecondsBetween(const struct timespec* start, const struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000L + (end->tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+/* =================================================
+ * This function folds a message queued with the
+ * LOG_COALESCE flag into its summary slot.  The
+ * first occurrence of a message is written right
+ * away, later identical messages are only counted
+ * until summarizeLogger() reports them.  If every
+ * slot is taken, the message is written as is.
+ *
+ * @param: Logger*, char* batch, size_t* length, LogEntry*
+ * @return: void
+ * ============================================== */
+
+static void coalesceLogEntry(Logger* logger, char* batch, size_t* length, const LogEntry* entry)
+{
+	LogSummary* freeSlot = NULL;
+
+	for (int i = 0; i < LOG_COALESCE_SLOTS; ++i)
+	{
+		LogSummary* summary = &logger->summaries[i];
+		if (!summary->active)
+		{
+			if (freeSlot == NULL)
+			{
+				freeSlot = summary;
+			}
+		}
+		else if (strCompare(summary->message, entry->message))
+		{
+			long gap = millisecondsBetween(&summary->last, &entry->time);
+			if (gap > summary->maxGap)
+			{
+				summary->maxGap = gap;
+			}
+			summary->last = entry->time;
+			summary->count++;
+			return;
+		}
+	}
+
+	appendLogLine(logger, batch, length, &entry->time, entry->message);
+
+	if (freeSlot != NULL)
+	{
+		strCopy(freeSlot->message, entry->message);
+		freeSlot->active = 1;
+		freeSlot->count = 0;
+		freeSlot->maxGap = 0;
+		freeSlot->windowStart = entry->time;
+		freeSlot->last = entry->time;
+	}
+}
+
+/* =================================================
+ * This function writes one summary line for every
+ * coalesced message whose interval has passed, e.g.
+ * "The Watchdog was updated (x2000 in 10 s, max gap
+ * 6 ms)".  A message that was not repeated during
+ * its interval gives up its slot, so its next
+ * occurrence is written right away again.  If force
+ * is set, every pending summary is written.
+ *
+ * @param: Logger*, char* batch, size_t* length, int force
+ * @return: void
+ * ============================================== */
+
+static void summarizeLogger(Logger* logger, char* batch, size_t* length, int force)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	for (int i = 0; i < LOG_COALESCE_SLOTS; ++i)
+	{
+		LogSummary* summary = &logger->summaries[i];
+		long elapsed = millisecondsBetween(&summary->windowStart, &now);
+
+		if (!summary->active || (!force && elapsed < atomic_load_explicit(&logger->summaryInterval, memory_order_relaxed) * 1000L))
+		{
+			continue;
+		}
+
+		if (summary->count == 0)
+		{
+			summary->active = 0;
+			continue;
+		}
+
+		// Print the message without its trailing new lines, followed by the counters
+		int messageLength = findLength(summary->message);
+		int newLines = 0;
+		while (messageLength > 0 && summary->message[messageLength - 1] == '\n')
+		{
+			--messageLength;
+			++newLines;
+		}
+
+		char line[LOG_MESSAGE_LENGTH + 96];
+		snprintf(line, sizeof(line), "%.*s (x%lu in %ld s, max gap %ld ms)%s", messageLength, summary->message,
+			summary->count, (elapsed + 500) / 1000, summary->maxGap, (newLines > 1) ? "\n\n" : "\n");
+		appendLogLine(logger, batch, length, &now, line);
+
+		summary->count = 0;
+		summary->maxGap = 0;
+		summary->windowStart = now;
+	}
+}
+
+/* =================================================
+ * This function formats every message currently in
+ * the ring into a batch buffer and writes it to the
+ * log file with as few write() calls as possible.
+ * Messages queued with LOG_COALESCE are folded into
+ * periodic summaries instead.  Only the writer
+ * thread calls this function.
+ *
+ * @param: Logger*, int force (write every pending summary)
+ * @return: number of messages written
+ * ============================================== */
+
+static size_t drainLogger(Logger* logger, int force)
+{
+	char batch[LOG_BATCH_SIZE];
+	size_t length = 0;
+	size_t count = 0;
+	size_t tail = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+
+	while (1)
+	{
+		LogEntry* entry = &logger->entries[tail & (LOG_RING_SIZE - 1)];
+
+		// The slot is ready once the producer has published it with sequence tail + 1
+		if (atomic_load_explicit(&entry->sequence, memory_order_acquire) != tail + 1)
+		{
+			break;
+		}
+
+		if (entry->flags & LOG_COALESCE)
+		{
+			coalesceLogEntry(logger, batch, &length, entry);
+		}
+		else
+		{
+			appendLogLine(logger, batch, &length, &entry->time, entry->message);
+		}
+
+		// Hand the slot back to the producers for the next lap around the ring
+		atomic_store_explicit(&entry->sequence, tail + LOG_RING_SIZE, memory_order_release);
+		++tail;
+		++count;
+	}
+
+	atomic_store_explicit(&logger->tail, tail, memory_order_relaxed);
+
+	summarizeLogger(logger, batch, &length, force);
+
+	size_t dropped = atomic_exchange_explicit(&logger->dropped, 0, memory_order_relaxed);
+	if (dropped > 0)
+	{
+		char line[96];
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		snprintf(line, sizeof(line), "%zu log messages were dropped, the log ring was full\n", dropped);
+		appendLogLine(logger, batch, &length, &now, line);
+	}
+
+	if (length > 0)
+	{
+		writeLogBatch(logger, batch, length);
+	}
+
+	// Group commit: everything written by this pass of the binary log is made durable by a single fdatasync()
+	if (logger->format == LOG_FORMAT_BINARY && logger->unsynced)
+	{
+		fdatasync(logger->fd);
+		logger->unsynced = 0;
+	}
+
+	atomic_store_explicit(&logger->written, tail, memory_order_release);
+	return count;
+}
+
+/* =================================================
+ * This function is the body of the writer thread.
+ * It sleeps until either the flush interval passes
+ * or a producer wakes it up, then writes out every
+ * queued message.  When the logger is closed it
+ * drains the ring one last time and syncs the file.
+ *
+ * @param: void*, the Logger
+ * @return: void*
+ * ============================================== */
+
+static void* loggerThread(void* argument)
+{
+	Logger* logger = (Logger*) argument;
+	struct pollfd wake = { logger->wakeFd, POLLIN, 0 };
+	uint64_t wakeups;
+
+	while (atomic_load_explicit(&logger->running, memory_order_acquire))
+	{
+		if (poll(&wake, 1, atomic_load_explicit(&logger->flushInterval, memory_order_relaxed)) > 0)
+		{
+			read(logger->wakeFd, &wakeups, sizeof(wakeups));
+		}
+		drainLogger(logger, 0);
+		REPORT_HEARTBEAT(logger->heartbeat);
+	}
+
+	drainLogger(logger, 1);
+	fsync(logger->fd);
+	return NULL;
+}
+
+/* =================================================
+ * This function opens the log file once, in append
+ * mode, and starts the writer thread.  The created
+ * field of the logger is set if the log file did
+ * not exist yet.
+ *
+ * @param:
+ * Logger*
+ * log file path (char*)
+ * program name (char*)
+ * flush interval (int) - milliseconds between writes to the log file
+ * summary interval (int) - seconds covered by each summary of a repeated message
+ * format (int) - LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+ *
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initLogger(Logger* logger, const char* logFilePath, const char* programName, int flushInterval, int summaryInterval, int format)
+{
+	if (logger == NULL || logFilePath == NULL || programName == NULL)
+	{
+		return -1;
+	}
+
+	logger->created = (access(logFilePath, F_OK) != 0);
+	logger->fd = open(logFilePath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (logger->fd < 0)
+	{
+		return -1;
+	}
+
+	logger->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	logger->compressFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (logger->wakeFd < 0 || logger->compressFd < 0)
+	{
+		close(logger->wakeFd);
+		close(logger->compressFd);
+		close(logger->fd);
+		return -1;
+	}
+
+	// Rotation stays off until setLogRotation() is called
+	pthread_mutex_init(&logger->fileLock, NULL);
+	strncpy(logger->path, logFilePath, sizeof(logger->path) - 1);
+	logger->path[sizeof(logger->path) - 1] = 0;
+	logger->segmentSize = 0;
+	logger->segmentCount = DEFAULT_LOG_SEGMENT_COUNT;
+	logger->compress = 0;
+	logger->rotations = 0;
+	logger->format = (format == LOG_FORMAT_BINARY) ? LOG_FORMAT_BINARY : LOG_FORMAT_TEXT;
+	logger->blockSequence = 0;
+	logger->blockStart = LOG_BATCH_SIZE;
+	logger->blockRecords = 0;
+	logger->unsynced = 0;
+	findLogSegments(logger->path, &logger->oldestSegment, &logger->newestSegment);
+	startLogSegment(logger);
+
+	strncpy(logger->programName, programName, sizeof(logger->programName) - 1);
+	logger->programName[sizeof(logger->programName) - 1] = 0;
+	atomic_init(&logger->flushInterval, (flushInterval > 0) ? flushInterval : DEFAULT_LOG_FLUSH_INTERVAL);
+	atomic_init(&logger->summaryInterval, (summaryInterval > 0) ? summaryInterval : DEFAULT_LOG_SUMMARY_INTERVAL);
+	memset(logger->summaries, 0, sizeof(logger->summaries));
+
+	for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+	{
+		atomic_init(&logger->entries[i].sequence, i);
+	}
+	atomic_init(&logger->head, 0);
+	atomic_init(&logger->tail, 0);
+	atomic_init(&logger->written, 0);
+	atomic_init(&logger->dropped, 0);
+	atomic_init(&logger->running, 1);
+	atomic_init(&logger->heartbeat, 0);
+
+	if (pthread_create(&logger->writer, NULL, loggerThread, logger) != 0)
+	{
+		close(logger->wakeFd);
+		close(logger->compressFd);
+		close(logger->fd);
+		return -1;
+	}
+	if (pthread_create(&logger->compressor, NULL, compressorThread, logger) != 0)
+	{
+		close(logger->compressFd);
+		logger->compressFd = -1;		// the rotated segments are then kept uncompressed
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function queues a message on the logger.  It
+ * never blocks and never makes a system call unless
+ * the ring is more than half full, in which case the
+ * writer thread is woken up early.  If the ring is
+ * full the message is dropped and counted instead.
+ * Any thread may call this function.
+ *
+ * @param: Logger*, char* message
+ * @return: void
+ * ============================================== */
+
+void logMessage(Logger* logger, const char* message)
+{
+	logMessageFlags(logger, message, 0);
+}
+
+/* =================================================
+ * This function queues a message on the logger with
+ * the given flags.  With LOG_COALESCE, repeats of
+ * the message are counted by the writer thread and
+ * reported as one summary line per interval rather
+ * than written one by one.
+ *
+ * @param: Logger*, char* message, int flags
+ * @return: void
+ * ============================================== */
+
+void logMessageFlags(Logger* logger, const char* message, int flags)
+{
+	if (logger == NULL || message == NULL)
+	{
+		return;
+	}
+
+	size_t position = atomic_load_explicit(&logger->head, memory_order_relaxed);
+	LogEntry* entry;
+
+	while (1)
+	{
+		entry = &logger->entries[position & (LOG_RING_SIZE - 1)];
+		size_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+		if (difference == 0)
+		{
+			// The slot is free, try to claim it
+			if (atomic_compare_exchange_weak_explicit(&logger->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (difference < 0)
+		{
+			// The writer has not caught up yet, the ring is full
+			atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+		{
+			position = atomic_load_explicit(&logger->head, memory_order_relaxed);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &entry->time);
+	entry->flags = flags;
+	strncpy(entry->message, message, LOG_MESSAGE_LENGTH - 1);
+	entry->message[LOG_MESSAGE_LENGTH - 1] = 0;
+	atomic_store_explicit(&entry->sequence, position + 1, memory_order_release);
+
+	if (position - atomic_load_explicit(&logger->tail, memory_order_relaxed) >= LOG_RING_SIZE / 2)
+	{
+		uint64_t wakeup = 1;
+		write(logger->wakeFd, &wakeup, sizeof(wakeup));
+	}
+}
+
+/* =================================================
+ * This function logs one stage of a traced command.
+ * Both clocks are written: CLOCK_MONOTONIC times
+ * the stages on one Pi, CLOCK_REALTIME (derived from
+ * the same instant) lines up the key and the lock,
+ * as far as their clocks agree.  Nothing is logged
+ * for a trace ID of 0.
+ *
+ * @param: Logger*, uint32_t trace ID, char* stage, uint64_t CLOCK_MONOTONIC of the stage (0 = now)
+ * @return: void
+ * ============================================== */
+
+void logTrace(Logger* logger, uint32_t traceId, const char* stage, uint64_t monotonicTime)
+{
+	if (traceId == 0)
+	{
+		return;		// the command is not traced (e.g. the one read from the communication file at start up)
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t monotonicNow = monotonicNanoseconds();
+
+	if (monotonicTime == 0 || monotonicTime > monotonicNow)
+	{
+		monotonicTime = monotonicNow;
+	}
+	uint64_t realTime = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec - (monotonicNow - monotonicTime);
+
+	char message[LOG_MESSAGE_LENGTH];
+	snprintf(message, sizeof(message), "TRACE %08x %s %llu %llu\n", traceId, stage, (unsigned long long) realTime, (unsigned long long) monotonicTime);
+	logMessage(logger, message);
+}
+
+/* =================================================
+ * This function wakes the writer thread and waits
+ * (at most one second) until every message queued
+ * before the call has been written to the log file.
+ * It is used before the program exits on an error.
+ *
+ * @param: Logger*
+ * @return: 0 = successful execution, -1 = error or timed out
+ * ============================================== */
+
+int flushLogger(Logger* logger)
+{
+	if (logger == NULL || logger->fd < 0)
+	{
+		return -1;
+	}
+
+	size_t target = atomic_load_explicit(&logger->head, memory_order_acquire);
+	uint64_t wakeup = 1;
+	write(logger->wakeFd, &wakeup, sizeof(wakeup));
+
+	for (int waited = 0; waited < 1000; ++waited)
+	{
+		if (atomic_load_explicit(&logger->written, memory_order_acquire) >= target)
+		{
+			return 0;
+		}
+		usleep(1000);
+	}
+	return -1;
+}
+
+/* =================================================
+ * This function moves the logger to another log
+ * file, and changes its flush and summary intervals,
+ * without stopping the writer thread.  The queued
+ * messages are flushed to the current file first.
+ * The new file is then put in place with dup2(), so
+ * the writer thread, which may be writing at that
+ * very moment, always has an open file to write to.
+ * If the new file cannot be opened, the logger keeps
+ * the current one.
+ *
+ * @param: Logger*, char* log file path, int flush interval (ms), int summary interval (s)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int reopenLogger(Logger* logger, const char* logFilePath, int flushInterval, int summaryInterval)
+{
+	if (logger == NULL || logger->fd < 0)
+	{
+		return -1;
+	}
+
+	// The writer thread reads the intervals without taking fileLock
+	atomic_store_explicit(&logger->flushInterval, (flushInterval > 0) ? flushInterval : DEFAULT_LOG_FLUSH_INTERVAL, memory_order_relaxed);
+	atomic_store_explicit(&logger->summaryInterval, (summaryInterval > 0) ? summaryInterval : DEFAULT_LOG_SUMMARY_INTERVAL, memory_order_relaxed);
+
+	int fd = open(logFilePath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	flushLogger(logger);
+	fsync(logger->fd);
+
+	// The writer thread may be about to rotate the current file, so the file is swapped with fileLock held
+	pthread_mutex_lock(&logger->fileLock);
+	if (dup2(fd, logger->fd) < 0)
+	{
+		pthread_mutex_unlock(&logger->fileLock);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	strncpy(logger->path, logFilePath, sizeof(logger->path) - 1);
+	logger->path[sizeof(logger->path) - 1] = 0;
+	logger->blockSequence = 0;
+	findLogSegments(logger->path, &logger->oldestSegment, &logger->newestSegment);
+	startLogSegment(logger);
+	pthread_mutex_unlock(&logger->fileLock);
+	return 0;
+}
+
+/* =================================================
+ * This function sets how the log file is rotated.
+ * The active segment is preallocated right away and
+ * rotated by the writer thread once the next batch
+ * would take it past segmentSize kilobytes.  Only
+ * the segmentCount newest rotated segments are kept
+ * and, if compress is set, the compressor thread
+ * gzips them, starting with any segment an earlier
+ * run left uncompressed.  It may be called again
+ * (e.g. on a reload) while the logger is running.
+ *
+ * @param: Logger*, int segment size (kilobytes, 0 = never rotate), int segment count, int compress (0 or 1)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int setLogRotation(Logger* logger, int segmentSize, int segmentCount, int compress)
+{
+	if (logger == NULL || logger->fd < 0 || segmentSize < 0 || segmentCount < 0)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&logger->fileLock);
+	logger->segmentSize = (off_t) segmentSize * 1024;
+	logger->segmentCount = segmentCount;
+	logger->compress = (compress != 0 && logger->compressFd >= 0);
+	startLogSegment(logger);
+	pruneLogSegments(logger);
+	pthread_mutex_unlock(&logger->fileLock);
+
+	if (logger->compress)
+	{
+		uint64_t wakeup = 1;
+		write(logger->compressFd, &wakeup, sizeof(wakeup));
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function stops the writer thread after it has
+ * written every queued message, then closes the log
+ * file.
+ *
+ * @param: Logger*
+ * @return: void
+ * ============================================== */
+
+void closeLogger(Logger* logger)
+{
+	if (logger == NULL || logger->fd < 0)
+	{
+		return;
+	}
+
+	atomic_store_explicit(&logger->running, 0, memory_order_release);
+	uint64_t wakeup = 1;
+	write(logger->wakeFd, &wakeup, sizeof(wakeup));
+	pthread_join(logger->writer, NULL);
+
+	if (logger->compressFd >= 0)
+	{
+		write(logger->compressFd, &wakeup, sizeof(wakeup));
+		pthread_join(logger->compressor, NULL);
+		close(logger->compressFd);
+	}
+	pthread_mutex_destroy(&logger->fileLock);
+
+	close(logger->wakeFd);
+	close(logger->fd);
+	logger->fd = -1;
+}
+
+
+/* ======================================
+ * Command transports
+ * ===================================== */
+
+/* =================================================
+ * This function maps the shared memory record used
+ * by the "shm" transport, creating and initializing
+ * it if it does not exist yet.  The file should live
+ * on a tmpfs (e.g. /dev/shm) or DAX mount that both
+ * the key and the lock can see.  Anyone who can write
+ * the record can unlock the door, so it is only
+ * readable and writable by its owner: a record that
+ * is open to others and cannot be closed off (e.g.
+ * one planted in /dev/shm by another user) is not
+ * used.
+ *
+ * @param: char* path, int initial command
+ * @return: CommRecord*, NULL = error
+ * ============================================== */
+
+static CommRecord* mapCommRecord(const char* path, int initialCommand)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) != 0 || status.st_uid != geteuid() ||
+		((status.st_mode & (S_IRWXG | S_IRWXO)) != 0 && fchmod(fd, S_IRUSR | S_IWUSR) != 0) ||
+		(status.st_size < (off_t) sizeof(CommRecord) && ftruncate(fd, sizeof(CommRecord)) != 0))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	CommRecord* record = mmap(NULL, sizeof(CommRecord), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (record == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// A freshly created file is all zeros, so the magic number tells if the record was set up yet
+	uint32_t expected = 0;
+	if (atomic_compare_exchange_strong(&record->magic, &expected, COMM_SHM_INITIALIZING))
+	{
+		atomic_store_explicit(&record->command, initialCommand, memory_order_relaxed);
+		atomic_store_explicit(&record->writeTime, 0, memory_order_relaxed);
+		atomic_store_explicit(&record->sequence, 2, memory_order_relaxed);
+		atomic_store_explicit(&record->magic, COMM_SHM_MAGIC, memory_order_release);
+	}
+	else
+	{
+		while (atomic_load_explicit(&record->magic, memory_order_acquire) == COMM_SHM_INITIALIZING)
+		{
+			usleep(1000);
+		}
+	}
+
+	return record;
+}
+
+/* =================================================
+ * This function reads the shared memory record
+ * without taking a lock.  The sequence number is odd
+ * while a writer is updating the record, so the read
+ * is retried until it sees the same even sequence
+ * number before and after copying the fields.
+ *
+ * @param: CommRecord*, int* command, uint64_t* write time, uint32_t* trace ID, uint32_t* sequence
+ * @return: void
+ * ============================================== */
+
+static void readCommRecord(CommRecord* record, int* command, uint64_t* writeTime, uint32_t* traceId, uint32_t* sequence)
+{
+	uint32_t before, after;
+
+	do
+	{
+		before = atomic_load_explicit(&record->sequence, memory_order_acquire);
+		*command = atomic_load_explicit(&record->command, memory_order_relaxed);
+		*writeTime = atomic_load_explicit(&record->writeTime, memory_order_relaxed);
+		*traceId = atomic_load_explicit(&record->traceId, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	*sequence = before;
+}
+
+/* =================================================
+ * This function updates the shared memory record.
+ * Both the key and the lock may write it, so the
+ * writer first claims the record by moving the
+ * sequence number from even to odd.
+ *
+ * @param: CommRecord*, int command, uint32_t trace ID
+ * @return: void
+ * ============================================== */
+
+static void writeCommRecord(CommRecord* record, int command, uint32_t traceId)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	uint32_t sequence = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+	while ((sequence & 1) || !atomic_compare_exchange_weak_explicit(&record->sequence, &sequence, sequence + 1, memory_order_acquire, memory_order_relaxed))
+	{
+		sequence = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&record->command, command, memory_order_relaxed);
+	atomic_store_explicit(&record->writeTime, (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec, memory_order_relaxed);
+	atomic_store_explicit(&record->traceId, traceId, memory_order_relaxed);
+
+	atomic_store_explicit(&record->sequence, sequence + 2, memory_order_release);
+}
+
+/* =================================================
+ * This function returns the current CLOCK_MONOTONIC
+ * time in nanoseconds.
+ *
+ * @param: void
+ * @return: uint64_t, nanoseconds
+ * ============================================== */
+
+uint64_t monotonicNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// SHA-256 (FIPS 180-4), only used for the HMAC of the command packets
+typedef struct Sha256
+{
+	uint32_t state[8];
+	uint64_t length;				// Bytes hashed so far
+	unsigned char block[64];
+	size_t used;					// Bytes waiting in block
+} Sha256;
+
+static const uint32_t sha256Constants[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTATE_RIGHT(_x, _n) (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+static void sha256Block(uint32_t state[8], const unsigned char block[64])
+{
+	uint32_t w[64];
+	uint32_t v[8];
+
+	for (int i = 0; i < 16; ++i)
+	{
+		w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) | ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = ROTATE_RIGHT(w[i - 15], 7) ^ ROTATE_RIGHT(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTATE_RIGHT(w[i - 2], 17) ^ ROTATE_RIGHT(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v, state, sizeof(v));
+	for (int i = 0; i < 64; ++i)
+	{
+		uint32_t s1 = ROTATE_RIGHT(v[4], 6) ^ ROTATE_RIGHT(v[4], 11) ^ ROTATE_RIGHT(v[4], 25);
+		uint32_t choose = (v[4] & v[5]) ^ (~v[4] & v[6]);
+		uint32_t t1 = v[7] + s1 + choose + sha256Constants[i] + w[i];
+		uint32_t s0 = ROTATE_RIGHT(v[0], 2) ^ ROTATE_RIGHT(v[0], 13) ^ ROTATE_RIGHT(v[0], 22);
+		uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+		memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + s0 + majority;
+	}
+	for (int i = 0; i < 8; ++i)
+	{
+		state[i] += v[i];
+	}
+}
+
+static void sha256Init(Sha256* hash)
+{
+	static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(hash->state, initial, sizeof(initial));
+	hash->length = 0;
+	hash->used = 0;
+}
+
+static void sha256Update(Sha256* hash, const void* data, size_t length)
+{
+	const unsigned char* bytes = data;
+	hash->length += length;
+
+	while (length > 0)
+	{
+		size_t part = (length < 64 - hash->used) ? length : 64 - hash->used;
+		memcpy(hash->block + hash->used, bytes, part);
+		hash->used += part;
+		bytes += part;
+		length -= part;
+
+		if (hash->used == 64)
+		{
+			sha256Block(hash->state, hash->block);
+			hash->used = 0;
+		}
+	}
+}
+
+static void sha256Final(Sha256* hash, unsigned char digest[32])
+{
+	uint64_t bits = hash->length * 8;
+	unsigned char padding[72] = { 0x80 };
+	size_t paddingLength = (hash->used < 56) ? 56 - hash->used : 120 - hash->used;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		padding[paddingLength + i] = (unsigned char) (bits >> (56 - i * 8));
+	}
+	sha256Update(hash, padding, paddingLength + 8);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		digest[i * 4] = (unsigned char) (hash->state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char) (hash->state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char) (hash->state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char) hash->state[i];
+	}
+}
+
+/* =================================================
+ * This function computes the HMAC-SHA256 (RFC 2104)
+ * of a block of data.
+ *
+ * @param: void* key, size_t key length, void* data, size_t length, unsigned char mac[32]
+ * @return: void
+ * ============================================== */
+
+static void hmacSha256(const void* key, size_t keyLength, const void* data, size_t length, unsigned char mac[32])
+{
+	unsigned char pad[64];
+	unsigned char inner[32];
+	Sha256 hash;
+
+	memset(pad, 0, sizeof(pad));
+	if (keyLength > sizeof(pad))
+	{
+		sha256Init(&hash);
+		sha256Update(&hash, key, keyLength);
+		sha256Final(&hash, pad);
+	}
+	else
+	{
+		memcpy(pad, key, keyLength);
+	}
+
+	for (int i = 0; i < 64; ++i)
+	{
+		pad[i] ^= 0x36;
+	}
+	sha256Init(&hash);
+	sha256Update(&hash, pad, sizeof(pad));
+	sha256Update(&hash, data, length);
+	sha256Final(&hash, inner);
+
+	for (int i = 0; i < 64; ++i)
+	{
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256Init(&hash);
+	sha256Update(&hash, pad, sizeof(pad));
+	sha256Update(&hash, inner, sizeof(inner));
+	sha256Final(&hash, mac);
+}
+
+/* =================================================
+ * This function fills in a packet of the command
+ * protocol in network byte order, and signs it with
+ * the secret of the transport.
+ *
+ * @param: CommTransport*, CommPacket*, int type, int command, int lock state, uint32_t session, uint32_t sequence, uint64_t send time, uint32_t trace ID
+ * @return: void
+ * ============================================== */
+
+static void buildCommPacket(const CommTransport* transport, CommPacket* packet, int type, int command, int lockState, uint32_t session, uint32_t sequence, uint64_t sendTime, uint32_t traceId)
+{
+	unsigned char mac[32];
+
+	memset(packet, 0, sizeof(CommPacket));
+	packet->magic = htons(COMM_PACKET_MAGIC);
+	packet->type = (uint8_t) type;
+	packet->command = (uint8_t) command;
+	packet->lockState = (uint8_t) lockState;
+	packet->session = htonl(session);
+	packet->sequence = htonl(sequence);
+	packet->sendTime = htobe64(sendTime);
+	packet->traceId = htonl(traceId);
+
+	hmacSha256(transport->secret, strlen(transport->secret), packet, offsetof(CommPacket, mac), mac);
+	memcpy(packet->mac, mac, COMM_MAC_LENGTH);
+}
+
+/* =================================================
+ * This function checks the magic number and the
+ * HMAC of a packet and converts its fields to host
+ * byte order.  Without a secret no packet is valid,
+ * so a transport that has no COMM_SECRET cannot be
+ * given commands over the network.
+ *
+ * @param: CommTransport*, CommPacket*, ssize_t length received
+ * @return: 1 = valid packet, 0 = invalid
+ * ============================================== */
+
+static int parseCommPacket(CommTransport* transport, CommPacket* packet, ssize_t length)
+{
+	if (length != (ssize_t) sizeof(CommPacket) || ntohs(packet->magic) != COMM_PACKET_MAGIC)
+	{
+		return 0;
+	}
+
+	// The whole MAC is always compared, so the time taken does not tell how much of it was right
+	unsigned char mac[32];
+	unsigned char difference = 0;
+	hmacSha256(transport->secret, strlen(transport->secret), packet, offsetof(CommPacket, mac), mac);
+	for (int i = 0; i < COMM_MAC_LENGTH; ++i)
+	{
+		difference |= mac[i] ^ packet->mac[i];
+	}
+	if (difference != 0 || transport->secret[0] == 0)
+	{
+		transport->refused++;
+		return 0;
+	}
+
+	packet->session = ntohl(packet->session);
+	packet->sequence = ntohl(packet->sequence);
+	packet->sendTime = be64toh(packet->sendTime);
+	packet->traceId = ntohl(packet->traceId);
+	return (packet->command == 0 || packet->command == 1);
+}
+
+/* =================================================
+ * This function sets up the sockets of the "udp"
+ * transport.  The lock binds a UDP socket and a TCP
+ * listening socket (the TCP fallback) to COMM_PORT
+ * on COMM_BIND_ADDRESS.
+ * The key resolves the address of the lock, given as
+ * "host" or "host:port" (COMM_PORT is used if the
+ * port is left out), and uses an unbound UDP socket
+ * to reach it.
+ *
+ * @param: CommTransport*, LockConfig*, char* address of the lock (key only)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int openNetworkTransport(CommTransport* transport, const LockConfig* settings, const char* lockAddress)
+{
+	transport->socketFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (transport->socketFd < 0)
+	{
+		return -1;
+	}
+
+	if (transport->role == COMM_ROLE_LOCK)
+	{
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons((uint16_t) settings->commPort);
+
+		int reuse = 1;
+		transport->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (transport->listenFd < 0 || inet_pton(AF_INET, settings->commBindAddress, &address.sin_addr) != 1 ||
+			setsockopt(transport->listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+			bind(transport->socketFd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+			bind(transport->listenFd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+			listen(transport->listenFd, 4) != 0)
+		{
+			return -1;
+		}
+		return 0;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo* result;
+	char host[LOCK_ADDRESS_LENGTH];
+	char port[16];
+
+	strncpy(host, lockAddress, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	char* colon = strrchr(host, ':');
+	if (colon != NULL)
+	{
+		*colon = 0;
+		strncpy(port, colon + 1, sizeof(port) - 1);
+		port[sizeof(port) - 1] = 0;
+	}
+	else
+	{
+		snprintf(port, sizeof(port), "%d", settings->commPort);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+	{
+		return -1;
+	}
+	memcpy(&transport->peer, result->ai_addr, result->ai_addrlen);
+	transport->peerLength = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	// Start each run of the key with a new session so the lock does not mistake its sequence numbers for old ones
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	transport->session = (uint32_t) (now.tv_sec ^ (now.tv_nsec << 8) ^ getpid());
+	return 0;
+}
+
+/* =================================================
+ * This function sends the pending command of the
+ * key to the lock over UDP and arms the deadline for
+ * its retransmission.
+ *
+ * @param: CommTransport*
+ * @return: void
+ * ============================================== */
+
+static void sendPendingCommand(CommTransport* transport)
+{
+	CommPacket packet;
+	buildCommPacket(transport, &packet, COMM_PACKET_COMMAND, transport->command, COMM_STATE_UNKNOWN, transport->session, transport->sequence, transport->sendTime, transport->traceId);
+	sendto(transport->socketFd, &packet, sizeof(packet), 0, (struct sockaddr*) &transport->peer, transport->peerLength);
+
+	transport->deadline = monotonicNanoseconds() + (uint64_t) transport->retransmitTimeout * 1000000ULL;
+}
+
+/* =================================================
+ * This function closes a TCP fallback connection,
+ * removing it from the event loop of the lock or
+ * the epoll instance of the key first.
+ *
+ * @param: CommTransport*, CommConnection*
+ * @return: void
+ * ============================================== */
+
+static void closeCommConnection(CommTransport* transport, CommConnection* connection)
+{
+	if (connection->fd < 0)
+	{
+		return;
+	}
+
+	if (transport->loop != NULL)
+	{
+		removeEventSource(transport->loop, connection->fd);
+	}
+	if (transport->epollFd >= 0)
+	{
+		epoll_ctl(transport->epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+	}
+	close(connection->fd);
+	connection->fd = -1;
+}
+
+/* =================================================
+ * This function starts connecting to the lock over
+ * TCP once every UDP retransmission of the pending
+ * command has been lost.  The connection is made
+ * without blocking: it is added to the epoll
+ * instance of the key, and pollTcpFallback() carries
+ * it on as the socket becomes ready.
+ *
+ * @param: CommTransport*
+ * @return: 0 = connecting, -1 = error
+ * ============================================== */
+
+static int startTcpFallback(CommTransport* transport)
+{
+	CommConnection* connection = &transport->connections[0];
+
+	connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (connection->fd < 0)
+	{
+		return -1;
+	}
+	connection->sent = 0;
+	connection->received = 0;
+	connection->deadline = monotonicNanoseconds() + COMM_TCP_TIMEOUT_MS * 1000000ULL;
+
+	if (connect(connection->fd, (struct sockaddr*) &transport->peer, transport->peerLength) != 0 && errno != EINPROGRESS)
+	{
+		closeCommConnection(transport, connection);
+		return -1;
+	}
+
+	if (transport->epollFd >= 0)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLOUT;
+		event.data.ptr = transport->epollData;
+		epoll_ctl(transport->epollFd, EPOLL_CTL_ADD, connection->fd, &event);
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function carries on the TCP fallback of the
+ * key without blocking: once the connection is made
+ * the command is sent, and the acknowledgement is
+ * read as it arrives.  The connection and the reply
+ * are both bounded by COMM_TCP_TIMEOUT_MS.
+ *
+ * @param: CommTransport*, CommPacket* reply
+ * @return: 1 = acknowledged, 0 = still waiting, -1 = error
+ * ============================================== */
+
+static int pollTcpFallback(CommTransport* transport, CommPacket* reply)
+{
+	CommConnection* connection = &transport->connections[0];
+	uint64_t now = monotonicNanoseconds();
+
+	if (!connection->sent)
+	{
+		struct pollfd ready = { connection->fd, POLLOUT, 0 };
+		int error = 0;
+		socklen_t errorLength = sizeof(error);
+
+		if (poll(&ready, 1, 0) != 1)
+		{
+			return (now >= connection->deadline) ? -1 : 0;	// still connecting
+		}
+
+		CommPacket packet;
+		buildCommPacket(transport, &packet, COMM_PACKET_COMMAND, transport->command, COMM_STATE_UNKNOWN, transport->session, transport->sequence, transport->sendTime, transport->traceId);
+		if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0 ||
+			send(connection->fd, &packet, sizeof(packet), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t) sizeof(packet))
+		{
+			return -1;
+		}
+		connection->sent = 1;
+		connection->deadline = now + COMM_TCP_TIMEOUT_MS * 1000000ULL;
+
+		if (transport->epollFd >= 0)
+		{
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.ptr = transport->epollData;
+			epoll_ctl(transport->epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+		}
+		return 0;
+	}
+
+	ssize_t length = recv(connection->fd, (char*) &connection->packet + connection->received, sizeof(CommPacket) - connection->received, MSG_DONTWAIT);
+	if (length > 0)
+	{
+		connection->received += length;
+	}
+	if (connection->received == sizeof(CommPacket))
+	{
+		memcpy(reply, &connection->packet, sizeof(CommPacket));
+		return parseCommPacket(transport, reply, sizeof(CommPacket)) ? 1 : -1;
+	}
+	if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || now >= connection->deadline)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function records an acknowledgement or state
+ * report received by the key.  The command of the
+ * transport follows the actual state of the lock,
+ * so a command given with the button on the lock is
+ * picked up by the key too.
+ *
+ * @param: CommTransport*, CommPacket*
+ * @return: 1 = the packet was for this key, 0 = ignored
+ * ============================================== */
+
+static int handleLockReply(CommTransport* transport, const CommPacket* packet)
+{
+	if (packet->type == COMM_PACKET_ACK)
+	{
+		if (!transport->pending || packet->session != transport->session || packet->sequence != transport->sequence)
+		{
+			return 0; // a late acknowledgement of a command that was already acknowledged
+		}
+		transport->pending = 0;
+		transport->ackLatency = monotonicNanoseconds() - transport->firstSendTime;
+	}
+	else if (packet->type != COMM_PACKET_STATE)
+	{
+		return 0;
+	}
+
+	transport->lockState = packet->lockState;
+	if (!transport->pending)
+	{
+		if (packet->lockState == COMM_STATE_LOCKED || packet->lockState == COMM_STATE_WAITING_TO_LOCK)
+		{
+			transport->command = 1;
+		}
+		else if (packet->lockState == COMM_STATE_UNLOCKED)
+		{
+			transport->command = 0;
+		}
+	}
+	return 1;
+}
+
+/* =================================================
+ * This function handles a command packet received by
+ * the lock and answers it with an acknowledgement
+ * that carries the actual state of the lock.  A
+ * retransmitted command is acknowledged again but
+ * only applied once.  A replayed packet is refused:
+ * the command must have been sent within
+ * COMM_REPLAY_WINDOW_MS and after the transport was
+ * opened, and a new session must have started after
+ * the last command applied.
+ *
+ * @param: CommTransport*, CommPacket*, int reply socket, struct sockaddr* (NULL for TCP), socklen_t
+ * @return: 1 = new command, 0 = duplicate or invalid
+ * ============================================== */
+
+static int handleKeyCommand(CommTransport* transport, const CommPacket* packet, int replyFd, const struct sockaddr* from, socklen_t fromLength)
+{
+	if (packet->type != COMM_PACKET_COMMAND)
+	{
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t realTime = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	uint64_t age = (realTime > packet->sendTime) ? realTime - packet->sendTime : packet->sendTime - realTime;
+	int sameSession = (packet->session == transport->session);
+
+	if (age > COMM_REPLAY_WINDOW_MS * 1000000ULL || packet->sendTime < transport->openTime ||
+		(!sameSession && packet->sendTime <= transport->sendTime))
+	{
+		transport->refused++;
+		return 0;
+	}
+
+	int isNew = (!sameSession || (int32_t) (packet->sequence - transport->sequence) > 0);
+	if (isNew)
+	{
+		transport->session = packet->session;
+		transport->sequence = packet->sequence;
+		transport->command = packet->command;
+		transport->sendTime = packet->sendTime;
+		transport->traceId = packet->traceId;
+	}
+
+	// Remember the key so that later state changes can be reported to it
+	if (from != NULL)
+	{
+		memcpy(&transport->peer, from, fromLength);
+		transport->peerLength = fromLength;
+	}
+
+	CommPacket ack;
+	buildCommPacket(transport, &ack, COMM_PACKET_ACK, packet->command, transport->lockState, packet->session, packet->sequence, packet->sendTime, packet->traceId);
+	if (from != NULL)
+	{
+		sendto(replyFd, &ack, sizeof(ack), 0, from, fromLength);
+	}
+	else
+	{
+		send(replyFd, &ack, sizeof(ack), MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+
+	return isNew;
+}
+
+/* =================================================
+ * This function accepts the connections queued on
+ * the TCP fallback socket of the lock, and reads the
+ * command of every open connection without blocking.
+ * The connections are added to the event loop so
+ * that it wakes up when they can be read, and the
+ * ones that are not done within COMM_TCP_TIMEOUT_MS
+ * are closed.
+ *
+ * @param: CommTransport*
+ * @return: 1 = new command, 0 = nothing new
+ * ============================================== */
+
+static int readTcpCommands(CommTransport* transport)
+{
+	uint64_t now = monotonicNanoseconds();
+	int wasOpen = 0;
+	int open = 0;
+	int isNew = 0;
+	int fd;
+
+	for (int i = 0; i < COMM_TCP_CONNECTIONS; ++i)
+	{
+		wasOpen += (transport->connections[i].fd >= 0);
+	}
+
+	while ((fd = accept4(transport->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		CommConnection* connection = NULL;
+		for (int i = 0; i < COMM_TCP_CONNECTIONS && connection == NULL; ++i)
+		{
+			if (transport->connections[i].fd < 0)
+			{
+				connection = &transport->connections[i];
+			}
+		}
+
+		// Once every slot is taken, new connections are turned away rather than queued
+		if (connection == NULL || (transport->loop != NULL && addEventSource(transport->loop, fd, NULL, NULL) != 0))
+		{
+			close(fd);
+			continue;
+		}
+		connection->fd = fd;
+		connection->received = 0;
+		connection->deadline = now + COMM_TCP_TIMEOUT_MS * 1000000ULL;
+	}
+
+	for (int i = 0; i < COMM_TCP_CONNECTIONS; ++i)
+	{
+		CommConnection* connection = &transport->connections[i];
+		if (connection->fd < 0)
+		{
+			continue;
+		}
+
+		ssize_t length = recv(connection->fd, (char*) &connection->packet + connection->received, sizeof(CommPacket) - connection->received, MSG_DONTWAIT);
+		if (length > 0)
+		{
+			connection->received += length;
+		}
+
+		if (connection->received == sizeof(CommPacket))
+		{
+			if (parseCommPacket(transport, &connection->packet, sizeof(CommPacket)))
+			{
+				isNew |= handleKeyCommand(transport, &connection->packet, connection->fd, NULL, 0);
+			}
+			closeCommConnection(transport, connection);
+		}
+		else if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || now >= connection->deadline)
+		{
+			closeCommConnection(transport, connection);
+		}
+		else
+		{
+			open++;
+		}
+	}
+
+	// The timer wakes the loop up to close the connections that never send their command
+	if (transport->loop != NULL && transport->connectionTimerFd >= 0 && (wasOpen > 0) != (open > 0))
+	{
+		setTimerSource(transport->loop, transport->connectionTimerFd, (open > 0) ? COMM_TCP_TIMEOUT_MS / 2 : 0);
+	}
+	return isNew;
+}
+
+/* =================================================
+ * This function does the network side of polling the
+ * "udp" transport.  The lock reads and acknowledges
+ * every queued command (UDP and TCP), and also checks
+ * the communication file, which is kept as a
+ * fallback.  The key reads acknowledgements and
+ * state reports, retransmits a command that has not
+ * been acknowledged in time with an exponential
+ * backoff, and once the retries are used up sends it
+ * over TCP and then through the communication file.
+ * Nothing here waits on a socket.
+ *
+ * @param: CommTransport*
+ * @return: 1 = new command or state, 0 = no change
+ * ============================================== */
+
+static int pollNetworkTransport(CommTransport* transport)
+{
+	CommPacket packet;
+	struct sockaddr_storage from;
+	socklen_t fromLength = sizeof(from);
+	ssize_t length;
+	int changed = 0;
+
+	while ((length = recvfrom(transport->socketFd, &packet, sizeof(packet), 0, (struct sockaddr*) &from, &fromLength)) >= 0)
+	{
+		if (parseCommPacket(transport, &packet, length))
+		{
+			if (transport->role == COMM_ROLE_LOCK)
+			{
+				changed |= handleKeyCommand(transport, &packet, transport->socketFd, (struct sockaddr*) &from, fromLength);
+			}
+			else
+			{
+				changed |= handleLockReply(transport, &packet);
+			}
+		}
+		fromLength = sizeof(from);
+	}
+
+	if (transport->role == COMM_ROLE_LOCK)
+	{
+		changed |= readTcpCommands(transport);
+
+		// Commands can still arrive through the communication file
+		if (commFileChanged(&transport->watcher) == 1)
+		{
+			int command = readCommunicationFile(transport->path, &transport->traceId);
+			if (command == 0 || command == 1)
+			{
+				transport->command = command;
+				changed = 1;
+			}
+		}
+
+		if (transport->localChange)
+		{
+			transport->localChange = 0;
+			changed = 1;
+		}
+		return changed;
+	}
+
+	// A late UDP acknowledgement makes the TCP fallback useless
+	if (!transport->pending && transport->connections[0].fd >= 0)
+	{
+		closeCommConnection(transport, &transport->connections[0]);
+	}
+
+	int fallback = 0;
+	if (transport->pending && transport->connections[0].fd >= 0)
+	{
+		int result = pollTcpFallback(transport, &packet);
+		if (result != 0)
+		{
+			closeCommConnection(transport, &transport->connections[0]);
+			if (result == 1 && handleLockReply(transport, &packet) && !transport->pending)
+			{
+				transport->fallback = COMM_FALLBACK_TCP;
+				changed = 1;
+			}
+			else
+			{
+				fallback = 1;
+			}
+		}
+	}
+	else if (transport->pending && monotonicNanoseconds() >= transport->deadline)
+	{
+		if (transport->retries < COMM_UDP_RETRIES)
+		{
+			transport->retries++;
+			transport->retransmitTimeout *= 2;
+			sendPendingCommand(transport);
+		}
+		else if (startTcpFallback(transport) != 0)
+		{
+			fallback = 1;
+		}
+	}
+
+	if (fallback)
+	{
+		transport->pending = 0;
+		transport->fallback = COMM_FALLBACK_FILE;
+		writeCommunicationFile(transport->path, transport->command, transport->traceId);
+		changed = 1;
+	}
+
+	return changed;
+}
+
+/* =================================================
+ * This function opens one transport.  It does the
+ * work of openCommTransport(), with the address of
+ * the lock given separately so that the key can open
+ * one transport for each lock of a fleet.
+ *
+ * @param: CommTransport*, LockConfig*, int role, char* address of the lock (udp key only)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int openTransport(CommTransport* transport, const LockConfig* settings, int role, const char* lockAddress)
+{
+	memset(transport, 0, sizeof(CommTransport));
+	transport->type = settings->commTransport;
+	transport->role = role;
+	transport->command = settings->lockState;
+	transport->lockState = COMM_STATE_UNKNOWN;
+	transport->record = NULL;
+	transport->watcher.fd = -1;
+	transport->socketFd = -1;
+	transport->listenFd = -1;
+	transport->pollTimerFd = -1;
+	transport->connectionTimerFd = -1;
+	transport->epollFd = -1;
+	transport->loop = NULL;
+	for (int i = 0; i < COMM_TCP_CONNECTIONS; ++i)
+	{
+		transport->connections[i].fd = -1;
+	}
+	strCopy(transport->secret, settings->commSecret);
+
+	if (transport->type == COMM_TRANSPORT_SHM)
+	{
+		strCopy(transport->path, settings->shmFilePath);
+		transport->record = mapCommRecord(transport->path, settings->lockState);
+		if (transport->record == NULL)
+		{
+			return -1;
+		}
+		readCommRecord(transport->record, &transport->command, &transport->writeTime, &transport->traceId, &transport->lastSequence);
+		return 0;
+	}
+
+	strCopy(transport->path, settings->commFilePath);
+	if (transport->type == COMM_TRANSPORT_UDP && openNetworkTransport(transport, settings, lockAddress) != 0)
+	{
+		closeCommTransport(transport);
+		return -1;
+	}
+
+	// The session of the last command applied is lost when the lock restarts, so a packet captured before it
+	// would pass as a new session for COMM_REPLAY_WINDOW_MS: only the commands sent from now on are accepted
+	if (transport->type == COMM_TRANSPORT_UDP && transport->role == COMM_ROLE_LOCK)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		transport->openTime = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+		transport->sendTime = transport->openTime;
+	}
+
+	// The key only writes the communication file as a last resort when the lock cannot be reached
+	if ((transport->type == COMM_TRANSPORT_FILE || transport->role == COMM_ROLE_LOCK) && initCommWatcher(&transport->watcher, transport->path) != 0)
+	{
+		closeCommTransport(transport);
+		return -1;
+	}
+
+	int command = readCommunicationFile(transport->path, &transport->traceId);
+	if (command == 0 || command == 1)
+	{
+		transport->command = command;
+	}
+
+	return 0;
+}
+
+/* =================================================
+ * This function opens the transport selected by the
+ * COMM_TRANSPORT parameter of the configuration.
+ * "file" uses the communication file and its watcher,
+ * "shm" uses a shared memory record and "udp" uses
+ * the command protocol over UDP (with TCP and the
+ * communication file as fallbacks).  Over udp, the
+ * key talks to the first LOCK_ADDRESS.  The current
+ * command is read once; if there is none yet, the
+ * default lock state from the configuration is used.
+ *
+ * @param: CommTransport*, LockConfig*, int role (COMM_ROLE_LOCK or COMM_ROLE_KEY)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int openCommTransport(CommTransport* transport, const LockConfig* settings, int role)
+{
+	if (transport == NULL || settings == NULL)
+	{
+		return -1;
+	}
+
+	return openTransport(transport, settings, role, (settings->lockCount > 0) ? settings->lockAddresses[0] : DEFAULT_LOCK_ADDRESS);
+}
+
+/* =================================================
+ * This function checks, without blocking, if a new
+ * command has arrived.  The shared memory transport
+ * only compares a sequence number, so it never makes
+ * a system call while nothing changes.  The file
+ * transport only opens the file once its watcher
+ * reports a change.  The udp transport reads the
+ * queued packets and handles retransmissions.  The
+ * latest command is stored in the command field of
+ * the transport.
+ *
+ * @param: CommTransport*
+ * @return: 1 = new command, 0 = no change, -1 = error
+ * ============================================== */
+
+int pollCommTransport(CommTransport* transport)
+{
+	if (transport == NULL)
+	{
+		return -1;
+	}
+
+	if (transport->type == COMM_TRANSPORT_SHM)
+	{
+		if (atomic_load_explicit(&transport->record->sequence, memory_order_acquire) == transport->lastSequence)
+		{
+			return 0;
+		}
+
+		int command;
+		readCommRecord(transport->record, &command, &transport->writeTime, &transport->traceId, &transport->lastSequence);
+		transport->command = command;
+		return 1;
+	}
+
+	if (transport->type == COMM_TRANSPORT_UDP)
+	{
+		return pollNetworkTransport(transport);
+	}
+
+	int changed = commFileChanged(&transport->watcher);
+	if (changed != 1)
+	{
+		return changed;
+	}
+
+	uint32_t traceId;
+	int command = readCommunicationFile(transport->path, &traceId);
+	if (command != 0 && command != 1)
+	{
+		return 0; // Ignore an empty file or a file that is still being written
+	}
+
+	transport->command = command;
+	transport->traceId = traceId;
+	return 1;
+}
+
+/* =================================================
+ * This function returns a new trace ID for a
+ * command.  The IDs of one run follow each other
+ * from a random start, spread out so that the IDs
+ * of two runs are unlikely to meet.  0 is never
+ * returned, it means "not traced".
+ *
+ * @param: void
+ * @return: uint32_t, trace ID
+ * ============================================== */
+
+uint32_t newTraceId(void)
+{
+	static _Atomic uint32_t counter = 0;
+	static uint32_t seed = 0;
+
+	if (seed == 0)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		seed = (uint32_t) (now.tv_sec ^ (now.tv_nsec << 8) ^ ((uint32_t) getpid() << 16)) | 1;
+	}
+
+	uint32_t traceId;
+	do
+	{
+		traceId = seed + atomic_fetch_add_explicit(&counter, 1, memory_order_relaxed) * 2654435761u;
+	} while (traceId == 0);
+
+	return traceId;
+}
+
+/* =================================================
+ * This function sends a command through the
+ * transport with a new trace ID.
+ *
+ * @param: CommTransport*, int command (1 = lock, 0 = unlock)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int writeCommTransport(CommTransport* transport, int command)
+{
+	return writeTracedCommand(transport, command, newTraceId());
+}
+
+/* =================================================
+ * This function sends a command through the
+ * transport, tagged with the trace ID given.  The
+ * command and trace ID fields of the transport are
+ * updated as well.  Over udp, the key sends the
+ * command with a new sequence number and keeps it
+ * pending until the lock acknowledges it, while the
+ * lock (whose own button gave the command) only
+ * reports it to its next pollCommTransport() call.
+ *
+ * @param: CommTransport*, int command (1 = lock, 0 = unlock), uint32_t trace ID
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int writeTracedCommand(CommTransport* transport, int command, uint32_t traceId)
+{
+	if (transport == NULL || (command != 0 && command != 1))
+	{
+		return -1;
+	}
+
+	transport->command = command;
+	transport->traceId = traceId;
+
+	if (transport->type == COMM_TRANSPORT_SHM)
+	{
+		writeCommRecord(transport->record, command, traceId);
+		return 0;
+	}
+
+	if (transport->type == COMM_TRANSPORT_UDP)
+	{
+		if (transport->role == COMM_ROLE_LOCK)
+		{
+			transport->localChange = 1;
+			return 0;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		closeCommConnection(transport, &transport->connections[0]);
+		transport->sequence++;
+		transport->sendTime = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+		transport->firstSendTime = monotonicNanoseconds();
+		transport->pending = 1;
+		transport->retries = 0;
+		transport->retransmitTimeout = COMM_UDP_RETRANSMIT_MS;
+		transport->fallback = COMM_FALLBACK_NONE;
+		transport->ackLatency = 0;
+		sendPendingCommand(transport);
+		return 0;
+	}
+
+	return writeCommunicationFile(transport->path, command, traceId);
+}
+
+/* =================================================
+ * This function tells the transport the actual state
+ * of the lock (one of the COMM_STATE_ values).  Over
+ * udp it is sent with every acknowledgement, and a
+ * change is reported right away to the last key that
+ * sent a command.
+ *
+ * @param: CommTransport*, int state
+ * @return: void
+ * ============================================== */
+
+void setCommLockState(CommTransport* transport, int state)
+{
+	if (transport == NULL || transport->lockState == state)
+	{
+		return;
+	}
+
+	transport->lockState = state;
+
+	if (transport->type == COMM_TRANSPORT_UDP && transport->role == COMM_ROLE_LOCK && transport->peerLength > 0)
+	{
+		CommPacket packet;
+		buildCommPacket(transport, &packet, COMM_PACKET_STATE, transport->command, state, transport->session, transport->sequence, 0, transport->traceId);
+		sendto(transport->socketFd, &packet, sizeof(packet), 0, (struct sockaddr*) &transport->peer, transport->peerLength);
+	}
+}
+
+/* =================================================
+ * This function fills fds with the descriptors that
+ * become readable when the transport has something
+ * to do (the communication file watcher and, over
+ * udp, the sockets), so that a program can sleep in
+ * poll() until then and call pollCommTransport().
+ * The shm transport has no descriptor and must be
+ * checked every COMM_SHM_POLL_MS instead.
+ *
+ * @param: CommTransport*, struct pollfd* array to fill, int size of the array
+ * @return: number of descriptors filled in
+ * ============================================== */
+
+int getCommTransportFds(const CommTransport* transport, struct pollfd* fds, int maxFds)
+{
+	int descriptors[3] = { transport->watcher.fd, transport->socketFd, transport->listenFd };
+	int count = 0;
+
+	if (transport->type == COMM_TRANSPORT_SHM)
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < 3 && count < maxFds; ++i)
+	{
+		if (descriptors[i] >= 0)
+		{
+			fds[count].fd = descriptors[i];
+			fds[count].events = POLLIN;
+			fds[count].revents = 0;
+			count++;
+		}
+	}
+	return count;
+}
+
+/* =================================================
+ * This function returns a printable name for one of
+ * the COMM_STATE_ values.
+ *
+ * @param: int state
+ * @return: char*, name of the state
+ * ============================================== */
+
+const char* commStateName(int state)
+{
+	switch (state)
+	{
+		case COMM_STATE_UNLOCKED:
+			return "UNLOCKED";
+		case COMM_STATE_LOCKED:
+			return "LOCKED";
+		case COMM_STATE_WAITING_TO_LOCK:
+			return "WAITING TO LOCK";
+		default:
+			return "UNKNOWN";
+	}
+}
+
+/* =================================================
+ * This function releases the resources held by the
+ * transport.
+ *
+ * @param: CommTransport*
+ * @return: void
+ * ============================================== */
+
+void closeCommTransport(CommTransport* transport)
+{
+	if (transport == NULL)
+	{
+		return;
+	}
+
+	if (transport->record != NULL)
+	{
+		munmap(transport->record, sizeof(CommRecord));
+		transport->record = NULL;
+	}
+	if (transport->socketFd >= 0)
+	{
+		close(transport->socketFd);
+		transport->socketFd = -1;
+	}
+	if (transport->listenFd >= 0)
+	{
+		close(transport->listenFd);
+		transport->listenFd = -1;
+	}
+	for (int i = 0; i < COMM_TCP_CONNECTIONS; ++i)
+	{
+		closeCommConnection(transport, &transport->connections[i]);
+	}
+	freeCommWatcher(&transport->watcher);
+}
+
+
+/* ======================================
+ * Fleet of locks controlled by one key
+ * ===================================== */
+
+/* =================================================
+ * This function arms the retransmission timer of the
+ * fleet while a command is waiting for an
+ * acknowledgement, and disarms it otherwise.
+ *
+ * @param: LockFleet*, int armed
+ * @return: void
+ * ============================================== */
+
+static void armFleetTimer(LockFleet* fleet, int armed)
+{
+	struct itimerspec interval;
+	memset(&interval, 0, sizeof(interval));
+
+	if (armed)
+	{
+		interval.it_interval.tv_nsec = (COMM_UDP_RETRANSMIT_MS / 2) * 1000000L;
+		interval.it_value = interval.it_interval;
+	}
+	timerfd_settime(fleet->timerFd, 0, &interval, NULL);
+}
+
+/* =================================================
+ * This function polls one lock of the fleet and, if
+ * it replied, updates its counters and calls the
+ * reply function.
+ *
+ * @param: LockFleet*, FleetLock*, reply function, void* argument of the reply function
+ * @return: 1 = the lock replied, 0 = nothing new
+ * ============================================== */
+
+static int pollFleetLock(LockFleet* fleet, FleetLock* lock, void (*onReply)(LockFleet*, FleetLock*, void*), void* argument)
+{
+	int wasPending = lock->transport.pending;
+
+	if (pollCommTransport(&lock->transport) != 1)
+	{
+		return 0;
+	}
+
+	lock->completed = (wasPending && !lock->transport.pending);
+	if (lock->completed)
+	{
+		fleet->outstanding--;
+		if (lock->transport.fallback != COMM_FALLBACK_FILE)
+		{
+			lock->acks++;
+			lock->ackLatencyTotal += lock->transport.ackLatency;
+			if (lock->transport.ackLatency > lock->ackLatencyMax)
+			{
+				lock->ackLatencyMax = lock->transport.ackLatency;
+			}
+		}
+		else
+		{
+			lock->failures++;
+		}
+	}
+
+	// With a single lock, the key follows commands given with the button on the lock
+	if (fleet->count == 1 && !lock->transport.pending)
+	{
+		fleet->command = lock->transport.command;
+	}
+
+	if (onReply != NULL)
+	{
+		onReply(fleet, lock, argument);
+	}
+	return 1;
+}
+
+/* =================================================
+ * This function opens one transport for each lock
+ * controlled by the key and registers their
+ * descriptors with a single epoll instance.  With
+ * the udp transport, every LOCK_ADDRESS of the
+ * configuration is one lock.  The file and shm
+ * transports always reach exactly one lock.
+ *
+ * @param: LockFleet*, LockConfig*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int openLockFleet(LockFleet* fleet, const LockConfig* settings)
+{
+	if (fleet == NULL || settings == NULL)
+	{
+		return -1;
+	}
+
+	memset(fleet, 0, sizeof(LockFleet));
+	fleet->count = (settings->commTransport == COMM_TRANSPORT_UDP && settings->lockCount > 0) ? settings->lockCount : 1;
+	fleet->locks = calloc(fleet->count, sizeof(FleetLock));
+	fleet->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	fleet->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fleet->locks == NULL || fleet->epollFd < 0 || fleet->timerFd < 0)
+	{
+		closeLockFleet(fleet);
+		return -1;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;	// the timer is the only source without a lock
+	epoll_ctl(fleet->epollFd, EPOLL_CTL_ADD, fleet->timerFd, &event);
+
+	for (int i = 0; i < fleet->count; ++i)
+	{
+		FleetLock* lock = &fleet->locks[i];
+		const char* address = (settings->lockCount > 0) ? settings->lockAddresses[i] : DEFAULT_LOCK_ADDRESS;
+
+		strncpy(lock->name, (settings->commTransport == COMM_TRANSPORT_UDP) ? address : "lock", sizeof(lock->name) - 1);
+		if (openTransport(&lock->transport, settings, COMM_ROLE_KEY, address) != 0)
+		{
+			fleet->count = i;
+			closeLockFleet(fleet);
+			return -1;
+		}
+
+		// The TCP fallback of the lock is added to the same epoll instance while it is connecting
+		lock->transport.epollFd = fleet->epollFd;
+		lock->transport.epollData = lock;
+
+		int fd = (lock->transport.socketFd >= 0) ? lock->transport.socketFd : lock->transport.watcher.fd;
+		if (fd >= 0)
+		{
+			event.events = EPOLLIN;
+			event.data.ptr = lock;
+			epoll_ctl(fleet->epollFd, EPOLL_CTL_ADD, fd, &event);
+		}
+	}
+
+	fleet->command = fleet->locks[0].transport.command;
+	return 0;
+}
+
+/* =================================================
+ * This function sends the same command, under one
+ * trace ID, to every lock of the fleet.
+ *
+ * @param: LockFleet*, int command (1 = lock, 0 = unlock)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int sendFleetCommand(LockFleet* fleet, int command)
+{
+	if (fleet == NULL || (command != 0 && command != 1))
+	{
+		return -1;
+	}
+
+	int result = 0;
+	fleet->command = command;
+	fleet->outstanding = 0;
+	fleet->sendTime = monotonicNanoseconds();
+	fleet->traceId = newTraceId();
+
+	for (int i = 0; i < fleet->count; ++i)
+	{
+		FleetLock* lock = &fleet->locks[i];
+		if (writeTracedCommand(&lock->transport, command, fleet->traceId) != 0)
+		{
+			result = -1;
+		}
+		lock->commands++;
+		if (lock->transport.pending)
+		{
+			fleet->outstanding++;
+		}
+	}
+
+	armFleetTimer(fleet, fleet->outstanding > 0);
+	return result;
+}
+
+/* =================================================
+ * This function waits up to timeoutMs milliseconds
+ * (0 does not block, a negative value waits forever)
+ * for replies from the locks of the fleet.  Only the
+ * locks whose descriptors are ready are polled, and
+ * the pending ones are revisited every time the
+ * retransmission timer fires, which also times out
+ * their TCP fallbacks.  No lock is waited on while
+ * the others are polled.  onReply is called for
+ * every lock that replied.
+ *
+ * @param: LockFleet*, int timeoutMs, reply function, void* argument of the reply function
+ * @return: number of locks that replied, -1 = error
+ * ============================================== */
+
+int pollLockFleet(LockFleet* fleet, int timeoutMs, void (*onReply)(LockFleet*, FleetLock*, void*), void* argument)
+{
+	if (fleet == NULL)
+	{
+		return -1;
+	}
+
+	struct epoll_event events[64];
+	int replies = 0;
+	int ready = epoll_wait(fleet->epollFd, events, 64, timeoutMs);
+
+	if (ready < 0)
+	{
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	for (int i = 0; i < ready; ++i)
+	{
+		FleetLock* lock = events[i].data.ptr;
+
+		if (lock != NULL)
+		{
+			replies += pollFleetLock(fleet, lock, onReply, argument);
+			continue;
+		}
+
+		// The retransmission timer fired: let every pending lock retransmit or fall back
+		uint64_t expirations;
+		read(fleet->timerFd, &expirations, sizeof(expirations));
+		for (int n = 0; n < fleet->count; ++n)
+		{
+			if (fleet->locks[n].transport.pending)
+			{
+				replies += pollFleetLock(fleet, &fleet->locks[n], onReply, argument);
+			}
+		}
+		if (fleet->outstanding <= 0)
+		{
+			armFleetTimer(fleet, 0);
+		}
+	}
+
+	// The shared memory record has no descriptor, it is cheap enough to check on every call
+	if (fleet->locks[0].transport.type == COMM_TRANSPORT_SHM)
+	{
+		replies += pollFleetLock(fleet, &fleet->locks[0], onReply, argument);
+	}
+
+	return replies;
+}
+
+/* =================================================
+ * This function closes every transport of the fleet.
+ *
+ * @param: LockFleet*
+ * @return: void
+ * ============================================== */
+
+void closeLockFleet(LockFleet* fleet)
+{
+	if (fleet == NULL)
+	{
+		return;
+	}
+
+	if (fleet->locks != NULL)
+	{
+		for (int i = 0; i < fleet->count; ++i)
+		{
+			closeCommTransport(&fleet->locks[i].transport);
+		}
+		free(fleet->locks);
+		fleet->locks = NULL;
+	}
+	if (fleet->timerFd >= 0)
+	{
+		close(fleet->timerFd);
+	}
+	if (fleet->epollFd >= 0)
+	{
+		close(fleet->epollFd);
+	}
+	fleet->timerFd = -1;
+	fleet->epollFd = -1;
+	fleet->count = 0;
+}
+
+
+/* ======================================
+ * Table driven state machines
+ * ===================================== */
+
+/* =================================================
+ * This function sets up a state machine driven by a
+ * transition table.  The table must stay valid for
+ * as long as the machine is used.  No hook is set;
+ * assign machine->onTransition to get one.
+ *
+ * @param: StateMachine*, StateTransition* table, int rows of the table, int initial state, void* context of the actions
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initStateMachine(StateMachine* machine, const StateTransition* table, int count, int initialState, void* context)
+{
+	if (machine == NULL || table == NULL || count <= 0)
+	{
+		return -1;
+	}
+
+	machine->table = table;
+	machine->count = count;
+	machine->state = initialState;
+	machine->enteredAt = monotonicNanoseconds();
+	machine->transitions = 0;
+	machine->context = context;
+	machine->onTransition = NULL;
+	return 0;
+}
+
+/* =================================================
+ * This function gives an event to a state machine.
+ * The first row of the table that starts from the
+ * current state and matches the event is taken: its
+ * action runs, the state changes, enteredAt records
+ * when, and the hook is called with the time the
+ * event was observed so it can measure the latency
+ * of the transition.  Events without a matching row
+ * are ignored.
+ *
+ * @param: StateMachine*, int event, uint64_t eventTime (CLOCK_MONOTONIC in nanoseconds)
+ * @return: 1 = a transition was taken, 0 = the event was ignored
+ * ============================================== */
+
+int fireStateEvent(StateMachine* machine, int event, uint64_t eventTime)
+{
+	for (int i = 0; i < machine->count; ++i)
+	{
+		const StateTransition* transition = &machine->table[i];
+
+		if (transition->from == machine->state && transition->event == event)
+		{
+			if (transition->action != NULL)
+			{
+				transition->action(machine->context);
+			}
+			machine->state = transition->to;
+			machine->enteredAt = monotonicNanoseconds();
+			machine->transitions++;
+
+			if (machine->onTransition != NULL)
+			{
+				machine->onTransition(machine, transition, eventTime);
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* =================================================
+ * This function sets up the button machine shared by
+ * the key and the lock.  It starts in BUTTON_START,
+ * goes to BUTTON_PRESSED or BUTTON_UNPRESSED with the
+ * first level of the button, and calls onRelease
+ * every time the button goes from pressed to
+ * released.  The rows are copied to the table given,
+ * which must stay valid for as long as the machine.
+ *
+ * @param: StateMachine*, StateTransition table[BUTTON_TRANSITIONS], release function, void* context of the release function
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initButtonMachine(StateMachine* machine, StateTransition table[BUTTON_TRANSITIONS], void (*onRelease)(void* context), void* context)
+{
+	static const StateTransition buttonTransitions[BUTTON_TRANSITIONS] =
+	{
+		{ BUTTON_START, EVENT_BUTTON_DOWN, BUTTON_PRESSED, NULL },
+		{ BUTTON_START, EVENT_BUTTON_UP, BUTTON_UNPRESSED, NULL },
+		{ BUTTON_UNPRESSED, EVENT_BUTTON_DOWN, BUTTON_PRESSED, NULL },
+		{ BUTTON_PRESSED, EVENT_BUTTON_UP, BUTTON_UNPRESSED, NULL }		// the release, its action is onRelease
+	};
+
+	if (table == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(table, buttonTransitions, sizeof(buttonTransitions));
+	table[BUTTON_TRANSITIONS - 1].action = onRelease;
+	return initStateMachine(machine, table, BUTTON_TRANSITIONS, BUTTON_START, context);
+}
+
+/* =================================================
+ * This function empties a latency histogram and
+ * gives it the name used in the log file.
+ *
+ * @param: LatencyHistogram*, char* name
+ * @return: void
+ * ============================================== */
+
+void initLatencyHistogram(LatencyHistogram* histogram, const char* name)
+{
+	memset(histogram, 0, sizeof(LatencyHistogram));
+	histogram->name = name;
+}
+
+/* =================================================
+ * This function adds one latency to a histogram.
+ * Latencies under 2 microseconds go to bucket 0 and
+ * the ones that do not fit go to the last bucket.
+ *
+ * @param: LatencyHistogram*, uint64_t latency in nanoseconds
+ * @return: void
+ * ============================================== */
+
+void recordLatency(LatencyHistogram* histogram, uint64_t latency)
+{
+	uint64_t microseconds = latency / 1000;
+	int bucket = (microseconds > 1) ? 63 - __builtin_clzll(microseconds) : 0;
+
+	if (bucket >= LATENCY_BUCKETS)
+	{
+		bucket = LATENCY_BUCKETS - 1;
+	}
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total += latency;
+	if (latency > histogram->max)
+	{
+		histogram->max = latency;
+	}
+}
+
+/* =================================================
+ * This function returns the upper bound, in
+ * milliseconds, of the bucket holding the given
+ * percentile of a histogram.
+ *
+ * @param: LatencyHistogram*, int percentile [1 - 100]
+ * @return: double milliseconds
+ * ============================================== */
+
+static double latencyPercentile(const LatencyHistogram* histogram, int percentile)
+{
+	unsigned long target = (histogram->count * percentile + 99) / 100;
+	unsigned long seen = 0;
+
+	for (int b = 0; b < LATENCY_BUCKETS; ++b)
+	{
+		seen += histogram->buckets[b];
+		if (seen >= target)
+		{
+			return (double) (2ULL << b) / 1000.0;
+		}
+	}
+	return histogram->max / 1000000.0;
+}
+
+/* =================================================
+ * This function writes a histogram to the log file
+ * on one line: the number of samples, the mean, the
+ * maximum, the bucket bounds of the median and of
+ * the 99th percentile, then "<bound>:<count>" for
+ * every bucket that is not empty.
+ *
+ * @param: Logger*, LatencyHistogram*
+ * @return: void
+ * ============================================== */
+
+void logLatencyHistogram(Logger* logger, const LatencyHistogram* histogram)
+{
+	char message[LOG_MESSAGE_LENGTH];
+	size_t room = sizeof(message) - 1;	// the newline always fits
+	int length;
+
+	if (histogram->count == 0)
+	{
+		snprintf(message, sizeof(message), "%s: no samples yet\n", histogram->name);
+		PRINT_MSG(logger, message);
+		return;
+	}
+
+	length = snprintf(message, room, "%s: %lu samples, mean %.3f ms, max %.3f ms, p50 < %.3f ms, p99 < %.3f ms, buckets",
+		histogram->name, histogram->count, (histogram->total / (double) histogram->count) / 1000000.0, histogram->max / 1000000.0,
+		latencyPercentile(histogram, 50), latencyPercentile(histogram, 99));
+
+	for (int b = 0; b < LATENCY_BUCKETS && length >= 0 && (size_t) length < room; ++b)
+	{
+		if (histogram->buckets[b] != 0)
+		{
+			length += snprintf(message + length, room - length, " <%.3fms:%u", (double) (2ULL << b) / 1000.0, histogram->buckets[b]);
+		}
+	}
+
+	if (length < 0 || (size_t) length > room - 1)
+	{
+		length = room - 1;
+	}
+	message[length] = '\n';
+	message[length + 1] = 0;
+	PRINT_MSG(logger, message);
+}
+
+
+/* ======================================
+ * Lock state snapshot
+ * ===================================== */
+
+/* =================================================
+ * This function checks the magic number and the
+ * CRC-32 of a snapshot read from the file.
+ *
+ * @param: StateSnapshot*
+ * @return: 1 = valid snapshot, 0 = empty or damaged slot
+ * ============================================== */
+
+static int validStateSnapshot(const StateSnapshot* snapshot)
+{
+	return snapshot->magic == STATE_SNAPSHOT_MAGIC && snapshot->crc == crc32(0, snapshot, offsetof(StateSnapshot, crc));
+}
+
+/* =================================================
+ * This function opens the snapshot file, creating
+ * it if needed, and reads the newest valid snapshot
+ * of its two slots into file->last.  The file is
+ * given the size of both slots up front, so that a
+ * later write never has to change its size and only
+ * its data is written to the disk.
+ *
+ * @param: StateSnapshotFile*, char* path
+ * @return: 1 = a snapshot was found, 0 = none, -1 = error
+ * ============================================== */
+
+int openStateSnapshot(StateSnapshotFile* file, const char* path)
+{
+	if (file == NULL || path == NULL)
+	{
+		return -1;
+	}
+
+	memset(file, 0, sizeof(StateSnapshotFile));
+	file->fd = open(path, O_RDWR | O_CREAT | O_DSYNC | O_CLOEXEC, 0644);
+	if (file->fd < 0)
+	{
+		return -1;
+	}
+
+	struct stat status;
+	if (fstat(file->fd, &status) == 0 && status.st_size < 2 * STATE_SNAPSHOT_SLOT)
+	{
+		if (ftruncate(file->fd, 2 * STATE_SNAPSHOT_SLOT) == 0)
+		{
+			fsync(file->fd);
+		}
+	}
+
+	int found = 0;
+	for (int slot = 0; slot < 2; ++slot)
+	{
+		StateSnapshot snapshot;
+		if (pread(file->fd, &snapshot, sizeof(snapshot), slot * STATE_SNAPSHOT_SLOT) != (ssize_t) sizeof(snapshot) || !validStateSnapshot(&snapshot))
+		{
+			continue;
+		}
+
+		if (!found || (int32_t) (snapshot.sequence - file->last.sequence) > 0)
+		{
+			file->last = snapshot;
+			file->slot = 1 - slot;		// the next write replaces the older copy
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/* =================================================
+ * This function writes a new snapshot over the older
+ * of the two slots.  The file was opened with O_DSYNC,
+ * so the snapshot is on the disk when this returns;
+ * if the write fails, or the power is lost during it,
+ * the other slot still holds the previous snapshot.
+ *
+ * @param: StateSnapshotFile*, int state, int command, uint32_t trace ID, uint32_t servo pulse width (us)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int saveStateSnapshot(StateSnapshotFile* file, int state, int command, uint32_t traceId, uint32_t servoPulse)
+{
+	if (file == NULL || file->fd < 0)
+	{
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	StateSnapshot snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.magic = STATE_SNAPSHOT_MAGIC;
+	snapshot.sequence = file->last.sequence + 1;
+	snapshot.state = state;
+	snapshot.command = command;
+	snapshot.traceId = traceId;
+	snapshot.servoPulse = servoPulse;
+	snapshot.writeTime = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	snapshot.crc = crc32(0, &snapshot, offsetof(StateSnapshot, crc));
+
+	uint64_t start = monotonicNanoseconds();
+	if (pwrite(file->fd, &snapshot, sizeof(snapshot), file->slot * STATE_SNAPSHOT_SLOT) != (ssize_t) sizeof(snapshot))
+	{
+		return -1;
+	}
+	file->writeTime += monotonicNanoseconds() - start;
+	file->writes++;
+
+	file->last = snapshot;
+	file->slot = 1 - file->slot;
+	return 0;
+}
+
+/* =================================================
+ * This function closes the snapshot file.  Every
+ * snapshot was already written to the disk.
+ *
+ * @param: StateSnapshotFile*
+ * @return: void
+ * ============================================== */
+
+void closeStateSnapshot(StateSnapshotFile* file)
+{
+	if (file != NULL && file->fd >= 0)
+	{
+		close(file->fd);
+		file->fd = -1;
+	}
+}
+
+
+/* ======================================
+ * Watchdog supervisor
+ * ===================================== */
+
+/* =================================================
+ * This function prepares a watchdog supervisor.  The
+ * watchdog time limit is set, and read back since
+ * the driver may round it.  Nothing is kicked until
+ * startWatchdogSupervisor() is called.
+ *
+ * @param: WatchdogSupervisor*, int /dev/watchdog descriptor (-1 if none), int time limit (s), Logger*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initWatchdogSupervisor(WatchdogSupervisor* supervisor, int watchdogFd, int timeout, Logger* logger)
+{
+	if (supervisor == NULL)
+	{
+		return -1;
+	}
+
+	memset(supervisor, 0, sizeof(WatchdogSupervisor));
+	supervisor->fd = watchdogFd;
+	supervisor->logger = logger;
+	atomic_init(&supervisor->kicks, 0);
+	atomic_init(&supervisor->skipped, 0);
+
+	supervisor->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	supervisor->stopFd = eventfd(0, EFD_CLOEXEC);
+	if (supervisor->timerFd < 0 || supervisor->stopFd < 0)
+	{
+		if (supervisor->timerFd >= 0)
+		{
+			close(supervisor->timerFd);
+		}
+		if (supervisor->stopFd >= 0)
+		{
+			close(supervisor->stopFd);
+		}
+		return -1;
+	}
+
+	supervisor->timeout = (timeout > 0) ? timeout : DEFAULT_TIMEOUT;
+	if (supervisor->fd >= 0)
+	{
+		ioctl(supervisor->fd, WDIOC_SETTIMEOUT, &supervisor->timeout);
+		ioctl(supervisor->fd, WDIOC_GETTIMEOUT, &supervisor->timeout);
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function adds a subsystem to the ones the
+ * supervisor watches.  The subsystem shows it is
+ * alive with REPORT_HEARTBEAT() on the counter.  A
+ * subsystem that sleeps for longer than a kick
+ * period when it is idle (e.g. the logger, between
+ * two flushes) gives an eventfd that wakes it up; it
+ * is written after every check, so the subsystem
+ * has until the next one to answer.  Sources are
+ * added before the thread is started.
+ *
+ * @param: WatchdogSupervisor*, char* name (used in the log), atomic_ulong* heartbeat counter, int wake eventfd (-1 if none)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int addWatchdogSource(WatchdogSupervisor* supervisor, const char* name, atomic_ulong* heartbeat, int wakeFd)
+{
+	if (supervisor == NULL || heartbeat == NULL || supervisor->sourceCount >= WATCHDOG_MAX_SOURCES)
+	{
+		return -1;
+	}
+
+	supervisor->sourceNames[supervisor->sourceCount] = name;
+	supervisor->sources[supervisor->sourceCount] = heartbeat;
+	supervisor->wakeFds[supervisor->sourceCount] = wakeFd;
+	supervisor->lastBeats[supervisor->sourceCount] = atomic_load_explicit(heartbeat, memory_order_relaxed);
+	supervisor->sourceCount++;
+	return 0;
+}
+
+/* =================================================
+ * This function arms the timer of the supervisor
+ * for a kick every WATCHDOG_KICK_FRACTION of the
+ * time limit.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int armWatchdogTimer(WatchdogSupervisor* supervisor)
+{
+	uint64_t period = (uint64_t) supervisor->timeout * 1000000000ULL / WATCHDOG_KICK_FRACTION;
+	struct itimerspec timer;
+	timer.it_interval.tv_sec = period / 1000000000ULL;
+	timer.it_interval.tv_nsec = period % 1000000000ULL;
+	timer.it_value = timer.it_interval;
+
+	return timerfd_settime(supervisor->timerFd, 0, &timer, NULL);
+}
+
+/* =================================================
+ * This function checks the heartbeats of the
+ * watched subsystems, and kicks the watchdog if
+ * every one of them has moved since the last kick.
+ * Otherwise the kick is held back and the silent
+ * subsystems are logged; if they stay silent for
+ * the whole time limit the watchdog resets the Pi.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: void
+ * ============================================== */
+
+static void superviseWatchdog(WatchdogSupervisor* supervisor)
+{
+	unsigned long beats[WATCHDOG_MAX_SOURCES];
+	char message[LOG_MESSAGE_LENGTH];
+	int length = 0;
+
+	for (int i = 0; i < supervisor->sourceCount; ++i)
+	{
+		beats[i] = atomic_load_explicit(supervisor->sources[i], memory_order_relaxed);
+		if (beats[i] == supervisor->lastBeats[i] && length >= 0 && (size_t) length < sizeof(message))
+		{
+			length += snprintf(message + length, sizeof(message) - length, "%s%s",
+				(length == 0) ? "The Watchdog was not kicked, no heartbeat from: " : ", ", supervisor->sourceNames[i]);
+		}
+	}
+
+	if (length > 0)
+	{
+		atomic_fetch_add_explicit(&supervisor->skipped, 1, memory_order_relaxed);
+		if ((size_t) length > sizeof(message) - 2)
+		{
+			length = sizeof(message) - 2;
+		}
+		message[length] = '\n';
+		message[length + 1] = 0;
+
+		// The Pi may be reset soon, make sure the log file holds the reason
+		PRINT_MSG(supervisor->logger, message);
+		flushLogger(supervisor->logger);
+		return;
+	}
+
+	memcpy(supervisor->lastBeats, beats, sizeof(unsigned long) * supervisor->sourceCount);
+	atomic_fetch_add_explicit(&supervisor->kicks, 1, memory_order_relaxed);
+
+	if (supervisor->fd < 0)
+	{
+		// There is no watchdog to kick with the sim GPIO backend
+	}
+	else if (ioctl(supervisor->fd, WDIOC_KEEPALIVE, 0) != 0)
+	{
+		// The watchdog will reset the Pi soon, make sure the log file holds everything up to this point
+		PRINT_MSG(supervisor->logger, "The Watchdog could not be updated!\n\n");
+		flushLogger(supervisor->logger);
+	}
+	else
+	{
+		PRINT_REPEATED_MSG(supervisor->logger, "The Watchdog was updated\n\n");
+	}
+}
+
+/* =================================================
+ * This function asks the subsystems that could be
+ * idle for a heartbeat before the next check.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: void
+ * ============================================== */
+
+static void wakeWatchdogSources(WatchdogSupervisor* supervisor)
+{
+	uint64_t wakeup = 1;
+	for (int i = 0; i < supervisor->sourceCount; ++i)
+	{
+		if (supervisor->wakeFds[i] >= 0)
+		{
+			write(supervisor->wakeFds[i], &wakeup, sizeof(wakeup));
+		}
+	}
+}
+
+/* =================================================
+ * This function is the body of the supervisor
+ * thread.  It sleeps until its timer fires or it is
+ * asked to stop.
+ *
+ * @param: void*, the WatchdogSupervisor
+ * @return: void*
+ * ============================================== */
+
+static void* watchdogThread(void* argument)
+{
+	WatchdogSupervisor* supervisor = argument;
+	struct pollfd fds[2] = { { supervisor->timerFd, POLLIN, 0 }, { supervisor->stopFd, POLLIN, 0 } };
+	uint64_t expirations;
+
+	while (1)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			continue;	// interrupted by a signal
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			return NULL;
+		}
+		if ((fds[0].revents & POLLIN) && read(supervisor->timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		{
+			superviseWatchdog(supervisor);
+			wakeWatchdogSources(supervisor);
+		}
+	}
+}
+
+/* =================================================
+ * This function starts the supervisor thread.  The
+ * watchdog is kicked once right away, since the
+ * subsystems have not had the time to show a
+ * heartbeat yet.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int startWatchdogSupervisor(WatchdogSupervisor* supervisor)
+{
+	if (supervisor == NULL || armWatchdogTimer(supervisor) != 0)
+	{
+		return -1;
+	}
+
+	if (supervisor->fd >= 0)
+	{
+		ioctl(supervisor->fd, WDIOC_KEEPALIVE, 0);
+	}
+	wakeWatchdogSources(supervisor);
+
+	if (pthread_create(&supervisor->thread, NULL, watchdogThread, supervisor) != 0)
+	{
+		close(supervisor->timerFd);
+		close(supervisor->stopFd);
+		supervisor->timerFd = -1;	// stopWatchdogSupervisor() then has nothing to do
+		supervisor->stopFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function changes the watchdog time limit
+ * while the supervisor runs, kicks the watchdog so
+ * the new limit starts now, and re-arms the timer.
+ *
+ * @param: WatchdogSupervisor*, int time limit (s)
+ * @return: int, time limit in effect (s)
+ * ============================================== */
+
+int setWatchdogTimeout(WatchdogSupervisor* supervisor, int timeout)
+{
+	if (supervisor == NULL || timeout <= 0)
+	{
+		return (supervisor != NULL) ? supervisor->timeout : -1;
+	}
+
+	supervisor->timeout = timeout;
+	if (supervisor->fd >= 0)
+	{
+		ioctl(supervisor->fd, WDIOC_SETTIMEOUT, &supervisor->timeout);
+		ioctl(supervisor->fd, WDIOC_GETTIMEOUT, &supervisor->timeout);
+		ioctl(supervisor->fd, WDIOC_KEEPALIVE, 0);
+	}
+	armWatchdogTimer(supervisor);
+	return supervisor->timeout;
+}
+
+/* =================================================
+ * This function returns the longest time, in
+ * milliseconds, a watched subsystem may wait between
+ * two heartbeats without holding back a kick: half
+ * of the time between two kicks.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: int, milliseconds
+ * ============================================== */
+
+int heartbeatInterval(const WatchdogSupervisor* supervisor)
+{
+	return supervisor->timeout * 1000 / (2 * WATCHDOG_KICK_FRACTION);
+}
+
+/* =================================================
+ * This function stops the supervisor thread.  The
+ * watchdog itself is left as it is, so the caller
+ * still disables it with the magic close ("V")
+ * before closing it.
+ *
+ * @param: WatchdogSupervisor*
+ * @return: void
+ * ============================================== */
+
+void stopWatchdogSupervisor(WatchdogSupervisor* supervisor)
+{
+	if (supervisor == NULL || supervisor->timerFd < 0)
+	{
+		return;
+	}
+
+	uint64_t stop = 1;
+	write(supervisor->stopFd, &stop, sizeof(stop));
+	pthread_join(supervisor->thread, NULL);
+
+	close(supervisor->timerFd);
+	close(supervisor->stopFd);
+	supervisor->timerFd = -1;
+	supervisor->stopFd = -1;
+}
+
+
+/* ======================================
+ * Event loop
+ * ===================================== */
+
+/* =================================================
+ * This function creates an empty event loop.
+ *
+ * @param: EventLoop*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initEventLoop(EventLoop* loop)
+{
+	if (loop == NULL)
+	{
+		return -1;
+	}
+
+	memset(loop, 0, sizeof(EventLoop));
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; ++i)
+	{
+		loop->sources[i].fd = -1;
+	}
+	loop->startTime = monotonicNanoseconds();
+
+	loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	return (loop->epollFd >= 0) ? 0 : -1;
+}
+
+/* =================================================
+ * This function adds a descriptor of the given type
+ * to the loop, in a free slot whose index is kept as
+ * the epoll data of the descriptor.
+ *
+ * @param: EventLoop*, int fd, int type, EventHandler, void* data
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int addSource(EventLoop* loop, int fd, int type, EventHandler handler, void* data)
+{
+	if (loop == NULL || fd < 0)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; ++i)
+	{
+		EventSource* source = &loop->sources[i];
+		if (source->fd >= 0)
+		{
+			continue;
+		}
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.u32 = (uint32_t) i;
+		if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+		{
+			return -1;
+		}
+
+		source->fd = fd;
+		source->type = type;
+		source->handler = handler;
+		source->data = data;
+		return 0;
+	}
+	return -1;
+}
+
+/* =================================================
+ * This function adds a descriptor owned by the
+ * caller (a socket, a pipe, an inotify or epoll
+ * descriptor...).  The loop wakes up while it is
+ * readable, so the handler, or the caller after
+ * runEventLoop() returns, must read it.
+ *
+ * @param: EventLoop*, int fd, EventHandler (may be NULL), void* data
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int addEventSource(EventLoop* loop, int fd, EventHandler handler, void* data)
+{
+	return addSource(loop, fd, EVENT_SOURCE_FD, handler, data);
+}
+
+/* =================================================
+ * This function adds a periodic timer to the loop.
+ *
+ * @param: EventLoop*, int period (ms), EventHandler (may be NULL), void* data
+ * @return: timerfd of the timer, -1 = error
+ * ============================================== */
+
+int addTimerSource(EventLoop* loop, int periodMs, EventHandler handler, void* data)
+{
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0)
+	{
+		return -1;
+	}
+
+	if (setTimerSource(loop, timerFd, periodMs) != 0 || addSource(loop, timerFd, EVENT_SOURCE_TIMER, handler, data) != 0)
+	{
+		close(timerFd);
+		return -1;
+	}
+	return timerFd;
+}
+
+/* =================================================
+ * This function changes the period of a timer of
+ * the loop.  A period of 0 stops the timer.
+ *
+ * @param: EventLoop*, int timerfd, int period (ms)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int setTimerSource(EventLoop* loop, int timerFd, int periodMs)
+{
+	(void) loop;
+	struct itimerspec timer;
+	timer.it_interval.tv_sec = periodMs / 1000;
+	timer.it_interval.tv_nsec = (long) (periodMs % 1000) * 1000000L;
+	timer.it_value = timer.it_interval;
+
+	return timerfd_settime(timerFd, 0, &timer, NULL);
+}
+
+/* =================================================
+ * This function delivers the given signals through
+ * the loop.  They are blocked in the calling thread,
+ * so this must be called before any other thread is
+ * started: the threads inherit the mask, and the
+ * signals then only reach the signalfd.
+ *
+ * @param: EventLoop*, int* signals, int count, EventHandler, void* data
+ * @return: signalfd, -1 = error
+ * ============================================== */
+
+int addSignalSource(EventLoop* loop, const int* signals, int count, EventHandler handler, void* data)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int i = 0; i < count; ++i)
+	{
+		sigaddset(&mask, signals[i]);
+	}
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
+	{
+		return -1;
+	}
+
+	int signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd < 0)
+	{
+		return -1;
+	}
+
+	if (addSource(loop, signalFd, EVENT_SOURCE_SIGNAL, handler, data) != 0)
+	{
+		close(signalFd);
+		return -1;
+	}
+	return signalFd;
+}
+
+/* =================================================
+ * This function removes a descriptor from the loop.
+ * Timers and signalfds are closed, descriptors of
+ * the caller are left open.
+ *
+ * @param: EventLoop*, int fd
+ * @return: 0 = successful execution, -1 = not found
+ * ============================================== */
+
+int removeEventSource(EventLoop* loop, int fd)
+{
+	for (int i = 0; loop != NULL && fd >= 0 && i < EVENT_LOOP_MAX_SOURCES; ++i)
+	{
+		EventSource* source = &loop->sources[i];
+		if (source->fd != fd)
+		{
+			continue;
+		}
+
+		epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+		if (source->type != EVENT_SOURCE_FD)
+		{
+			close(fd);
+		}
+		source->fd = -1;
+		return 0;
+	}
+	return -1;
+}
+
+/* =================================================
+ * This function waits up to timeoutMs milliseconds
+ * (0 does not block, a negative value waits until
+ * an event arrives) and calls the handler of every
+ * source that is ready.  A handler may remove
+ * sources; events of a source removed during the
+ * same wakeup are dropped.
+ *
+ * @param: EventLoop*, int timeoutMs
+ * @return: number of events handled, -1 = error
+ * ============================================== */
+
+int runEventLoop(EventLoop* loop, int timeoutMs)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int fds[EVENT_LOOP_MAX_EVENTS];
+
+	int count = epoll_wait(loop->epollFd, events, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+	if (count < 0)
+	{
+		return (errno == EINTR) ? 0 : -1;
+	}
+	if (count > 0)
+	{
+		loop->wakeups++;
+	}
+
+	// Remember which descriptor every event was for, so that an event is not given to a source added in its slot meanwhile
+	for (int e = 0; e < count; ++e)
+	{
+		fds[e] = loop->sources[events[e].data.u32].fd;
+	}
+
+	for (int e = 0; e < count; ++e)
+	{
+		EventSource* source = &loop->sources[events[e].data.u32];
+		if (source->fd < 0 || source->fd != fds[e])
+		{
+			continue;
+		}
+		loop->dispatched++;
+
+		if (source->type == EVENT_SOURCE_TIMER)
+		{
+			uint64_t expirations;
+			if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations) && source->handler != NULL)
+			{
+				source->handler(loop, source->fd, (uint32_t) expirations, source->data);
+			}
+		}
+		else if (source->type == EVENT_SOURCE_SIGNAL)
+		{
+			struct signalfd_siginfo signal;
+			while (source->fd == fds[e] && read(source->fd, &signal, sizeof(signal)) == sizeof(signal))
+			{
+				if (source->handler != NULL)
+				{
+					source->handler(loop, source->fd, signal.ssi_signo, source->data);
+				}
+			}
+		}
+		else if (source->handler != NULL)
+		{
+			source->handler(loop, source->fd, events[e].events, source->data);
+		}
+	}
+
+	return count;
+}
+
+/* =================================================
+ * This function is the handler of the signal source
+ * of both programs.  SIGTERM and SIGINT ask the main
+ * loop to shut down cleanly, which flushes the
+ * logger before the program exits.  SIGHUP asks it
+ * to reload the configuration on its next pass.
+ *
+ * @param: EventLoop*, int signalfd, uint32_t signal number, void* (unused)
+ * @return: void
+ * ============================================== */
+
+void handleStopOrReloadSignal(EventLoop* loop, int fd, uint32_t signalNumber, void* data)
+{
+	(void) loop;
+	(void) fd;
+	(void) data;
+
+	if (signalNumber == SIGHUP)
+	{
+		reloadRequested = 1;
+	}
+	else
+	{
+		stopRequested = 1;
+	}
+}
+
+/* =================================================
+ * This function adds the descriptors of a transport
+ * to the loop.  The shared memory transport has no
+ * descriptor to wait on, so a COMM_SHM_POLL_MS timer
+ * is added instead and kept in pollTimerFd.
+ *
+ * @param: EventLoop*, CommTransport*
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int addCommTransportSources(EventLoop* loop, CommTransport* transport)
+{
+	struct pollfd fds[3];
+	int count = getCommTransportFds(transport, fds, 3);
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (addEventSource(loop, fds[i].fd, NULL, NULL) != 0)
+		{
+			return -1;
+		}
+	}
+
+	transport->pollTimerFd = -1;
+	if (transport->type == COMM_TRANSPORT_SHM)
+	{
+		transport->pollTimerFd = addTimerSource(loop, COMM_SHM_POLL_MS, NULL, NULL);
+		if (transport->pollTimerFd < 0)
+		{
+			return -1;
+		}
+	}
+
+	// The accepted TCP connections of the lock are added to the loop as they come, and timed out with this timer
+	if (transport->type == COMM_TRANSPORT_UDP && transport->role == COMM_ROLE_LOCK)
+	{
+		transport->loop = loop;
+		transport->connectionTimerFd = addTimerSource(loop, 0, NULL, NULL);
+		if (transport->connectionTimerFd < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* =================================================
+ * This function removes the descriptors of a
+ * transport from the loop, before it is closed.
+ *
+ * @param: EventLoop*, CommTransport*
+ * @return: void
+ * ============================================== */
+
+void removeCommTransportSources(EventLoop* loop, CommTransport* transport)
+{
+	struct pollfd fds[3];
+	int count = getCommTransportFds(transport, fds, 3);
+
+	for (int i = 0; i < count; ++i)
+	{
+		removeEventSource(loop, fds[i].fd);
+	}
+
+	if (transport->pollTimerFd >= 0)
+	{
+		removeEventSource(loop, transport->pollTimerFd);
+		transport->pollTimerFd = -1;
+	}
+
+	for (int i = 0; i < COMM_TCP_CONNECTIONS; ++i)
+	{
+		if (transport->connections[i].fd >= 0)
+		{
+			removeEventSource(loop, transport->connections[i].fd);
+		}
+	}
+	if (transport->connectionTimerFd >= 0)
+	{
+		removeEventSource(loop, transport->connectionTimerFd);
+		transport->connectionTimerFd = -1;
+	}
+	transport->loop = NULL;
+}
+
+/* =================================================
+ * This function writes how often the loop woke up
+ * since it was created to the log file.
+ *
+ * @param: Logger*, EventLoop*
+ * @return: void
+ * ============================================== */
+
+void logEventLoopStats(Logger* logger, const EventLoop* loop)
+{
+	char message[LOG_MESSAGE_LENGTH];
+	double seconds = (monotonicNanoseconds() - loop->startTime) / 1000000000.0;
+
+	snprintf(message, sizeof(message), "Event loop: %lu wakeups (%.1f/s), %lu events handled in %.1f s\n",
+		loop->wakeups, (seconds > 0) ? loop->wakeups / seconds : 0.0, loop->dispatched, seconds);
+	PRINT_MSG(logger, message);
+}
+
+/* =================================================
+ * This function closes the loop along with the
+ * timers and signalfds it owns.
+ *
+ * @param: EventLoop*
+ * @return: void
+ * ============================================== */
+
+void closeEventLoop(EventLoop* loop)
+{
+	if (loop == NULL || loop->epollFd < 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; ++i)
+	{
+		if (loop->sources[i].fd >= 0)
+		{
+			removeEventSource(loop, loop->sources[i].fd);
+		}
+	}
+	close(loop->epollFd);
+	loop->epollFd = -1;
+}
+
+
+/* ======================================
+ * Single producer, single consumer rings
+ * ===================================== */
+
+/* =================================================
+ * This function prepares an empty ring for items of
+ * the given size, along with the eventfd written by
+ * every push so that the consumer can sleep on it.
+ *
+ * @param: SpscRing*, size_t size of an item (at most SPSC_RING_ITEM_SIZE)
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+int initSpscRing(SpscRing* ring, size_t itemSize)
+{
+	if (ring == NULL || itemSize == 0 || itemSize > SPSC_RING_ITEM_SIZE)
+	{
+		return -1;
+	}
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->itemSize = itemSize;
+	ring->dropped = 0;
+	ring->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return (ring->wakeFd >= 0) ? 0 : -1;
+}
+
+/* =================================================
+ * This function copies an item into the ring and
+ * wakes the consumer.  It must only be called by the
+ * producer thread of the ring.
+ *
+ * @param: SpscRing*, void* item
+ * @return: 0 = successful execution, -1 = the ring is full (the item is dropped)
+ * ============================================== */
+
+int pushSpscRing(SpscRing* ring, const void* item)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= SPSC_RING_SLOTS)
+	{
+		ring->dropped++;
+		return -1;
+	}
+
+	memcpy(ring->items[tail & (SPSC_RING_SLOTS - 1)], item, ring->itemSize);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	uint64_t one = 1;
+	write(ring->wakeFd, &one, sizeof(one));
+	return 0;
+}
+
+/* =================================================
+ * This function takes the oldest item out of the
+ * ring.  It must only be called by the consumer
+ * thread of the ring.
+ *
+ * @param: SpscRing*, void* item
+ * @return: 1 = an item was copied, 0 = the ring is empty
+ * ============================================== */
+
+int popSpscRing(SpscRing* ring, void* item)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+	{
+		return 0;
+	}
+
+	memcpy(item, ring->items[head & (SPSC_RING_SLOTS - 1)], ring->itemSize);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 1;
+}
+
+/* =================================================
+ * This function clears the eventfd of the ring and,
+ * if nothing has been pushed since the consumer last
+ * emptied it, waits up to timeoutMs for a push (0 to
+ * not wait, -1 to wait for as long as it takes).  The
+ * consumer must then pop until the ring is empty,
+ * since the pushes made until then share one wakeup.
+ *
+ * @param: SpscRing*, int timeout (ms)
+ * @return: 1 = there may be items to pop, 0 = timed out
+ * ============================================== */
+
+int waitSpscRing(SpscRing* ring, int timeoutMs)
+{
+	uint64_t pushes;
+	if (read(ring->wakeFd, &pushes, sizeof(pushes)) == sizeof(pushes))
+	{
+		return 1;
+	}
+	if (atomic_load_explicit(&ring->head, memory_order_relaxed) != atomic_load_explicit(&ring->tail, memory_order_acquire))
+	{
+		return 1;
+	}
+	if (timeoutMs == 0)
+	{
+		return 0;
+	}
+
+	struct pollfd wake = { ring->wakeFd, POLLIN, 0 };
+	if (poll(&wake, 1, timeoutMs) <= 0)
+	{
+		return 0;
+	}
+	read(ring->wakeFd, &pushes, sizeof(pushes));
+	return 1;
+}
+
+/* =================================================
+ * This function closes the eventfd of the ring.
+ * Neither of its threads may use it afterwards.
+ *
+ * @param: SpscRing*
+ * @return: void
+ * ============================================== */
+
+void freeSpscRing(SpscRing* ring)
+{
+	if (ring != NULL && ring->wakeFd >= 0)
+	{
+		close(ring->wakeFd);
+		ring->wakeFd = -1;
+	}
+}
@@ -1,6 +1,11 @@
 #ifndef PI_LOCK
 #define PI_LOCK
 
+// accept4(), fallocate(), SCHED_IDLE and environ are GNU extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 /* =================================================
  * Authors: Kyle Pinto, Hemit Shah, Efaz Shikder
  * Date: December 03, 2018.
@@ -41,6 +46,34 @@
 #include <time.h> // time_t and time()
 #include <sys/time.h> // getTimeOfDay()
 
+#include <errno.h> // errno, EAGAIN
+#include <string.h> // strrchr(), strncpy()
+#include <poll.h> // poll()
+#include <sys/stat.h> // stat()
+#include <sys/vfs.h> // statfs()
+#include <sys/inotify.h> // inotify_init1(), inotify_add_watch()
+#include <sys/timerfd.h> // timerfd_create(), timerfd_settime()
+#include <sys/eventfd.h> // eventfd()
+#include <pthread.h> // pthread_create(), pthread_join()
+#include <stdatomic.h> // atomic_size_t, atomic_load_explicit()
+#include <signal.h> // sigaction(), sig_atomic_t
+#include <endian.h> // htobe64(), be64toh()
+#include <netdb.h> // getaddrinfo()
+#include <arpa/inet.h> // htons(), htonl()
+#include <netinet/in.h> // struct sockaddr_in
+#include <sys/socket.h> // socket(), sendto(), recvfrom()
+#include <sys/epoll.h> // epoll_create1(), epoll_wait()
+#include <sys/syscall.h> // SYS_memfd_create
+#include <sys/signalfd.h> // signalfd()
+#include <stddef.h> // offsetof()
+#include <limits.h> // INT_MAX
+#include <ctype.h> // isalnum()
+#include <dirent.h> // opendir(), readdir()
+#include <spawn.h> // posix_spawnp()
+#include <sched.h> // SCHED_IDLE
+#include <sys/wait.h> // waitpid()
+#include <sys/uio.h> // writev()
+
 // Define default GPIO variables
 #define GPIO_BASE 0x0
 #define GPIO_LEN  0xB4
@@ -51,10 +84,19 @@
 #define GPLEV(_x)  (13 + _x)
 
 // Define macro used to pring logging messages to the log file
-#define PRINT_MSG(file, time, programName, outputStr)                   \
+// The message is queued on the logger and written to the file by its writer thread
+#define PRINT_MSG(logger, outputStr)                                    \
+	do                                                                  \
+	{                                                                   \
+		logMessage(logger, outputStr);                                  \
+	} while (0)
+
+// Define macro used for messages printed on every loop (e.g. watchdog kicks)
+// Repeats are folded into one summary line per LOG_SUMMARY_INTERVAL seconds
+#define PRINT_REPEATED_MSG(logger, outputStr)                           \
 	do                                                                  \
 	{                                                                   \
-		fprintf(logFile, "%s : %s : %s", time, programName, outputStr); \
+		logMessageFlags(logger, outputStr, LOG_COALESCE);               \
 	} while (0)
 
 // Define the default file paths and default variable values for values stored in the configuration file
@@ -64,9 +106,47 @@
 #define LOCK_LOG_FILE_PATH "/home/pi/raspShare/locklogFile.log"
 #define DEFAULT_LOCK_STATE 0
 #define DEFAULT_TIMEOUT 15
+#define DEFAULT_LOG_FLUSH_INTERVAL 1000
+#define DEFAULT_LOG_SUMMARY_INTERVAL 10
+#define DEFAULT_LOG_SEGMENT_SIZE 1024	// Kilobytes
+#define DEFAULT_LOG_SEGMENT_COUNT 8
+#define DEFAULT_LOG_COMPRESS 1
+#define SHM_FILE_PATH "/dev/shm/piLockComm"
+#define STATE_FILE_PATH "/home/pi/piLockState.bin"	// Local to the lock, not on the share
+#define DEFAULT_LOCK_ADDRESS "127.0.0.1"
+#define DEFAULT_COMM_PORT 5005
+#define DEFAULT_COMM_BIND_ADDRESS "0.0.0.0"
+#define COMM_SECRET_LENGTH 128		// Longest COMM_SECRET, plus its terminating NUL
+#define DEFAULT_DEBOUNCE_TIME 20
+#define DEFAULT_COALESCE_WINDOW 1000	// Milliseconds
+#define MAX_LOCKS 512				// Most LOCK_ADDRESS entries a single key can control
+#define LOCK_ADDRESS_LENGTH 64		// Longest "host:port" entry of LOCK_ADDRESS
+
+// Define the communication file watcher modes and the polling period used when inotify cannot see remote writes
+#define COMM_WATCH_INOTIFY 0
+#define COMM_WATCH_TIMER 1
+#define COMM_POLL_INTERVAL_MS 250
 
 typedef uint32_t* GPIO_Handle;
-// Imported GPIO Functions
+
+// GPIO backends: "mmap" maps the registers of the Pi, "sim" simulates them in memory with scripted inputs
+#define GPIO_BACKEND_MMAP 0
+#define GPIO_BACKEND_SIM 1
+#define GPIO_SIM_MAX_EVENTS 4096		// Most lines of a simulated input waveform
+
+typedef struct GpioBackend
+{
+	const char* name;
+	GPIO_Handle (*init)(void);
+	void (*free)(GPIO_Handle handle);
+	void (*writeReg)(GPIO_Handle handle, uint32_t offst, uint32_t data);
+	uint32_t (*readReg)(GPIO_Handle handle, uint32_t offst);
+} GpioBackend;
+
+int selectGpioBackend(int backend, const char* waveformPath);
+const char* gpioBackendName(void);
+
+// Imported GPIO Functions (they go through the selected backend)
 GPIO_Handle gpiolib_init_gpio(void);
 void        gpiolib_free_gpio(GPIO_Handle handle);
 void        gpiolib_write_reg(GPIO_Handle handle,uint32_t offst, uint32_t data);
@@ -80,17 +160,573 @@ int writePin(GPIO_Handle gpio, int pinNumber, int state);
 int readPin(GPIO_Handle gpio, int pinNumber);
 int freeGPIO(GPIO_Handle gpio);
 
+// GPIO functions working on several pins at once: bit N of a mask is pin N, and each bank is accessed once
+#define PIN_MASK(_pin) (1ULL << (_pin))
+int setPins(GPIO_Handle gpio, uint64_t mask);
+int clearPins(GPIO_Handle gpio, uint64_t mask);
+int writePins(GPIO_Handle gpio, uint64_t setMask, uint64_t clearMask);
+uint64_t readPins(GPIO_Handle gpio, uint64_t mask);
+
+// Pin accessors for pins known at compile time.  The pin number is checked by the compiler and the bank, register
+// offset and bit are constants.  While the mmap backend is selected every access is a single load or store of the
+// register with no other checks; any other backend (the sim backend has to see every access) is reached through
+// gpiolib_write_reg() and gpiolib_read_reg(), so GPIO_BACKEND is still chosen when the program starts
+extern int gpioRegistersMapped;		// 1 while the mmap backend is selected
+#define PIN_REG_WRITE(gpio, offst, data) (gpioRegistersMapped ? (void) (((volatile uint32_t*) (gpio))[offst] = (data)) : gpiolib_write_reg(gpio, offst, data))
+#define PIN_REG_READ(gpio, offst) (gpioRegistersMapped ? ((volatile uint32_t*) (gpio))[offst] : gpiolib_read_reg(gpio, offst))
+
+#define PIN_CHECKED(_pin) ((_pin) + 0 * sizeof(struct { _Static_assert((_pin) >= 0 && (_pin) <= 53, "GPIO pin out of range [0 - 53]"); int valid; }))
+#define PIN_BANK(_pin) (PIN_CHECKED(_pin) / 32)
+#define PIN_BIT(_pin) (1U << ((_pin) % 32))
+
+#define PIN_SET(gpio, _pin) PIN_REG_WRITE(gpio, GPSET(PIN_BANK(_pin)), PIN_BIT(_pin))
+#define PIN_CLEAR(gpio, _pin) PIN_REG_WRITE(gpio, GPCLR(PIN_BANK(_pin)), PIN_BIT(_pin))
+#define PIN_WRITE(gpio, _pin, state) PIN_REG_WRITE(gpio, (state) ? GPSET(PIN_BANK(_pin)) : GPCLR(PIN_BANK(_pin)), PIN_BIT(_pin))
+#define PIN_READ(gpio, _pin) ((PIN_REG_READ(gpio, GPLEV(PIN_BANK(_pin))) >> ((_pin) % 32)) & 1)
+
+// Debouncer for input pins, integrating every monitored pin at once from a single read of the level registers
+#define DEBOUNCE_COUNTER_BITS 16		// Bit planes of the vertical counters (debounce times below 32768 ms)
+#define DEBOUNCE_POLL_INTERVAL_MS 10	// Sampling period of the debouncer when the pins cannot report their edges
+
+typedef struct Debouncer
+{
+	uint64_t mask;									// Pins being debounced (bit N = pin N)
+	uint64_t levels;								// Debounced levels of the pins
+	uint64_t counter[DEBOUNCE_COUNTER_BITS];		// Milliseconds each pin has disagreed with its debounced level, one bit plane per entry
+	uint32_t threshold;								// Milliseconds a new level must last to be accepted
+	uint64_t lastSample;							// CLOCK_MONOTONIC of the last sample, in nanoseconds
+} Debouncer;
+
+int initDebouncer(Debouncer* debouncer, GPIO_Handle gpio, uint64_t pinMask, int debounceTime);
+uint64_t updateDebouncer(Debouncer* debouncer, GPIO_Handle gpio);
+int readDebouncedPin(const Debouncer* debouncer, int pinNumber);
+
 // Logging specific functions used to determine the time and program name
 void getTime(char* buffer);
+void formatTime(const struct timespec* time, char* buffer);
+uint64_t monotonicNanoseconds(void);
 int findLength(const char* fileName);
 void copyProgramName(char* programName, const char* fileName);
 
-// Config file reading specific functions used to compare and store parameter names while parsing the data
+// Values read from the configuration file
+typedef struct LockConfig
+{
+	int timeout;					// Watchdog timout
+	int lockState;					// Initial lock state (1 for locked, 0 for unlocked)
+	char commFilePath[255];			// File path to the communication file shared between Pis
+	char lockLogFilePath[255];		// File path to the log file for the lock mechanism
+	char keyLogFilePath[255];		// File path to the log file for the remote access key
+	int logFlushInterval;			// Milliseconds between logger flushes to the log file
+	int logSummaryInterval;			// Seconds between summaries of repeated log messages
+	int logSegmentSize;				// Kilobytes after which the log file is rotated (0 = never)
+	int logSegmentCount;			// Rotated log segments kept
+	int logCompress;				// 1 to gzip the rotated log segments
+	int logFormat;					// LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+	int commTransport;				// COMM_TRANSPORT_FILE or COMM_TRANSPORT_SHM
+	char shmFilePath[255];			// File path to the shared memory record used by the shm transport
+	char stateFilePath[255];		// File path to the snapshot of the lock state kept across restarts
+	int commPort;					// UDP and TCP port the lock listens on with the udp transport
+	char commBindAddress[16];		// IPv4 address the lock listens on with the udp transport
+	char commSecret[COMM_SECRET_LENGTH];	// Shared secret that authenticates the udp transport ("" = every packet is refused)
+	int lockCount;					// Number of LOCK_ADDRESS entries
+	char lockAddresses[MAX_LOCKS][LOCK_ADDRESS_LENGTH];	// "host" or "host:port" of every lock controlled by the key (udp transport)
+	int debounceTime;				// Milliseconds the button and photodiode must be steady before a change is accepted
+	int coalesceWindow;				// Milliseconds after a command is applied during which newer commands to lock are coalesced (0 = never),
+									// commands to unlock are always applied right away
+	int gpioBackend;				// GPIO_BACKEND_MMAP or GPIO_BACKEND_SIM
+	char gpioWaveformPath[255];		// Input waveform played by the sim GPIO backend
+} LockConfig;
+
+// String helpers, and the config file loader: the file is mapped and parsed in a single pass, with every
+// parameter name found by a binary search of a sorted table that gives the type and location of its value
 int strCompare(const char* compare, const char* source);
 void strCopy(char* dest, const char* source);
-void readConfig(FILE* config, int* timeout, int* lockState, char* commFilePath, char* lockLogFilePath, char* keyLogFilePath);
+void setDefaultConfig(LockConfig* settings);
+int parseConfig(const char* text, size_t length, LockConfig* settings);
+int loadConfig(const char* path, LockConfig* settings);
 
 // Communication file reading specific funciton
-int readCommunicationFile(char *commFilePath);
+int readCommunicationFile(char *commFilePath, uint32_t* traceId);
+int writeCommunicationFile(char *commFilePath, int command, uint32_t traceId);
+
+// Transports that can carry the commands between the key and the lock
+#define COMM_TRANSPORT_FILE 0
+#define COMM_TRANSPORT_SHM 1
+#define COMM_TRANSPORT_UDP 2
+
+// Which end of the transport is opened
+#define COMM_ROLE_LOCK 0
+#define COMM_ROLE_KEY 1
+
+// Communication file watcher used to only re-read the communication file once it has changed
+typedef struct CommWatcher
+{
+	int fd;						// inotify descriptor or timerfd descriptor depending on the mode
+	int mode;					// COMM_WATCH_INOTIFY or COMM_WATCH_TIMER
+	char commFilePath[255];		// Full path of the watched communication file
+	char fileName[255];			// Name of the communication file inside of its directory
+	struct stat lastStat;		// Last observed status of the file (timer mode only)
+} CommWatcher;
+
+int initCommWatcher(CommWatcher* watcher, const char* commFilePath);
+int commFileChanged(CommWatcher* watcher);
+int waitCommFileChange(CommWatcher* watcher, int timeoutMs);
+void freeCommWatcher(CommWatcher* watcher);
+
+// Shared memory record used by the shm transport, read with a seqlock so polling it needs no system call
+#define COMM_SHM_MAGIC 0x504C434B			// "PLCK"
+#define COMM_SHM_INITIALIZING 0x494E4954	// "INIT"
+
+typedef struct CommRecord
+{
+	_Atomic uint32_t magic;			// COMM_SHM_MAGIC once the record has been set up
+	_Atomic uint32_t sequence;		// Odd while a writer is updating the record
+	_Atomic int32_t command;		// 1 = lock, 0 = unlock
+	_Atomic uint64_t writeTime;		// CLOCK_REALTIME of the last write, in nanoseconds
+	_Atomic uint32_t traceId;		// Trace ID of the command
+} CommRecord;
+
+// Command protocol used by the udp transport: the key sends sequence numbered commands, the lock
+// acknowledges each one with its actual state and reports later state changes on its own. Every packet
+// carries an HMAC-SHA256 of its fields keyed with COMM_SECRET, and packets that fail it are dropped
+#define COMM_PACKET_MAGIC 0x504C		// "PL"
+#define COMM_PACKET_COMMAND 1
+#define COMM_PACKET_ACK 2
+#define COMM_PACKET_STATE 3
+#define COMM_MAC_LENGTH 16				// Bytes of the HMAC-SHA256 kept in every packet
+
+#define COMM_UDP_RETRANSMIT_MS 50		// First retransmission timeout, doubled after every retry
+#define COMM_UDP_RETRIES 4				// Retransmissions over UDP before falling back to TCP
+#define COMM_TCP_TIMEOUT_MS 500			// Time allowed for the TCP connection and for its reply
+#define COMM_TCP_CONNECTIONS 4			// TCP fallback connections the lock reads at the same time
+#define COMM_REPLAY_WINDOW_MS 30000		// Commands sent longer ago than this (CLOCK_REALTIME of both Pis) are refused
+#define COMM_SHM_POLL_MS 5				// The shared memory record has no descriptor to wait on, it is checked this often
+
+// Actual state of the lock as reported to the key
+#define COMM_STATE_UNKNOWN 0
+#define COMM_STATE_UNLOCKED 1
+#define COMM_STATE_LOCKED 2
+#define COMM_STATE_WAITING_TO_LOCK 3
+
+// Path taken by the last command of the key when UDP was not acknowledged
+#define COMM_FALLBACK_NONE 0
+#define COMM_FALLBACK_TCP 1
+#define COMM_FALLBACK_FILE 2
+
+typedef struct __attribute__((packed)) CommPacket
+{
+	uint16_t magic;					// COMM_PACKET_MAGIC
+	uint8_t type;					// COMM_PACKET_COMMAND, COMM_PACKET_ACK or COMM_PACKET_STATE
+	uint8_t command;				// 1 = lock, 0 = unlock
+	uint8_t lockState;				// COMM_STATE_ value (acknowledgements and state reports)
+	uint8_t reserved[3];
+	uint32_t session;				// Random number picked by the key when it starts
+	uint32_t sequence;				// Increased by the key for every new command
+	uint64_t sendTime;				// CLOCK_REALTIME of the key press, in nanoseconds
+	uint32_t traceId;				// Trace ID of the command, echoed in its acknowledgement
+	uint8_t mac[COMM_MAC_LENGTH];	// HMAC-SHA256 of the fields above keyed with COMM_SECRET, truncated
+} CommPacket;
+
+// TCP fallback connection, read or written without blocking as its socket becomes ready
+typedef struct CommConnection
+{
+	int fd;							// -1 if the slot is free
+	int sent;						// Key: 1 once the command has been sent
+	size_t received;				// Bytes of the packet received so far
+	uint64_t deadline;				// CLOCK_MONOTONIC after which the connection is given up, in nanoseconds
+	CommPacket packet;
+} CommConnection;
+
+typedef struct CommTransport
+{
+	int type;						// COMM_TRANSPORT_FILE, COMM_TRANSPORT_SHM or COMM_TRANSPORT_UDP
+	int role;						// COMM_ROLE_LOCK or COMM_ROLE_KEY
+	int command;					// Last command sent or received
+	uint64_t writeTime;				// Time the last received command was written (shm only, 0 if unknown)
+	uint32_t traceId;				// Trace ID of the last command sent or received (0 if unknown)
+	char path[255];					// Communication file or shared memory file
+	CommWatcher watcher;			// File transport, and fallback of the lock for the udp transport
+	CommRecord* record;				// Shared memory transport only
+	uint32_t lastSequence;			// Sequence number of the last record read
+	int pollTimerFd;				// Event loop timer polling the shared memory record (-1 if none)
+
+	// udp transport only
+	int socketFd;					// UDP socket
+	int listenFd;					// TCP fallback listening socket (lock only)
+	char secret[COMM_SECRET_LENGTH];	// COMM_SECRET, "" if none
+	CommConnection connections[COMM_TCP_CONNECTIONS];	// Lock: accepted TCP connections. Key: [0] is the TCP fallback
+	struct EventLoop* loop;			// Lock: event loop the accepted connections are added to (NULL if none)
+	int connectionTimerFd;			// Lock: event loop timer that runs while connections are open (-1 if none)
+	int epollFd;					// Key: epoll instance the TCP fallback is added to (-1 if none)
+	void* epollData;				// Key: data of the TCP fallback in that epoll instance
+	unsigned long refused;			// Packets dropped because they failed authentication or were replayed
+	struct sockaddr_storage peer;	// Key: the lock. Lock: the last key that sent a command
+	socklen_t peerLength;
+	uint32_t session;				// Key: session of this run. Lock: session of the last command applied
+	uint32_t sequence;				// Key: last sequence number sent. Lock: last sequence number applied
+	uint64_t sendTime;				// CLOCK_REALTIME of the last command, in nanoseconds
+	uint64_t openTime;				// Lock: CLOCK_REALTIME when the transport was opened, commands sent before it are refused
+	int lockState;					// Actual state of the lock (COMM_STATE_ value)
+	int localChange;				// Lock: a command was given with the button on the lock
+	int pending;					// Key: 1 while the last command has not been acknowledged
+	int retries;					// Key: retransmissions of the pending command so far
+	int retransmitTimeout;			// Key: current retransmission timeout, in milliseconds
+	int fallback;					// Key: COMM_FALLBACK_ value used by the last command
+	uint64_t firstSendTime;			// Key: CLOCK_MONOTONIC of the first transmission, in nanoseconds
+	uint64_t deadline;				// Key: CLOCK_MONOTONIC of the next retransmission, in nanoseconds
+	uint64_t ackLatency;			// Key: nanoseconds between sending the last command and its acknowledgement
+} CommTransport;
+
+int openCommTransport(CommTransport* transport, const LockConfig* settings, int role);
+int pollCommTransport(CommTransport* transport);
+int writeCommTransport(CommTransport* transport, int command);
+int writeTracedCommand(CommTransport* transport, int command, uint32_t traceId);
+uint32_t newTraceId(void);
+void setCommLockState(CommTransport* transport, int state);
+const char* commStateName(int state);
+int getCommTransportFds(const CommTransport* transport, struct pollfd* fds, int maxFds);
+void closeCommTransport(CommTransport* transport);
+
+// Asynchronous logger: messages are queued in a lock-free ring and written in batches by a writer thread
+#define LOG_RING_SIZE 1024			// Number of queued messages, must be a power of two
+#define LOG_MESSAGE_LENGTH 256		// Longest message that can be queued
+#define LOG_BATCH_SIZE 16384		// Bytes formatted before a single write() to the log file
+#define LOG_COALESCE_SLOTS 8		// Number of distinct repeated messages that can be summarized at once
+#define LOG_COALESCE 1				// Message flag: fold repeats of this message into a periodic summary
+
+// Binary log format (LOG_FORMAT = binary): every message becomes 16 byte records instead of a text line. A message
+// of auditMessages[] takes a single record, a TRACE line two, and any other message a record followed by its text.
+// The records are written in blocks, each starting with a header that holds the CRC-32 of its records, and every
+// batch is made durable with a single fdatasync() (group commit). auditDecode prints them back as text lines.
+// Records are in the byte order of the Pi (little endian). Codes are never reused: new messages go at the end
+#define LOG_FORMAT_TEXT 0
+#define LOG_FORMAT_BINARY 1
+#define AUDIT_BLOCK_MAGIC 0x4b4c5041	// "APLK"
+#define AUDIT_BLOCK_RECORDS 64			// Most records in one block
+#define AUDIT_EVENT_TEXT 0				// Any message: length bytes of text follow, in as many records as needed
+#define AUDIT_EVENT_PROGRAM 1			// Name of the program, as text, at the start of every log file it opens
+#define AUDIT_EVENT_TRACE 2				// logTrace() line: argument = trace ID, length = stage, then a record with both clocks
+#define AUDIT_EVENT_MESSAGE 16			// auditMessages[event - AUDIT_EVENT_MESSAGE]
+
+typedef struct AuditRecord
+{
+	uint64_t time;					// CLOCK_REALTIME of the message, in microseconds
+	uint16_t event;					// AUDIT_EVENT_ code
+	uint16_t length;				// AUDIT_EVENT_TEXT and AUDIT_EVENT_PROGRAM: bytes of text. AUDIT_EVENT_TRACE: index of the stage
+	uint32_t argument;				// AUDIT_EVENT_TRACE: trace ID
+} AuditRecord;
+
+typedef struct AuditBlockHeader
+{
+	uint32_t magic;					// AUDIT_BLOCK_MAGIC
+	uint16_t records;				// Records that follow the header
+	uint16_t version;				// 1
+	uint32_t sequence;				// Blocks written before this one since the log file was opened
+	uint32_t crc;					// CRC-32 of the records
+} AuditBlockHeader;
+
+extern const char* const auditMessages[];
+extern const int auditMessageCount;
+extern const char* const auditTraceStages[];
+extern const int auditTraceStageCount;
+uint32_t crc32(uint32_t crc, const void* data, size_t length);
+
+typedef struct LogEntry
+{
+	atomic_size_t sequence;			// Ring slot sequence number used to hand the slot between producer and writer
+	struct timespec time;			// Time at which the message was queued
+	int flags;						// LOG_COALESCE or 0
+	char message[LOG_MESSAGE_LENGTH];
+} LogEntry;
+
+typedef struct LogSummary
+{
+	int active;						// 1 while the slot is counting repeats of its message
+	unsigned long count;			// Repeats seen since windowStart
+	long maxGap;					// Longest time between two repeats, in milliseconds
+	struct timespec windowStart;	// Start of the current summary interval
+	struct timespec last;			// Time of the last repeat
+	char message[LOG_MESSAGE_LENGTH];
+} LogSummary;
+
+typedef struct Logger
+{
+	LogEntry entries[LOG_RING_SIZE];
+	atomic_size_t head;				// Next slot claimed by a producer
+	atomic_size_t tail;				// Next slot read by the writer thread
+	atomic_size_t written;			// Ring position up to which messages have been written to the log file
+	atomic_size_t dropped;			// Number of messages lost because the ring was full
+	atomic_int running;				// Cleared to ask the writer thread to drain the ring and exit
+	int fd;							// Log file, kept open for the lifetime of the logger
+	int wakeFd;						// eventfd used to wake the writer thread before its flush interval
+	atomic_int flushInterval;		// Milliseconds between flushes, may be changed by reopenLogger() while the writer thread runs
+	int created;					// 1 if the log file did not exist before initLogger()
+	char programName[64];
+	pthread_t writer;
+	atomic_int summaryInterval;		// Seconds covered by each summary of a repeated message, may also be changed while it runs
+	LogSummary summaries[LOG_COALESCE_SLOTS];	// Repeated messages being counted, only used by the writer thread
+	atomic_ulong heartbeat;			// Passes of the writer thread, watched by the watchdog supervisor
+
+	// Rotation, see setLogRotation()
+	pthread_mutex_t fileLock;		// Held by the writer thread while it writes or rotates, and by reopenLogger()
+	char path[255];					// Log file, i.e. the active segment
+	off_t segmentBytes;				// Bytes in the active segment
+	off_t segmentSize;				// Bytes after which the active segment is rotated, 0 = never
+	int segmentCount;				// Rotated segments kept
+	int compress;					// 1 to gzip the rotated segments
+	unsigned long oldestSegment;	// Rotated segments are "<path>.<oldestSegment>" to "<path>.<newestSegment>",
+	unsigned long newestSegment;	// there is none while oldestSegment > newestSegment
+	unsigned long rotations;
+	int compressFd;					// eventfd used to wake the compressor thread
+	pthread_t compressor;
+
+	// Binary log format
+	int format;						// LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+	uint32_t blockSequence;			// Blocks written since the log file was opened
+	int unsynced;					// 1 once records have been written since the last fdatasync()
+	size_t blockStart;				// Offset in the batch of the block being filled, LOG_BATCH_SIZE if none
+	int blockRecords;				// Records in that block so far
+} Logger;
+
+int initLogger(Logger* logger, const char* logFilePath, const char* programName, int flushInterval, int summaryInterval, int format);
+void logMessage(Logger* logger, const char* message);
+void logMessageFlags(Logger* logger, const char* message, int flags);
+
+// Trace lines "TRACE <trace ID> <stage> <CLOCK_REALTIME ns> <CLOCK_MONOTONIC ns>", joined across the key and lock logs by traceReport
+void logTrace(Logger* logger, uint32_t traceId, const char* stage, uint64_t monotonicTime);
+int flushLogger(Logger* logger);
+int reopenLogger(Logger* logger, const char* logFilePath, int flushInterval, int summaryInterval);
+
+// Log rotation: the log file is preallocated to segmentSize kilobytes and, once full, renamed to "<log file>.<N>" by the
+// writer thread (N counts up). Only the segmentCount newest of them are kept and, if compress is set, a thread running at
+// idle CPU and I/O priority gzips them
+int setLogRotation(Logger* logger, int segmentSize, int segmentCount, int compress);
+void closeLogger(Logger* logger);
+
+// Set when SIGTERM or SIGINT is received so the main loop can shut down and flush the logger
+extern volatile sig_atomic_t stopRequested;
+
+// Set when SIGHUP is received so the main loop reloads the configuration file
+extern volatile sig_atomic_t reloadRequested;
+
+// Fleet of locks controlled by a single key, all polled from one epoll instance
+typedef struct FleetLock
+{
+	char name[LOCK_ADDRESS_LENGTH];	// LOCK_ADDRESS of the lock
+	CommTransport transport;
+	int completed;					// 1 if the last reply finished the pending command (acknowledged or fallen back)
+	unsigned long commands;			// Commands sent to the lock
+	unsigned long acks;				// Commands acknowledged by the lock
+	unsigned long failures;			// Commands that had to fall back to the communication file
+	uint64_t ackLatencyTotal;		// Sum of the acknowledgement latencies, in nanoseconds
+	uint64_t ackLatencyMax;			// Longest acknowledgement latency, in nanoseconds
+} FleetLock;
+
+typedef struct LockFleet
+{
+	FleetLock* locks;
+	int count;						// Number of locks
+	int command;					// Last command sent to the fleet
+	int outstanding;				// Locks that have not acknowledged the last command yet
+	uint64_t sendTime;				// CLOCK_MONOTONIC of the last command sent, in nanoseconds
+	uint32_t traceId;				// Trace ID shared by every lock for the last command
+	int epollFd;
+	int timerFd;					// Retransmission timer, armed while a command is outstanding
+} LockFleet;
+
+int openLockFleet(LockFleet* fleet, const LockConfig* settings);
+int sendFleetCommand(LockFleet* fleet, int command);
+int pollLockFleet(LockFleet* fleet, int timeoutMs, void (*onReply)(LockFleet*, FleetLock*, void*), void* argument);
+void closeLockFleet(LockFleet* fleet);
+
+// Table driven state machines: each row moves the machine from one state to another when an event arrives,
+// running an optional action first.  The hook is called after every transition, once the action is done
+typedef struct StateMachine StateMachine;
+
+typedef struct StateTransition
+{
+	int from;						// State the transition starts from
+	int event;						// Event that triggers it
+	int to;							// State the machine is in afterwards
+	void (*action)(void* context);	// Run before the state changes, NULL for none
+} StateTransition;
+
+struct StateMachine
+{
+	const StateTransition* table;
+	int count;						// Rows of the table
+	int state;						// Current state
+	uint64_t enteredAt;				// CLOCK_MONOTONIC when the current state was entered (after its action), in nanoseconds
+	unsigned long transitions;		// Transitions taken so far
+	void* context;					// Passed to the actions and available to the hook
+	void (*onTransition)(StateMachine* machine, const StateTransition* transition, uint64_t eventTime);
+};
+
+int initStateMachine(StateMachine* machine, const StateTransition* table, int count, int initialState, void* context);
+int fireStateEvent(StateMachine* machine, int event, uint64_t eventTime);
+
+// Button machine shared by the key and the lock: a command is given when the button is released
+enum ButtonState
+{
+	BUTTON_START,
+	BUTTON_PRESSED,
+	BUTTON_UNPRESSED
+};
+
+enum ButtonEvent
+{
+	EVENT_BUTTON_DOWN,
+	EVENT_BUTTON_UP
+};
+
+#define BUTTON_TRANSITIONS 4
+int initButtonMachine(StateMachine* machine, StateTransition table[BUTTON_TRANSITIONS], void (*onRelease)(void* context), void* context);
+
+// Lock state snapshot: the last command, the state of the lock machine and the position of the servo, kept in a small file
+// so that the lock resumes where it was after a restart without moving the servo. The file holds two slots written in turn
+// through O_DSYNC, each checked by a CRC-32, so a write cut short by a power loss can only damage the older of the two
+#define STATE_SNAPSHOT_MAGIC 0x54534C50		// "PLST"
+#define STATE_SNAPSHOT_SLOT 512				// Bytes of a slot, a single sector so that the disk writes it whole
+
+typedef struct StateSnapshot
+{
+	uint32_t magic;					// STATE_SNAPSHOT_MAGIC
+	uint32_t sequence;				// Increased by every write, the valid slot with the highest one is current
+	int32_t state;					// State of the lock machine
+	int32_t command;				// Last command applied (1 = lock, 0 = unlock)
+	uint32_t traceId;				// Trace ID of that command
+	uint32_t servoPulse;			// Pulse width the servo was last moved to, in microseconds (0 if it has not been moved)
+	uint64_t writeTime;				// CLOCK_REALTIME of the write, in nanoseconds
+	uint32_t crc;					// CRC-32 of the fields above
+	uint32_t reserved;
+} StateSnapshot;
+
+typedef struct StateSnapshotFile
+{
+	int fd;							// Opened with O_DSYNC, so every write is on the disk when it returns
+	int slot;						// Slot the next snapshot is written to
+	StateSnapshot last;				// Snapshot last read or written
+	unsigned long writes;			// Snapshots written since the file was opened
+	uint64_t writeTime;				// Nanoseconds spent in those writes
+} StateSnapshotFile;
+
+int openStateSnapshot(StateSnapshotFile* file, const char* path);
+int saveStateSnapshot(StateSnapshotFile* file, int state, int command, uint32_t traceId, uint32_t servoPulse);
+void closeStateSnapshot(StateSnapshotFile* file);
+
+// Latency histograms with power of two buckets: bucket b counts latencies from 2^b up to 2^(b+1) microseconds
+#define LATENCY_BUCKETS 32
+#define LATENCY_REPORT_INTERVAL 600		// Seconds between the latency histograms written to the log file
+
+typedef struct LatencyHistogram
+{
+	const char* name;
+	unsigned long count;
+	uint64_t total;					// Sum of the latencies, in nanoseconds
+	uint64_t max;					// Longest latency, in nanoseconds
+	uint32_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+void initLatencyHistogram(LatencyHistogram* histogram, const char* name);
+void recordLatency(LatencyHistogram* histogram, uint64_t latency);
+void logLatencyHistogram(Logger* logger, const LatencyHistogram* histogram);
+
+// Watchdog supervisor: a thread kicks /dev/watchdog from a timerfd WATCHDOG_KICK_FRACTION times per time limit, and only
+// if every subsystem registered with it has shown a heartbeat since the last kick, so that a hung subsystem resets the Pi
+#define WATCHDOG_KICK_FRACTION 3		// Kicks per watchdog time limit
+#define WATCHDOG_MAX_SOURCES 8			// Subsystems that can be watched
+
+// Called by a subsystem every time it makes progress, it only increments a counter
+#define REPORT_HEARTBEAT(_heartbeat) atomic_fetch_add_explicit(&(_heartbeat), 1, memory_order_relaxed)
+
+typedef struct WatchdogSupervisor
+{
+	int fd;							// /dev/watchdog, or -1 if there is none (the heartbeats are still checked and logged)
+	int timerFd;					// Fires at every kick
+	int stopFd;						// eventfd used to stop the thread
+	int timeout;					// Watchdog time limit, in seconds
+	int sourceCount;
+	const char* sourceNames[WATCHDOG_MAX_SOURCES];
+	atomic_ulong* sources[WATCHDOG_MAX_SOURCES];	// Heartbeat counters of the watched subsystems
+	unsigned long lastBeats[WATCHDOG_MAX_SOURCES];	// Value of every counter at the last kick
+	int wakeFds[WATCHDOG_MAX_SOURCES];	// eventfd written after every check so that an idle subsystem beats, -1 if not needed
+	Logger* logger;
+	pthread_t thread;
+	atomic_ulong kicks;				// Kicks done
+	atomic_ulong skipped;			// Kicks held back because a subsystem had no heartbeat
+} WatchdogSupervisor;
+
+int initWatchdogSupervisor(WatchdogSupervisor* supervisor, int watchdogFd, int timeout, Logger* logger);
+int addWatchdogSource(WatchdogSupervisor* supervisor, const char* name, atomic_ulong* heartbeat, int wakeFd);
+int startWatchdogSupervisor(WatchdogSupervisor* supervisor);
+int setWatchdogTimeout(WatchdogSupervisor* supervisor, int timeout);
+int heartbeatInterval(const WatchdogSupervisor* supervisor);
+void stopWatchdogSupervisor(WatchdogSupervisor* supervisor);
+
+// Event loop shared by the key and the lock: every source of wakeups (GPIO edges, sockets, inotify, timers and signals)
+// is a descriptor in one epoll instance, so the programs sleep until something actually happens
+#define EVENT_LOOP_MAX_SOURCES 24
+#define EVENT_LOOP_MAX_EVENTS 16		// Events read by a single epoll_wait()
+
+#define EVENT_SOURCE_FD 0				// Descriptor owned by the caller, which reads it
+#define EVENT_SOURCE_TIMER 1			// timerfd owned by the loop, its expirations are read before the handler is called
+#define EVENT_SOURCE_SIGNAL 2			// signalfd owned by the loop, the handler is called once per signal
+
+typedef struct EventLoop EventLoop;
+
+// value: the epoll events (EVENT_SOURCE_FD), the number of expirations (EVENT_SOURCE_TIMER) or the signal number (EVENT_SOURCE_SIGNAL)
+typedef void (*EventHandler)(EventLoop* loop, int fd, uint32_t value, void* data);
+
+typedef struct EventSource
+{
+	int fd;							// -1 if the slot is free
+	int type;						// EVENT_SOURCE_ value
+	EventHandler handler;			// May be NULL if the source only has to wake the loop up
+	void* data;
+} EventSource;
+
+struct EventLoop
+{
+	int epollFd;
+	EventSource sources[EVENT_LOOP_MAX_SOURCES];
+	unsigned long wakeups;			// epoll_wait() calls that returned at least one event
+	unsigned long dispatched;		// Events handled
+	uint64_t startTime;				// CLOCK_MONOTONIC when the loop was created, in nanoseconds
+};
+
+int initEventLoop(EventLoop* loop);
+int addEventSource(EventLoop* loop, int fd, EventHandler handler, void* data);
+int addTimerSource(EventLoop* loop, int periodMs, EventHandler handler, void* data);
+int setTimerSource(EventLoop* loop, int timerFd, int periodMs);
+int addSignalSource(EventLoop* loop, const int* signals, int count, EventHandler handler, void* data);
+int removeEventSource(EventLoop* loop, int fd);
+void handleStopOrReloadSignal(EventLoop* loop, int fd, uint32_t signalNumber, void* data);
+int addCommTransportSources(EventLoop* loop, CommTransport* transport);
+void removeCommTransportSources(EventLoop* loop, CommTransport* transport);
+int runEventLoop(EventLoop* loop, int timeoutMs);
+void logEventLoopStats(Logger* logger, const EventLoop* loop);
+void closeEventLoop(EventLoop* loop);
+
+// Single producer, single consumer rings that hand items from one thread to another (e.g. the GPIO edges to the main loop
+// of the lock, and the servo moves to its actuator thread) without a lock: only the producer writes tail and only the
+// consumer writes head. Every push also writes an eventfd, which the consumer can sleep on or add to its event loop
+#define SPSC_RING_SLOTS 64				// Items a ring can hold, must be a power of two
+#define SPSC_RING_ITEM_SIZE 64			// Largest item
+
+typedef struct SpscRing
+{
+	_Alignas(64) atomic_size_t head;	// Next slot read by the consumer
+	_Alignas(64) atomic_size_t tail;	// Next slot written by the producer
+	size_t itemSize;
+	unsigned long dropped;			// Items lost because the ring was full (producer only)
+	int wakeFd;						// eventfd written by every push
+	_Alignas(64) unsigned char items[SPSC_RING_SLOTS][SPSC_RING_ITEM_SIZE];
+} SpscRing;
+
+int initSpscRing(SpscRing* ring, size_t itemSize);
+int pushSpscRing(SpscRing* ring, const void* item);
+int popSpscRing(SpscRing* ring, void* item);
+int waitSpscRing(SpscRing* ring, int timeoutMs);
+void freeSpscRing(SpscRing* ring);
 
 #endif /* PI_LOCK */
\ No newline at end of file
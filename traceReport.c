@@ -0,0 +1,289 @@
+/* ==================================================================================
+ * traceReport: joins the TRACE lines of the key and lock log files into a latency
+ * breakdown of every command, from the press of the button to the servo moving,
+ * followed by the percentiles of every segment.
+ *
+ * Usage: ./traceReport keyLog.log lockLog.log [more log files...]
+ *
+ * Segments within one Pi are timed with CLOCK_MONOTONIC.  Segments that cross from
+ * the key to the lock are timed with CLOCK_REALTIME, so they are only as accurate
+ * as the agreement between the clocks of the two Pis (NTP).
+ * ================================================================================= */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Stages logged by logTrace(), in the order a command goes through them
+enum TraceStage
+{
+	STAGE_PRESS,		// key (or lock) button released
+	STAGE_SENT,			// key handed the command to every transport
+	STAGE_ACK,			// key received an acknowledgement (the last lock to answer is kept)
+	STAGE_OBSERVE,		// lock saw the new command
+	STAGE_DOOR,			// lock saw the door closed while waiting to lock
+	STAGE_LED,			// lock LEDs updated
+	STAGE_SERVO,		// lock servo commanded
+	STAGE_COUNT
+};
+
+static const char* stageNames[STAGE_COUNT] = { "press", "sent", "ack", "observe", "door", "led", "servo" };
+
+typedef struct TraceStamp
+{
+	int seen;
+	int file;						// Index of the log file the stage was read from
+	uint64_t realTime;				// CLOCK_REALTIME, in nanoseconds
+	uint64_t monotonicTime;			// CLOCK_MONOTONIC of the Pi that logged it, in nanoseconds
+} TraceStamp;
+
+typedef struct Trace
+{
+	uint32_t traceId;
+	TraceStamp stamps[STAGE_COUNT];
+} Trace;
+
+// Segments reported for every command
+typedef struct TraceSegment
+{
+	const char* name;
+	int from;
+	int to;
+} TraceSegment;
+
+static const TraceSegment segments[] =
+{
+	{ "press>sent", STAGE_PRESS, STAGE_SENT },
+	{ "sent>ack", STAGE_SENT, STAGE_ACK },
+	{ "sent>observe", STAGE_SENT, STAGE_OBSERVE },
+	{ "observe>led", STAGE_OBSERVE, STAGE_LED },
+	{ "observe>servo", STAGE_OBSERVE, STAGE_SERVO },
+	{ "door>servo", STAGE_DOOR, STAGE_SERVO },
+	{ "press>servo", STAGE_PRESS, STAGE_SERVO }
+};
+
+#define SEGMENT_COUNT ((int) (sizeof(segments) / sizeof(segments[0])))
+
+static Trace* traces = NULL;
+static int traceCount = 0;
+static int traceCapacity = 0;
+
+static Trace* findTrace(uint32_t traceId);
+static int readTraceFile(const char* path, int file);
+static int segmentTime(const Trace* trace, const TraceSegment* segment, double* milliseconds);
+static int compareDoubles(const void* a, const void* b);
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s keyLog.log lockLog.log [more log files...]\n", argv[0]);
+		return 1;
+	}
+
+	for (int file = 1; file < argc; ++file)
+	{
+		if (readTraceFile(argv[file], file) != 0)
+		{
+			fprintf(stderr, "Could not read %s\n", argv[file]);
+			return 1;
+		}
+	}
+
+	if (traceCount == 0)
+	{
+		printf("No TRACE lines were found\n");
+		return 0;
+	}
+
+	// Per command breakdown, in milliseconds
+	printf("%-8s", "trace");
+	for (int s = 0; s < SEGMENT_COUNT; ++s)
+	{
+		printf(" %14s", segments[s].name);
+	}
+	printf("\n");
+
+	double* samples[SEGMENT_COUNT];
+	int sampleCounts[SEGMENT_COUNT] = { 0 };
+	for (int s = 0; s < SEGMENT_COUNT; ++s)
+	{
+		samples[s] = malloc(sizeof(double) * traceCount);
+		if (samples[s] == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	}
+
+	for (int t = 0; t < traceCount; ++t)
+	{
+		printf("%08x", traces[t].traceId);
+		for (int s = 0; s < SEGMENT_COUNT; ++s)
+		{
+			double milliseconds;
+			if (segmentTime(&traces[t], &segments[s], &milliseconds))
+			{
+				printf(" %14.3f", milliseconds);
+				samples[s][sampleCounts[s]++] = milliseconds;
+			}
+			else
+			{
+				printf(" %14s", "-");
+			}
+		}
+		printf("\n");
+	}
+
+	// Nearest rank percentiles of every segment
+	printf("\n%-14s %8s %12s %12s %12s %12s\n", "segment", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (int s = 0; s < SEGMENT_COUNT; ++s)
+	{
+		int count = sampleCounts[s];
+		if (count == 0)
+		{
+			printf("%-14s %8d %12s %12s %12s %12s\n", segments[s].name, 0, "-", "-", "-", "-");
+		}
+		else
+		{
+			qsort(samples[s], count, sizeof(double), compareDoubles);
+			printf("%-14s %8d %12.3f %12.3f %12.3f %12.3f\n", segments[s].name, count,
+				samples[s][(count * 50 + 99) / 100 - 1], samples[s][(count * 90 + 99) / 100 - 1],
+				samples[s][(count * 99 + 99) / 100 - 1], samples[s][count - 1]);
+		}
+		free(samples[s]);
+	}
+
+	free(traces);
+	return 0;
+}
+
+/* =================================================
+ * This function returns the trace with the given ID,
+ * adding it if it has not been seen yet.
+ *
+ * @param: uint32_t trace ID
+ * @return: Trace*, NULL if out of memory
+ * ============================================== */
+
+static Trace* findTrace(uint32_t traceId)
+{
+	for (int t = traceCount - 1; t >= 0; --t)
+	{
+		if (traces[t].traceId == traceId)
+		{
+			return &traces[t];
+		}
+	}
+
+	if (traceCount == traceCapacity)
+	{
+		int capacity = (traceCapacity > 0) ? traceCapacity * 2 : 256;
+		Trace* grown = realloc(traces, sizeof(Trace) * capacity);
+		if (grown == NULL)
+		{
+			return NULL;
+		}
+		traces = grown;
+		traceCapacity = capacity;
+	}
+
+	Trace* trace = &traces[traceCount++];
+	memset(trace, 0, sizeof(Trace));
+	trace->traceId = traceId;
+	return trace;
+}
+
+/* =================================================
+ * This function reads every TRACE line of a log
+ * file.  Lines of commands that were not traced
+ * (trace ID 0) and unknown stages are skipped.
+ *
+ * @param: char* path, int index of the file
+ * @return: 0 = successful execution, -1 = error
+ * ============================================== */
+
+static int readTraceFile(const char* path, int file)
+{
+	FILE* log = fopen(path, "r");
+	if (log == NULL)
+	{
+		return -1;
+	}
+
+	char line[512];
+	while (fgets(line, sizeof(line), log) != NULL)
+	{
+		char* start = strstr(line, "TRACE ");
+		unsigned int traceId;
+		char stage[32];
+		unsigned long long realTime, monotonicTime;
+
+		if (start == NULL || sscanf(start, "TRACE %x %31s %llu %llu", &traceId, stage, &realTime, &monotonicTime) != 4 || traceId == 0)
+		{
+			continue;
+		}
+
+		for (int s = 0; s < STAGE_COUNT; ++s)
+		{
+			if (strcmp(stage, stageNames[s]) == 0)
+			{
+				Trace* trace = findTrace(traceId);
+				if (trace == NULL)
+				{
+					fclose(log);
+					return -1;
+				}
+
+				// A later line of the same stage replaces the earlier one (e.g. the last lock of a fleet to acknowledge)
+				trace->stamps[s].seen = 1;
+				trace->stamps[s].file = file;
+				trace->stamps[s].realTime = realTime;
+				trace->stamps[s].monotonicTime = monotonicTime;
+				break;
+			}
+		}
+	}
+
+	fclose(log);
+	return 0;
+}
+
+/* =================================================
+ * This function computes the time of one segment of
+ * a trace.  Both stages must have been seen.  The
+ * monotonic clock is used if they come from the same
+ * log file, the real time clock otherwise.
+ *
+ * @param: Trace*, TraceSegment*, double* milliseconds
+ * @return: 1 = time computed, 0 = a stage is missing
+ * ============================================== */
+
+static int segmentTime(const Trace* trace, const TraceSegment* segment, double* milliseconds)
+{
+	const TraceStamp* from = &trace->stamps[segment->from];
+	const TraceStamp* to = &trace->stamps[segment->to];
+
+	if (!from->seen || !to->seen)
+	{
+		return 0;
+	}
+
+	if (from->file == to->file)
+	{
+		*milliseconds = ((double) to->monotonicTime - (double) from->monotonicTime) / 1000000.0;
+	}
+	else
+	{
+		*milliseconds = ((double) to->realTime - (double) from->realTime) / 1000000.0;
+	}
+	return 1;
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return (x > y) - (x < y);
+}